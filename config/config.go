@@ -53,6 +53,10 @@ const (
 
 	DefaultNGpuLayers = -1
 
+	DefaultCacheDiskMiB = 16384
+	DefaultSessionTTL   = 1800
+	DefaultSessionMax   = 256
+
 	EXT = ".gguf" // TODO:We will soon release our better format
 )
 
@@ -216,6 +220,101 @@ var (
 		Destination: &Conf.NoPrune,
 	}
 
+	// The flags below configure the server of the core, which reads them from its environment
+
+	CacheDiskDir = &cli.StringFlag{
+		Name:        "cache-disk-dir",
+		Usage:       "Directory of the disk tier of the prompt cache, the states evicted from RAM are spilled there (default: disabled)",
+		EnvVars:     []string{"LLAMA_SERVER_CACHE_DISK_DIR"},
+		Destination: &Conf.CacheDiskDir,
+	}
+
+	CacheDiskMiB = &cli.IntFlag{
+		Name:        "cache-disk-mib",
+		Usage:       "Size limit of the disk tier of the prompt cache in MiB, 0 disables the tier",
+		Value:       DefaultCacheDiskMiB,
+		EnvVars:     []string{"LLAMA_SERVER_CACHE_DISK_MIB"},
+		Destination: &Conf.CacheDiskMiB,
+	}
+
+	CacheCompress = &cli.BoolFlag{
+		Name:        "cache-compress",
+		Usage:       "Compress the states held by the prompt cache",
+		Value:       false,
+		EnvVars:     []string{"LLAMA_SERVER_CACHE_COMPRESS"},
+		Destination: &Conf.CacheCompress,
+	}
+
+	SnapshotDir = &cli.StringFlag{
+		Name:        "snapshot-dir",
+		Usage:       "Directory of the snapshots of the prompt cache, written at shutdown and loaded at startup (default: disabled)",
+		EnvVars:     []string{"LLAMA_SERVER_SNAPSHOT_DIR"},
+		Destination: &Conf.SnapshotDir,
+	}
+
+	SnapshotSlots = &cli.BoolFlag{
+		Name:        "snapshot-slots",
+		Usage:       "Include the states of the idle slots in the snapshots",
+		Value:       false,
+		EnvVars:     []string{"LLAMA_SERVER_SNAPSHOT_SLOTS"},
+		Destination: &Conf.SnapshotSlots,
+	}
+
+	SnapshotInterval = &cli.IntFlag{
+		Name:        "snapshot-interval",
+		Usage:       "Seconds between two periodic snapshots, 0 writes them at shutdown only",
+		Value:       0,
+		EnvVars:     []string{"LLAMA_SERVER_SNAPSHOT_INTERVAL"},
+		Destination: &Conf.SnapshotInterval,
+	}
+
+	ElasticCtx = &cli.BoolFlag{
+		Name:        "elastic-ctx",
+		Usage:       "Share the context between the slots on demand instead of splitting it evenly, needs a unified KV cache",
+		Value:       false,
+		EnvVars:     []string{"LLAMA_SERVER_ELASTIC_CTX"},
+		Destination: &Conf.ElasticCtx,
+	}
+
+	SloClasses = &cli.StringFlag{
+		Name:        "slo-classes",
+		Usage:       "A comma separated list of name=deadline_ms classes that requests can select for deadline scheduling",
+		EnvVars:     []string{"LLAMA_SERVER_SLO_CLASSES"},
+		Destination: &Conf.SloClasses,
+	}
+
+	SamplingThreads = &cli.IntFlag{
+		Name:        "sampling-threads",
+		Usage:       "Number of threads that sample the tokens of the slots, 0 uses one per slot up to the number of threads",
+		Value:       0,
+		EnvVars:     []string{"LLAMA_SERVER_SAMPLING_THREADS"},
+		Destination: &Conf.SamplingThreads,
+	}
+
+	SessionTTL = &cli.IntFlag{
+		Name:        "session-ttl",
+		Usage:       "Seconds after which an unused chat session is dropped",
+		Value:       DefaultSessionTTL,
+		EnvVars:     []string{"LLAMA_SERVER_SESSION_TTL"},
+		Destination: &Conf.SessionTTL,
+	}
+
+	SessionMax = &cli.IntFlag{
+		Name:        "session-max",
+		Usage:       "Maximum number of chat sessions, the least recently used one is dropped beyond it",
+		Value:       DefaultSessionMax,
+		EnvVars:     []string{"LLAMA_SERVER_SESSION_MAX"},
+		Destination: &Conf.SessionMax,
+	}
+
+	Trace = &cli.IntFlag{
+		Name:        "trace",
+		Usage:       "Number of request spans kept for GET /trace, 0 disables tracing",
+		Value:       0,
+		EnvVars:     []string{"LLAMA_SERVER_TRACE"},
+		Destination: &Conf.Trace,
+	}
+
 	AppFlags = []cli.Flag{
 		LogLevel,
 		Model,
@@ -236,6 +335,18 @@ var (
 		ChatTemplateFile,
 		ChatTemplateKwargs,
 		NoPrune,
+		CacheDiskDir,
+		CacheDiskMiB,
+		CacheCompress,
+		SnapshotDir,
+		SnapshotSlots,
+		SnapshotInterval,
+		ElasticCtx,
+		SloClasses,
+		SamplingThreads,
+		SessionTTL,
+		SessionMax,
+		Trace,
 	}
 )
 
@@ -260,6 +371,19 @@ type Config struct {
 	ChatTemplateFile   string
 	ChatTemplateKwargs string
 	NoPrune            bool
+
+	CacheDiskDir     string
+	CacheDiskMiB     int
+	CacheCompress    bool
+	SnapshotDir      string
+	SnapshotSlots    bool
+	SnapshotInterval int
+	ElasticCtx       bool
+	SloClasses       string
+	SamplingThreads  int
+	SessionTTL       int
+	SessionMax       int
+	Trace            int
 }
 
 func (c *Config) Load() error {
@@ -271,6 +395,41 @@ func (c *Config) Load() error {
 	return nil
 }
 
+// ServerEnv returns the environment variables through which the server of the core reads its settings
+func (c *Config) ServerEnv() map[string]string {
+	env := map[string]string{
+		"LLAMA_SERVER_CACHE_DISK_MIB":    strconv.Itoa(c.CacheDiskMiB),
+		"LLAMA_SERVER_SNAPSHOT_INTERVAL": strconv.Itoa(c.SnapshotInterval),
+		"LLAMA_SERVER_SESSION_TTL":       strconv.Itoa(c.SessionTTL),
+		"LLAMA_SERVER_SESSION_MAX":       strconv.Itoa(c.SessionMax),
+		"LLAMA_SERVER_TRACE":             strconv.Itoa(c.Trace),
+	}
+	if len(c.CacheDiskDir) > 0 {
+		env["LLAMA_SERVER_CACHE_DISK_DIR"] = c.CacheDiskDir
+	}
+	if len(c.SnapshotDir) > 0 {
+		env["LLAMA_SERVER_SNAPSHOT_DIR"] = c.SnapshotDir
+	}
+	if len(c.SloClasses) > 0 {
+		env["LLAMA_SERVER_SLO_CLASSES"] = c.SloClasses
+	}
+	if c.SamplingThreads > 0 {
+		env["LLAMA_SERVER_SAMPLING_THREADS"] = strconv.Itoa(c.SamplingThreads)
+	}
+	for name, on := range map[string]bool{
+		"LLAMA_SERVER_CACHE_COMPRESS": c.CacheCompress,
+		"LLAMA_SERVER_SNAPSHOT_SLOTS": c.SnapshotSlots,
+		"LLAMA_SERVER_ELASTIC_CTX":    c.ElasticCtx,
+	} {
+		if on {
+			env[name] = "1"
+		} else {
+			env[name] = "0"
+		}
+	}
+	return env
+}
+
 func (c *Config) ModelPath() string {
 	if len(c.Model) <= 0 {
 		return ""
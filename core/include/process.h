@@ -17,8 +17,8 @@ typedef struct CommonParams {
 
 bool llama_start(const char * args);
 bool llama_stop();
-Result llama_gen(int id,const char * js_str);
-Result llama_chat(int id,const char * js_str);
+Result llama_gen(int id,const char * js_str,unsigned long long trace_id);
+Result llama_chat(int id,const char * js_str,unsigned long long trace_id);
 
 bool llama_interactive_start(const char * args,const char * prompt);
 bool llama_interactive_stop();
@@ -28,6 +28,17 @@ Result whisper_gen(const char * model,const char * input);
 CommonParams get_common_params();
 Result get_props();
 Result get_slots();
+Result get_metrics();
+Result get_trace(unsigned long long trace_id);
+
+Result get_prompt_cache();
+Result prompt_cache_pin(const char * js_str);
+Result prompt_cache_unpin(const char * name);
+
+Result session_create(const char * js_str);
+Result session_delete(const char * session_id);
+Result get_sessions();
+Result llama_session_chat(int id,const char * session_id,const char * js_str,unsigned long long trace_id);
 
 #ifdef __cplusplus
 }
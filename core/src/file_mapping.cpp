@@ -0,0 +1,81 @@
+#include "file_mapping.h"
+
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FILE_MAPPING_MMAP
+#endif
+
+FileMapping::~FileMapping() {
+    close();
+}
+
+bool FileMapping::open(const std::string& path) {
+    close();
+
+#ifdef FILE_MAPPING_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    m_data = static_cast<const uint8_t*>(addr);
+    m_size = st.st_size;
+    m_mapped = true;
+    return true;
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+
+    const std::streamsize size = file.tellg();
+    if (size <= 0) {
+        return false;
+    }
+    file.seekg(0);
+
+    m_buffer.resize(size);
+    if (!file.read(reinterpret_cast<char*>(m_buffer.data()), size)) {
+        m_buffer.clear();
+        return false;
+    }
+
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    return true;
+#endif
+}
+
+void FileMapping::close() {
+#ifdef FILE_MAPPING_MMAP
+    if (m_mapped) {
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+#endif
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+}
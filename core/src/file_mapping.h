@@ -0,0 +1,30 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. The file is memory mapped where the platform supports it,
+// otherwise it is read into memory.
+class FileMapping {
+public:
+    FileMapping() = default;
+    ~FileMapping();
+
+    FileMapping(const FileMapping&) = delete;
+    FileMapping& operator=(const FileMapping&) = delete;
+
+    bool open(const std::string& path);
+
+    void close();
+
+    const uint8_t* data() const { return m_data; }
+
+    size_t size() const { return m_size; }
+
+private:
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+    bool m_mapped = false;
+    std::vector<uint8_t> m_buffer;
+};
@@ -0,0 +1,101 @@
+#include "histogram.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+
+Histogram::Histogram(std::vector<double> bounds) : m_bounds(std::move(bounds)) {
+    std::sort(m_bounds.begin(), m_bounds.end());
+
+    m_buckets.reset(new std::atomic<uint64_t>[m_bounds.size() + 1]);
+    for (size_t i = 0; i <= m_bounds.size(); ++i) {
+        m_buckets[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+std::vector<double> Histogram::exponential(double start, double factor, int n) {
+    std::vector<double> bounds;
+    for (int i = 0; i < n; ++i) {
+        bounds.push_back(start);
+        start *= factor;
+    }
+    return bounds;
+}
+
+std::vector<double> Histogram::linear(double start, double width, int n) {
+    std::vector<double> bounds;
+    for (int i = 0; i < n; ++i) {
+        bounds.push_back(start + i*width);
+    }
+    return bounds;
+}
+
+void Histogram::observe(double value) {
+    const size_t i = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+
+    m_buckets[i].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+
+    double sum = m_sum.load(std::memory_order_relaxed);
+    while (!m_sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
+    }
+}
+
+double Histogram::quantile(double q) const {
+    std::vector<uint64_t> buckets(m_bounds.size() + 1);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += buckets[i];
+    }
+
+    if (total == 0) {
+        return 0.0;
+    }
+
+    const double rank = q*total;
+
+    uint64_t n = 0;
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        if (n + buckets[i] >= rank && buckets[i] > 0) {
+            // the observations past the last bound are reported at the last bound
+            if (i == m_bounds.size()) {
+                return m_bounds.empty() ? 0.0 : m_bounds.back();
+            }
+
+            const double lo = i == 0 ? std::min(0.0, m_bounds[0]) : m_bounds[i - 1];
+            const double hi = m_bounds[i];
+
+            return lo + (hi - lo)*(rank - n)/buckets[i];
+        }
+        n += buckets[i];
+    }
+
+    return m_bounds.empty() ? 0.0 : m_bounds.back();
+}
+
+void Histogram::write_prometheus(std::string& out, const std::string& name, const std::string& help) const {
+    char buf[256];
+
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " histogram\n";
+
+    // the counters are read one by one while other threads observe, the cumulative counts and the
+    // total may be off by the observations made in the meantime
+    uint64_t n = 0;
+    for (size_t i = 0; i < m_bounds.size(); ++i) {
+        n += m_buckets[i].load(std::memory_order_relaxed);
+        snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %" PRIu64 "\n", name.c_str(), m_bounds[i], n);
+        out += buf;
+    }
+    n += m_buckets[m_bounds.size()].load(std::memory_order_relaxed);
+
+    snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name.c_str(), n);
+    out += buf;
+    snprintf(buf, sizeof(buf), "%s_sum %.17g\n", name.c_str(), m_sum.load(std::memory_order_relaxed));
+    out += buf;
+    snprintf(buf, sizeof(buf), "%s_count %" PRIu64 "\n", name.c_str(), n);
+    out += buf;
+}
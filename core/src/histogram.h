@@ -0,0 +1,42 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Distribution of a measurement over fixed buckets. observe() is lock-free, so that it can be called from the
+// sampling threads and read by the metrics endpoint while the server runs.
+// The buckets follow the Prometheus histograms: an observation is counted in the first bucket whose upper
+// bound is greater or equal to it, the last bucket (+Inf) counts the rest.
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> bounds);
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    // n bounds: start, start*factor, start*factor^2, ...
+    static std::vector<double> exponential(double start, double factor, int n);
+
+    // n bounds: start, start + width, start + 2*width, ...
+    static std::vector<double> linear(double start, double width, int n);
+
+    void observe(double value);
+
+    uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+
+    // value below which the given fraction of the observations falls, interpolated inside the bucket
+    double quantile(double q) const;
+
+    // append the histogram in the Prometheus text exposition format
+    void write_prometheus(std::string& out, const std::string& name, const std::string& help) const;
+
+private:
+    std::vector<double> m_bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> m_buckets; // m_bounds.size() + 1 buckets
+
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<double> m_sum{0.0};
+};
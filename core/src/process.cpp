@@ -3,6 +3,7 @@
 #include "log.h"
 #include "whisper_service.h"
 #include "scheduler.h"
+#include "tracer.h"
 
 extern "C" {
     void PushToChan(int id, const char* val);
@@ -37,14 +38,16 @@ bool llama_stop() {
     return true;
 }
 
-Result llama_gen(int id,const char * js_str) {
+Result llama_gen(int id,const char * js_str,unsigned long long trace_id) {
     if (!Scheduler::instance().is_running()) {
         return {false};
     }
-    Request rq{id,std::string(js_str)};
+    Request rq{id,std::string(js_str),trace_id};
     Response rp{id};
 
-    rp.write = [](int id, const std::string& content) {
+    rp.write = [trace_id](int id, const std::string& content) {
+        // the cgo call into the Go channel
+        Tracer::Span span(trace_id, "push_to_chan");
         PushToChan(id, content.c_str());
         return true;
     };
@@ -62,15 +65,17 @@ Result llama_gen(int id,const char * js_str) {
     return {true};
 }
 
-Result llama_chat(int id,const char * js_str) {
+Result llama_chat(int id,const char * js_str,unsigned long long trace_id) {
     if (!Scheduler::instance().is_running()) {
         return {false};
     }
 
-    Request rq{id,std::string(js_str)};
+    Request rq{id,std::string(js_str),trace_id};
     Response rp{id};
 
-    rp.write = [](int id, const std::string& content) {
+    rp.write = [trace_id](int id, const std::string& content) {
+        // the cgo call into the Go channel
+        Tracer::Span span(trace_id, "push_to_chan");
         PushToChan(id, content.c_str());
         return true;
     };
@@ -138,4 +143,153 @@ Result get_slots() {
     arr[result.size()] = '\0';
 
     return {true,arr};
+}
+
+Result get_metrics() {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().get_metrics();
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result get_trace(unsigned long long trace_id) {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().get_trace(trace_id);
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result get_prompt_cache() {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().get_prompt_cache();
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result prompt_cache_pin(const char * js_str) {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().prompt_cache_pin(std::string(js_str));
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result prompt_cache_unpin(const char * name) {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().prompt_cache_unpin(std::string(name));
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result session_create(const char * js_str) {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().session_create(std::string(js_str));
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result session_delete(const char * session_id) {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().session_delete(std::string(session_id));
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result get_sessions() {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+    std::string result = Scheduler::instance().get_sessions();
+    if (result.empty()) {
+        return {false};
+    }
+    char* arr = new char[result.size() + 1];
+    std::copy(result.begin(), result.end(), arr);
+    arr[result.size()] = '\0';
+
+    return {true,arr};
+}
+
+Result llama_session_chat(int id,const char * session_id,const char * js_str,unsigned long long trace_id) {
+    if (!Scheduler::instance().is_running()) {
+        return {false};
+    }
+
+    Request rq{id,std::string(js_str),trace_id};
+    Response rp{id};
+
+    rp.write = [trace_id](int id, const std::string& content) {
+        // the cgo call into the Go channel
+        Tracer::Span span(trace_id, "push_to_chan");
+        PushToChan(id, content.c_str());
+        return true;
+    };
+    rp.is_writable = [](int id) {
+        return true;
+    };
+    rp.complete = [](int id) {
+        CloseChan(id);
+    };
+
+    Scheduler::instance().handle_session_chat(std::string(session_id),rq,rp);
+    if (!rp.success) {
+        return {false};
+    }
+
+    return {true};
 }
\ No newline at end of file
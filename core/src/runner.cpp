@@ -10,6 +10,8 @@
 #include "chat.h"
 #include "chat.cpp"
 #include "message.h"
+#include "stop_matcher.h"
+#include "token_pieces.h"
 
 #include <cstdio>
 #include <cstring>
@@ -175,6 +177,11 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
     auto * mem = llama_get_memory(ctx);
 
     const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    // text of the tokens, looked up instead of detokenizing every generated token
+    TokenPieces token_pieces;
+    token_pieces.build(vocab);
+
     auto chat_templates = common_chat_templates_init(model, params.chat_template);
 
     LOG_INF("%s: llama threadpool init, n_threads = %d\n", __func__, (int) params.cpuparams.n_threads);
@@ -564,6 +571,9 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
 
     std::vector<llama_token> embd;
 
+    // reverse prompts, matched on the text of the tokens accepted by the sampler as it grows
+    StopMatcher antiprompt_matcher(params.antiprompt);
+
     // single-token antiprompts
     std::vector<llama_token> antiprompt_token;
 
@@ -738,12 +748,17 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
 
             common_sampler_accept(smpl, id, /* accept_grammar= */ true);
 
+            if (!params.antiprompt.empty()) {
+                const std::string_view piece = token_pieces.piece(id);
+                antiprompt_matcher.feed(piece.data(), piece.size());
+            }
+
             // LOG_DBG("last: %s\n", string_from(ctx, smpl->prev.to_vector()).c_str());
 
             embd.push_back(id);
 
             if (params.conversation_mode && !waiting_for_first_input && !llama_vocab_is_eog(vocab, id)) {
-                assistant_ss << common_token_to_piece(ctx, id, false);
+                assistant_ss << token_pieces.piece(id, false);
             }
 
             // echo this to console
@@ -763,6 +778,11 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
                 // for the prompt, we don't apply grammar rules
                 common_sampler_accept(smpl, embd_inp[n_consumed], /* accept_grammar= */ false);
 
+                if (!params.antiprompt.empty()) {
+                    const std::string_view piece = token_pieces.piece(embd_inp[n_consumed]);
+                    antiprompt_matcher.feed(piece.data(), piece.size());
+                }
+
                 ++n_consumed;
                 if ((int) embd.size() >= params.n_batch) {
                     break;
@@ -773,10 +793,10 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
         // display text
         if (input_echo && display) {
             for (auto id : embd) {
-                const std::string token_str = common_token_to_piece(ctx, id, params.special);
+                const std::string_view token_str = token_pieces.piece(id, params.special);
 
                 // Console/Stream Output
-                LOG("%s", token_str.c_str());
+                LOG("%.*s", (int) token_str.size(), token_str.data());
 
                 // Record Displayed Tokens To Log
                 // Note: Generated tokens are created one by one hence this check
@@ -799,33 +819,25 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
 
         // if not currently processing queued inputs;
         if ((int) embd_inp.size() <= n_consumed) {
-            // check for reverse prompt in the last n_prev tokens
+            // check for reverse prompt at the end of the output
             if (!params.antiprompt.empty()) {
-                const int n_prev = 32;
-                const std::string last_output = common_sampler_prev_str(smpl, ctx, n_prev);
-
                 is_antiprompt = false;
-                // Check if each of the reverse prompts appears at the end of the output.
+                // Check if one of the reverse prompts appears at the end of the output.
                 // If we're not running interactively, the reverse prompt might be tokenized with some following characters
                 // so we'll compensate for that by widening the search window a bit.
-                for (std::string & antiprompt : params.antiprompt) {
-                    size_t extra_padding = params.interactive ? 0 : 2;
-                    size_t search_start_pos = last_output.length() > static_cast<size_t>(antiprompt.length() + extra_padding)
-                                              ? last_output.length() - static_cast<size_t>(antiprompt.length() + extra_padding)
-                                              : 0;
-
-                    if (last_output.find(antiprompt, search_start_pos) != std::string::npos) {
-                        if (params.interactive) {
-                            is_interacting = true;
-                        }
-                        is_antiprompt = true;
-                        break;
+                const size_t extra_padding = params.interactive ? 0 : 2;
+                const size_t match_end     = antiprompt_matcher.last_match_end();
+
+                if (match_end > 0 && match_end + extra_padding >= antiprompt_matcher.consumed()) {
+                    if (params.interactive) {
+                        is_interacting = true;
                     }
+                    is_antiprompt = true;
                 }
 
                 // check for reverse prompt using special tokens
-                // avoid calling common_sampler_last() if last_output is empty
-                if (!last_output.empty()) {
+                // avoid calling common_sampler_last() if there is no output yet
+                if (antiprompt_matcher.consumed() > 0) {
                     llama_token last_token = common_sampler_last(smpl);
                     for (auto token : antiprompt_token) {
                         if (token == last_token) {
@@ -839,7 +851,7 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
                 }
 
                 if (is_antiprompt) {
-                    LOG_DBG("found antiprompt: %s\n", last_output.c_str());
+                    LOG_DBG("found antiprompt: %s\n", common_sampler_prev_str(smpl, ctx, 32).c_str());
                 }
             }
 
@@ -992,6 +1004,7 @@ bool Runner::start(int id,const std::vector<std::string>& args,bool async,const
             if (n_past > 0 || waiting_for_first_input) {
                 if (is_interacting) {
                     common_sampler_reset(smpl);
+                    antiprompt_matcher.reset();
                 }
                 is_interacting = false;
 
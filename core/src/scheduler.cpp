@@ -60,7 +60,29 @@ bool Scheduler::start(const std::vector<std::string>& args) {
         return false;
     }
 
-    ctx_server.init();
+    // the settings of the sessions and of the tracer are checked before the server context is initialized
+    int64_t session_ttl = 1800;
+    int64_t session_max = 256;
+    int64_t n_spans     = 0;
+    if (!server_env_int("LLAMA_SERVER_SESSION_TTL", 0, INT32_MAX, session_ttl) ||
+        !server_env_int("LLAMA_SERVER_SESSION_MAX", 1, INT32_MAX, session_max) ||
+        !server_env_int("LLAMA_SERVER_TRACE",       0, INT32_MAX, n_spans) ||
+        !ctx_server.init()) {
+        cleanup();
+        LOG_ERR("%s: exiting due to invalid server settings\n", __func__);
+        return false;
+    }
+
+    sessions.configure(session_ttl, session_max);
+
+    // number of spans kept for GET /trace, tracing is off if 0
+    if (n_spans > 0 && !Tracer::instance().enabled()) {
+        Tracer::instance().enable(n_spans);
+        LOG_INF("%s: tracing enabled, n_spans = %lld\n", __func__, (long long) n_spans);
+    }
+
+    // warm start from the snapshot of the previous run, if any
+    ctx_server.snapshot_load();
 
     LOG_INF("%s: model loaded\n", __func__);
 
@@ -91,10 +113,14 @@ bool Scheduler::stop() {
         return false;
     }
     running= false;
-    cleanup();
+    // this will unblock start_loop()
+    ctx_server.queue_tasks.terminate();
     if (tasks_thread.joinable()) {
         tasks_thread.join();
     }
+    // the task loop has exited, the context can be saved from this thread
+    ctx_server.snapshot_save(true);
+    cleanup();
     return true;
 }
 
@@ -113,7 +139,11 @@ common_params * Scheduler::get_common_params() {
 }
 
 void Scheduler::handle_completions(const Request & req, Response & res) {
-    json data = json::parse(req.body);
+    json data;
+    {
+        Tracer::Span span(req.trace_id, "json_parse");
+        data = json::parse(req.body);
+    }
     std::vector<raw_buffer> files; // dummy
     handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
@@ -121,7 +151,8 @@ void Scheduler::handle_completions(const Request & req, Response & res) {
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_NONE);
+            OAICOMPAT_TYPE_NONE,
+            req.trace_id);
 }
 
 // handle completion-like requests (completion, chat, infill)
@@ -132,12 +163,25 @@ void Scheduler::handle_completions_impl(
         const std::vector<raw_buffer> & files,
         const std::function<bool()> & is_connection_closed,
         Response & res,
-        oaicompat_type oaicompat) {
+        oaicompat_type oaicompat,
+        uint64_t trace_id,
+        const std::function<void(server_task_result_cmpl_final &)> & on_final) {
     GGML_ASSERT(type == SERVER_TASK_TYPE_COMPLETION || type == SERVER_TASK_TYPE_INFILL);
 
     auto completion_id = gen_chatcmplid();
     std::unordered_set<int> task_ids;
+
+    // number of completions per prompt (OAI "n")
+    const int n_cmpl = json_value(data, "n_cmpl", 1);
+
     try {
+        if (n_cmpl < 1 || n_cmpl > ctx_server.params_base.n_parallel) {
+            throw std::runtime_error("n_cmpl must be between 1 and the number of slots (" + std::to_string(ctx_server.params_base.n_parallel) + ")");
+        }
+        if (n_cmpl > 1 && ctx_server.mctx != nullptr) {
+            throw std::runtime_error("n_cmpl > 1 is not supported by multimodal");
+        }
+
         std::vector<server_task> tasks;
 
         const auto & prompt = data.at("prompt");
@@ -147,16 +191,20 @@ void Scheduler::handle_completions_impl(
         // process prompt
         std::vector<server_tokens> inputs;
 
-        if (oaicompat && ctx_server.mctx != nullptr) {
-            // This is the case used by OAI compatible chat path with MTMD. TODO It can be moved to the path below.
-            inputs.push_back(process_mtmd_prompt(ctx_server.mctx, prompt.get<std::string>(), files));
-        } else {
-            // Everything else, including multimodal completions.
-            inputs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true);
+        {
+            Tracer::Span span(trace_id, "tokenize");
+
+            if (oaicompat && ctx_server.mctx != nullptr) {
+                // This is the case used by OAI compatible chat path with MTMD. TODO It can be moved to the path below.
+                inputs.push_back(process_mtmd_prompt(ctx_server.mctx, prompt.get<std::string>(), files));
+            } else {
+                // Everything else, including multimodal completions.
+                inputs = tokenize_input_prompts(ctx_server.vocab, ctx_server.mctx, prompt, true, true);
+            }
         }
 
-        const size_t n_ctx_slot = ctx_server.n_ctx / ctx_server.params_base.n_parallel;
-        tasks.reserve(inputs.size());
+        const size_t n_ctx_slot = ctx_server.get_n_ctx_slot();
+        tasks.reserve(inputs.size() * n_cmpl);
         for (size_t i = 0; i < inputs.size(); i++) {
             auto n_prompt_tokens = inputs[i].size();
             if (n_prompt_tokens >= n_ctx_slot) {
@@ -166,24 +214,52 @@ void Scheduler::handle_completions_impl(
                 res_error(res, error_data);
                 return;
             }
-            server_task task = server_task(type);
 
-            task.id    = ctx_server.queue_tasks.get_new_id();
-            task.index = i;
+            // fan-out: the prompt is evaluated once by the first task, the other tasks fork its state
+            // prompts that share a long prefix with the first prompt of the request fork from it as well
+            // when the fork is not safe (see server_context::slot_fanout), every task evaluates its own prompt
+            const bool fanout = ctx_server.slot_fanout && ctx_server.mctx == nullptr;
+
+            int id_parent = -1;
+            if (i > 0 && fanout &&
+                inputs[i].get_common_prefix(tasks[0].tokens) >= (size_t) ctx_server.fanout_prefix_min) {
+                id_parent = tasks[0].id;
+            }
+
+            for (int j = 0; j < n_cmpl; j++) {
+                server_task task = server_task(type);
 
-            task.tokens = std::move(inputs[i]);
-            task.params = server_task::params_from_json_cmpl(
-                    ctx_server.ctx,
-                    ctx_server.params_base,
-                    data);
-            task.id_slot = json_value(data, "id_slot", -1);
+                task.id        = ctx_server.queue_tasks.get_new_id();
+                task.index     = i*n_cmpl + j;
+                task.id_parent = j == 0 ? id_parent : (fanout ? tasks[i*n_cmpl].id : -1);
+                task.trace_id  = trace_id;
 
-            // OAI-compat
-            task.params.oaicompat                 = oaicompat;
-            task.params.oaicompat_cmpl_id         = completion_id;
-            // oaicompat_model is already populated by params_from_json_cmpl
+                task.tokens = j + 1 < n_cmpl ? server_tokens(inputs[i].get_text_tokens(), false) : std::move(inputs[i]);
+                task.params = server_task::params_from_json_cmpl(
+                        ctx_server.ctx,
+                        ctx_server.params_base,
+                        data);
+                task.id_slot = j == 0 ? json_value(data, "id_slot", -1) : -1;
 
-            tasks.push_back(std::move(task));
+                ctx_server.slo_apply(task);
+
+                // a fixed seed would sample the same completion in every fork
+                if (task.params.sampling.seed != LLAMA_DEFAULT_SEED) {
+                    task.params.sampling.seed += j;
+                }
+
+                // a different prompt reuses the forked state through the prompt cache logic of the slot
+                if (j == 0 && !task.params.cache_prompt) {
+                    task.id_parent = -1;
+                }
+
+                // OAI-compat
+                task.params.oaicompat                 = oaicompat;
+                task.params.oaicompat_cmpl_id         = completion_id;
+                // oaicompat_model is already populated by params_from_json_cmpl
+
+                tasks.push_back(std::move(task));
+            }
         }
 
         task_ids = server_task::get_list_id(tasks);
@@ -201,6 +277,31 @@ void Scheduler::handle_completions_impl(
             if (results.size() == 1) {
                 // single result
                 res_ok(res, results[0]->to_json());
+                if (on_final) {
+                    auto res_final = dynamic_cast<server_task_result_cmpl_final*>(results[0].get());
+                    if (res_final != nullptr) {
+                        on_final(*res_final);
+                    }
+                }
+            } else if (oaicompat != OAICOMPAT_TYPE_NONE && n_cmpl > 1) {
+                // OAI-compat: a single response with one choice per result
+                json merged = results[0]->to_json();
+                for (size_t i = 1; i < results.size(); i++) {
+                    json cur = results[i]->to_json();
+                    for (auto & choice : cur.at("choices")) {
+                        merged.at("choices").push_back(std::move(choice));
+                    }
+
+                    // the prompt is counted once for the forks of the same prompt
+                    auto & usage = merged.at("usage");
+                    const int n_prompt = i % n_cmpl == 0 ? cur.at("usage").at("prompt_tokens").get<int>() : 0;
+                    const int n_cmpl_tokens = cur.at("usage").at("completion_tokens").get<int>();
+
+                    usage["prompt_tokens"]     = usage.at("prompt_tokens").get<int>() + n_prompt;
+                    usage["completion_tokens"] = usage.at("completion_tokens").get<int>() + n_cmpl_tokens;
+                    usage["total_tokens"]      = usage.at("total_tokens").get<int>() + n_prompt + n_cmpl_tokens;
+                }
+                res_ok(res, merged);
             } else {
                 // multiple results (multitask)
                 json arr = json::array();
@@ -226,6 +327,12 @@ void Scheduler::handle_completions_impl(
             return res.write(res.id,str);
         };
         ctx_server.receive_cmpl_results_stream(task_ids, [&](server_task_result_ptr & result) -> bool {
+            if (on_final) {
+                auto res_final = dynamic_cast<server_task_result_cmpl_final*>(result.get());
+                if (res_final != nullptr) {
+                    on_final(*res_final);
+                }
+            }
             json res_json = result->to_json();
             if (res_json.is_array()) {
                 for (const auto & res : res_json) {
@@ -256,7 +363,12 @@ void Scheduler::handle_completions_impl(
 
 
 void Scheduler::handle_completions_oai(const Request & req, Response & res) {
-    json data = oaicompat_completion_params_parse(json::parse(req.body));
+    json body;
+    {
+        Tracer::Span span(req.trace_id, "json_parse");
+        body = json::parse(req.body);
+    }
+    json data = oaicompat_completion_params_parse(body);
     std::vector<raw_buffer> files; // dummy
     handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
@@ -264,18 +376,27 @@ void Scheduler::handle_completions_oai(const Request & req, Response & res) {
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_COMPLETION);
+            OAICOMPAT_TYPE_COMPLETION,
+            req.trace_id);
 }
 
 void Scheduler::handle_chat_completions(const Request & req, Response & res) {
     LOG_DBG("request: %s\n", req.body.c_str());
 
-    auto body = json::parse(req.body);
+    json body;
+    {
+        Tracer::Span span(req.trace_id, "json_parse");
+        body = json::parse(req.body);
+    }
     std::vector<raw_buffer> files;
-    json data = oaicompat_chat_params_parse(
-            body,
-            ctx_server.oai_parser_opt,
-            files);
+    json data;
+    {
+        Tracer::Span span(req.trace_id, "chat_template");
+        data = oaicompat_chat_params_parse(
+                body,
+                ctx_server.oai_parser_opt,
+                files);
+    }
 
     handle_completions_impl(
             SERVER_TASK_TYPE_COMPLETION,
@@ -283,7 +404,8 @@ void Scheduler::handle_chat_completions(const Request & req, Response & res) {
             files,
             req.is_connection_closed,
             res,
-            OAICOMPAT_TYPE_CHAT);
+            OAICOMPAT_TYPE_CHAT,
+            req.trace_id);
 }
 
 void Scheduler::handle_embeddings_impl(const Request & req, Response & res, oaicompat_type oaicompat) {
@@ -421,6 +543,11 @@ std::string Scheduler::get_props() {
         };
     }
 
+    json server_settings = ctx_server.settings_to_json();
+    server_settings["session_ttl"] = sessions.ttl();
+    server_settings["session_max"] = sessions.n_max();
+    server_settings["trace"]       = Tracer::instance().capacity();
+
     // this endpoint is publicly available, please only return what is safe to be exposed
     json data = {
             { "default_generation_settings", default_generation_settings_for_props },
@@ -438,6 +565,7 @@ std::string Scheduler::get_props() {
             { "bos_token",                   common_token_to_piece(ctx_server.ctx, llama_vocab_bos(ctx_server.vocab), /* special= */ true)},
             { "eos_token",                   common_token_to_piece(ctx_server.ctx, llama_vocab_eos(ctx_server.vocab), /* special= */ true)},
             { "build_info",                  build_info },
+            { "server_settings",             server_settings },
     };
     if (ctx_server.params_base.use_jinja) {
         if (auto tool_use_src = common_chat_templates_source(ctx_server.chat_templates.get(), "tool_use")) {
@@ -483,4 +611,409 @@ std::string Scheduler::get_slots(bool fail_on_no_slot) {
     }
 
     return safe_json_to_str(res_task->slots_data);
-}
\ No newline at end of file
+}
+
+std::string Scheduler::get_prompt_cache() {
+    int task_id = ctx_server.queue_tasks.get_new_id();
+    {
+        server_task task(SERVER_TASK_TYPE_METRICS);
+        task.id = task_id;
+        ctx_server.queue_results.add_waiting_task_id(task_id);
+        ctx_server.queue_tasks.post(std::move(task), true); // high-priority task
+    }
+
+    server_task_result_ptr result = ctx_server.queue_results.recv(task_id);
+    ctx_server.queue_results.remove_waiting_task_id(task_id);
+
+    if (result->is_error()) {
+        json final_response {{"error", safe_json_to_str(result->to_json())}};
+        return safe_json_to_str(final_response);
+    }
+
+    // TODO: get rid of this dynamic_cast
+    auto res_task = dynamic_cast<server_task_result_metrics*>(result.get());
+    GGML_ASSERT(res_task != nullptr);
+
+    if (res_task->prompt_cache_data.is_null()) {
+        json final_response {{"error", safe_json_to_str(format_error_response("The prompt cache is disabled - start the server with `--cache-ram N`", ERROR_TYPE_NOT_SUPPORTED))}};
+        return safe_json_to_str(final_response);
+    }
+
+    return safe_json_to_str(res_task->prompt_cache_data);
+}
+
+// prometheus compatible metrics, the counters come from a metrics task and the histograms are read directly
+std::string Scheduler::get_metrics() {
+    int task_id = ctx_server.queue_tasks.get_new_id();
+    {
+        server_task task(SERVER_TASK_TYPE_METRICS);
+        task.id = task_id;
+        task.metrics_reset_bucket = true;
+        ctx_server.queue_results.add_waiting_task_id(task_id);
+        ctx_server.queue_tasks.post(std::move(task), true); // high-priority task
+    }
+
+    server_task_result_ptr result = ctx_server.queue_results.recv(task_id);
+    ctx_server.queue_results.remove_waiting_task_id(task_id);
+
+    if (result->is_error()) {
+        return std::string();
+    }
+
+    // TODO: get rid of this dynamic_cast
+    auto res_task = dynamic_cast<server_task_result_metrics*>(result.get());
+    GGML_ASSERT(res_task != nullptr);
+
+    // metrics definition: https://prometheus.io/docs/practices/naming/#metric-names
+    json all_metrics_def = json {
+        {"counter", {{
+                {"name",  "prompt_tokens_total"},
+                {"help",  "Number of prompt tokens processed."},
+                {"value",  (uint64_t) res_task->n_prompt_tokens_processed_total}
+        }, {
+                {"name",  "prompt_seconds_total"},
+                {"help",  "Prompt process time"},
+                {"value",  (uint64_t) res_task->t_prompt_processing_total / 1.e3}
+        }, {
+                {"name",  "tokens_predicted_total"},
+                {"help",  "Number of generation tokens processed."},
+                {"value",  (uint64_t) res_task->n_tokens_predicted_total}
+        }, {
+                {"name",  "tokens_predicted_seconds_total"},
+                {"help",  "Predict process time"},
+                {"value",  (uint64_t) res_task->t_tokens_generation_total / 1.e3}
+        }, {
+                {"name",  "n_decode_total"},
+                {"help",  "Total number of llama_decode() calls"},
+                {"value",  res_task->n_decode_total}
+        }, {
+                {"name",  "prompt_tokens_shared_total"},
+                {"help",  "Number of prompt tokens copied from another slot."},
+                {"value",  res_task->n_prompt_tokens_shared_total}
+        }, {
+                {"name",  "preempted_total"},
+                {"help",  "Number of tasks suspended for a task of higher priority."},
+                {"value",  res_task->n_preempted_total}
+        }}},
+        {"gauge", {{
+                {"name",  "prompt_tokens_seconds"},
+                {"help",  "Average prompt throughput in tokens/s."},
+                {"value",  res_task->n_prompt_tokens_processed ? 1.e3 / res_task->t_prompt_processing * res_task->n_prompt_tokens_processed : 0.}
+        },{
+                {"name",  "predicted_tokens_seconds"},
+                {"help",  "Average generation throughput in tokens/s."},
+                {"value",  res_task->n_tokens_predicted ? 1.e3 / res_task->t_tokens_generation * res_task->n_tokens_predicted : 0.}
+        },{
+                {"name",  "n_busy_slots_per_decode"},
+                {"help",  "Average number of busy slots per llama_decode() call"},
+                {"value",  (float) res_task->n_busy_slots_total / std::max((float) res_task->n_decode_total, 1.f)}
+        },{
+                {"name",  "n_past_max"},
+                {"help",  "Largest observed n_past."},
+                {"value",  res_task->n_past_max}
+        },{
+                {"name",  "requests_processing"},
+                {"help",  "Number of requests processing."},
+                {"value",  (uint64_t) res_task->n_processing_slots}
+        },{
+                {"name",  "requests_deferred"},
+                {"help",  "Number of requests deferred."},
+                {"value",  (uint64_t) res_task->n_tasks_deferred}
+        }}}
+    };
+
+    std::stringstream prometheus;
+
+    for (const auto & el : all_metrics_def.items()) {
+        const auto & type        = el.key();
+        const auto & metrics_def = el.value();
+
+        for (const auto & metric_def : metrics_def) {
+            const std::string name = metric_def.at("name");
+            const std::string help = metric_def.at("help");
+
+            auto value = json_value(metric_def, "value", 0.);
+            prometheus << "# HELP llamacpp:" << name << " " << help  << "\n"
+                       << "# TYPE llamacpp:" << name << " " << type  << "\n"
+                       << "llamacpp:"        << name << " " << value << "\n";
+        }
+    }
+
+    std::string out = prometheus.str();
+    ctx_server.metrics.write_prometheus(out);
+
+    return out;
+}
+
+std::string Scheduler::prompt_cache_pin(const std::string & body) {
+    json data;
+    try {
+        data = json::parse(body);
+    } catch (const std::exception & e) {
+        json final_response {{"error", safe_json_to_str(format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST))}};
+        return safe_json_to_str(final_response);
+    }
+
+    const std::string name = json_value(data, "name", std::string());
+    if (name.empty() || !data.contains("prompt")) {
+        json final_response {{"error", safe_json_to_str(format_error_response("\"name\" and \"prompt\" must be provided", ERROR_TYPE_INVALID_REQUEST))}};
+        return safe_json_to_str(final_response);
+    }
+
+    int task_id = ctx_server.queue_tasks.get_new_id();
+    {
+        server_task task(SERVER_TASK_TYPE_PROMPT_CACHE_PIN);
+        task.id       = task_id;
+        task.pin_name = name;
+        // tokenized the same way as the completion prompts, so that the pin matches the cached tokens
+        task.tokens   = server_tokens(tokenize_mixed(ctx_server.vocab, data.at("prompt"), true, true), false);
+        ctx_server.queue_results.add_waiting_task_id(task_id);
+        ctx_server.queue_tasks.post(std::move(task));
+    }
+
+    server_task_result_ptr result = ctx_server.queue_results.recv(task_id);
+    ctx_server.queue_results.remove_waiting_task_id(task_id);
+
+    if (result->is_error()) {
+        json final_response {{"error", safe_json_to_str(result->to_json())}};
+        return safe_json_to_str(final_response);
+    }
+
+    return safe_json_to_str(result->to_json());
+}
+
+std::string Scheduler::prompt_cache_unpin(const std::string & name) {
+    int task_id = ctx_server.queue_tasks.get_new_id();
+    {
+        server_task task(SERVER_TASK_TYPE_PROMPT_CACHE_UNPIN);
+        task.id       = task_id;
+        task.pin_name = name;
+        ctx_server.queue_results.add_waiting_task_id(task_id);
+        ctx_server.queue_tasks.post(std::move(task));
+    }
+
+    server_task_result_ptr result = ctx_server.queue_results.recv(task_id);
+    ctx_server.queue_results.remove_waiting_task_id(task_id);
+
+    if (result->is_error()) {
+        json final_response {{"error", safe_json_to_str(result->to_json())}};
+        return safe_json_to_str(final_response);
+    }
+
+    return safe_json_to_str(result->to_json());
+}
+
+std::string Scheduler::session_create(const std::string & body) {
+    json data = json::object();
+    if (!body.empty()) {
+        try {
+            data = json::parse(body);
+        } catch (const std::exception & e) {
+            json final_response {{"error", safe_json_to_str(format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST))}};
+            return safe_json_to_str(final_response);
+        }
+    }
+
+    json messages = json::array();
+    if (data.contains("messages")) {
+        messages = data.at("messages");
+        if (!messages.is_array()) {
+            json final_response {{"error", safe_json_to_str(format_error_response("\"messages\" must be an array", ERROR_TYPE_INVALID_REQUEST))}};
+            return safe_json_to_str(final_response);
+        }
+        data.erase("messages");
+    }
+
+    // the rest of the body are the default parameters of the turns
+    std::vector<std::string> removed = sessions.expire();
+    const std::string id = sessions.create(messages, data, removed);
+    sessions_unpin(removed);
+
+    if (id.empty()) {
+        json final_response {{"error", safe_json_to_str(format_error_response("Too many sessions are running a turn", ERROR_TYPE_UNAVAILABLE))}};
+        return safe_json_to_str(final_response);
+    }
+
+    SRV_INF("created session %s, n_messages = %zu\n", id.c_str(), messages.size());
+
+    return safe_json_to_str(json {
+        {"id",         id},
+        {"ttl_s",      sessions.ttl()},
+        {"n_messages", messages.size()},
+    });
+}
+
+std::string Scheduler::session_delete(const std::string & id) {
+    if (!sessions.remove(id)) {
+        json final_response {{"error", safe_json_to_str(format_error_response("Unknown session", ERROR_TYPE_NOT_FOUND))}};
+        return safe_json_to_str(final_response);
+    }
+
+    sessions_unpin({id});
+
+    return safe_json_to_str(json {
+        {"id",      id},
+        {"deleted", true},
+    });
+}
+
+std::string Scheduler::get_sessions() {
+    sessions_unpin(sessions.expire());
+
+    return safe_json_to_str(sessions.to_json());
+}
+
+// a turn of a session: the request carries the new messages only, they are appended to the history of the
+// session together with the reply. the prompt of the turn is pinned in the prompt cache, so that the KV of
+// the conversation survives the slot being taken by other requests between the turns
+void Scheduler::handle_session_chat(const std::string & id, const Request & req, Response & res) {
+    LOG_DBG("session %s request: %s\n", id.c_str(), req.body.c_str());
+
+    sessions_unpin(sessions.expire());
+
+    json body;
+    try {
+        Tracer::Span span(req.trace_id, "json_parse");
+        body = json::parse(req.body);
+    } catch (const std::exception & e) {
+        res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
+        res.complete(res.id);
+        return;
+    }
+
+    if (!body.contains("messages") || !body.at("messages").is_array()) {
+        res_error(res, format_error_response("\"messages\" must be an array with the new messages of the session", ERROR_TYPE_INVALID_REQUEST));
+        res.complete(res.id);
+        return;
+    }
+
+    json history;
+    json params;
+    {
+        const std::string error = sessions.begin_turn(id, history, params);
+        if (!error.empty()) {
+            res_error(res, format_error_response(error, ERROR_TYPE_NOT_FOUND));
+            res.complete(res.id);
+            return;
+        }
+    }
+
+    json turn = body.at("messages");
+
+    // the parameters of the request override the ones given when the session was created
+    params.update(body);
+    params["messages"] = std::move(history);
+    for (const auto & msg : turn) {
+        params["messages"].push_back(msg);
+    }
+
+    json reply;
+    json data;
+    try {
+        std::vector<raw_buffer> files;
+        {
+            Tracer::Span span(req.trace_id, "chat_template");
+            data = oaicompat_chat_params_parse(
+                    params,
+                    ctx_server.oai_parser_opt,
+                    files);
+        }
+
+        if (json_value(data, "n_cmpl", 1) != 1) {
+            throw std::runtime_error("n > 1 is not supported by sessions");
+        }
+
+        handle_completions_impl(
+                SERVER_TASK_TYPE_COMPLETION,
+                data,
+                files,
+                req.is_connection_closed,
+                res,
+                OAICOMPAT_TYPE_CHAT,
+                req.trace_id,
+                [&reply](server_task_result_cmpl_final & result) {
+                    common_chat_msg msg;
+                    if (!result.oaicompat_msg.empty()) {
+                        msg = result.oaicompat_msg;
+                    } else {
+                        msg.role    = "assistant";
+                        msg.content = result.content;
+                    }
+                    reply = msg.to_json_oaicompat<json>();
+                });
+    } catch (const std::exception & e) {
+        sessions.end_turn(id, json());
+        res_error(res, format_error_response(e.what(), ERROR_TYPE_INVALID_REQUEST));
+        res.complete(res.id);
+        return;
+    }
+
+    if (reply.is_null()) {
+        // the turn failed or was cancelled, the client can send the same messages again.
+        // the request may have been rejected before the results were received, the response is completed here then
+        sessions.end_turn(id, json());
+        res.complete(res.id);
+        return;
+    }
+
+    turn.push_back(std::move(reply));
+
+    // the prompt is pinned while the session is busy, so that it cannot expire in between. a session deleted
+    // during the turn was unpinned before the pin existed, the pin is dropped here then
+    sessions_pin(id, data.at("prompt"));
+    if (!sessions.end_turn(id, turn)) {
+        sessions_unpin({id});
+    }
+}
+
+// the spans of a request (or of all the requests if trace_id is 0) in the Chrome trace event format
+std::string Scheduler::get_trace(uint64_t trace_id) {
+    if (!Tracer::instance().enabled()) {
+        return "";
+    }
+    return Tracer::instance().dump(trace_id);
+}
+
+void Scheduler::sessions_pin(const std::string & id, const json & prompt) {
+    // TODO: mtmd does not support prompt cache
+    if (!ctx_server.prompt_cache || ctx_server.mctx != nullptr) {
+        return;
+    }
+
+    int task_id = ctx_server.queue_tasks.get_new_id();
+    {
+        server_task task(SERVER_TASK_TYPE_PROMPT_CACHE_PIN);
+        task.id       = task_id;
+        task.pin_name = "session:" + id;
+        // the prompt was tokenized by the turn, this is a hit in the tokenize cache
+        task.tokens   = server_tokens(tokenize_mixed(ctx_server.vocab, prompt, true, true), false);
+        ctx_server.queue_results.add_waiting_task_id(task_id);
+        ctx_server.queue_tasks.post(std::move(task));
+    }
+
+    ctx_server.queue_results.recv(task_id);
+    ctx_server.queue_results.remove_waiting_task_id(task_id);
+}
+
+void Scheduler::sessions_unpin(const std::vector<std::string> & ids) {
+    if (!ctx_server.prompt_cache) {
+        return;
+    }
+
+    for (const auto & id : ids) {
+        SRV_INF("removed session %s\n", id.c_str());
+
+        // the sessions without a finished turn have no pin, the error result is expected
+        int task_id = ctx_server.queue_tasks.get_new_id();
+        {
+            server_task task(SERVER_TASK_TYPE_PROMPT_CACHE_UNPIN);
+            task.id       = task_id;
+            task.pin_name = "session:" + id;
+            ctx_server.queue_results.add_waiting_task_id(task_id);
+            ctx_server.queue_tasks.post(std::move(task));
+        }
+
+        ctx_server.queue_results.recv(task_id);
+        ctx_server.queue_results.remove_waiting_task_id(task_id);
+    }
+}
@@ -2,10 +2,13 @@
 
 #include "server_context.h"
 #include "singleton.h"
+#include "session_store.h"
 
 struct Request {
     int id;
     std::string body;
+    // spans of the request in the Tracer, 0 if none
+    uint64_t trace_id = 0;
     std::function<bool()> is_connection_closed = []() { return false; };
 };
 
@@ -22,6 +25,7 @@ class Scheduler : public patterns::Singleton<Scheduler> {
 
 private:
     server_context ctx_server;
+    SessionStore sessions;
     bool running= false;
     std::thread tasks_thread;
     Scheduler();
@@ -35,7 +39,9 @@ public:
     bool is_running();
 
     void handle_completions(const Request & req, Response & res);
-    void handle_completions_impl(server_task_type type,json & data,const std::vector<raw_buffer> & files,const std::function<bool()> & is_connection_closed,Response & res,oaicompat_type oaicompat);
+    void handle_completions_impl(server_task_type type,json & data,const std::vector<raw_buffer> & files,const std::function<bool()> & is_connection_closed,Response & res,oaicompat_type oaicompat,
+                                 uint64_t trace_id = 0,
+                                 const std::function<void(server_task_result_cmpl_final &)> & on_final = nullptr);
     void handle_completions_oai(const Request & req, Response & res);
     void handle_chat_completions(const Request & req, Response & res);
 
@@ -47,4 +53,19 @@ public:
     common_params *get_common_params();
     std::string get_props();
     std::string get_slots(bool fail_on_no_slot= false);
+    std::string get_metrics();
+    std::string get_prompt_cache();
+    std::string prompt_cache_pin(const std::string & body);
+    std::string prompt_cache_unpin(const std::string & name);
+
+    std::string session_create(const std::string & body);
+    std::string session_delete(const std::string & id);
+    std::string get_sessions();
+    void handle_session_chat(const std::string & id, const Request & req, Response & res);
+
+    std::string get_trace(uint64_t trace_id);
+
+private:
+    void sessions_pin(const std::string & id, const json & prompt);
+    void sessions_unpin(const std::vector<std::string> & ids);
 };
\ No newline at end of file
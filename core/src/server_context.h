@@ -17,11 +17,24 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <list>
+#include <map>
+#include <set>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <assert.h>
 
 #include "arg.h"
 #include "chat.h"
 #include "message.h"
+#include "file_mapping.h"
+#include "histogram.h"
+#include "state_codec.h"
+#include "stop_matcher.h"
+#include "thread_pool.h"
+#include "token_pieces.h"
+#include "tracer.h"
 
 #include "utils.hpp"
 #include "common.h"
@@ -36,6 +49,10 @@ using json = nlohmann::ordered_json;
 
 constexpr int HTTP_POLLING_SECONDS = 1;
 
+// streamed chat messages are parsed on every token up to this many bytes of output, then in steps of 1/STEP of it
+constexpr size_t CHAT_MSG_PARSE_FULL = 4096;
+constexpr size_t CHAT_MSG_PARSE_STEP = 32;
+
 enum stop_type {
     STOP_TYPE_NONE,
     STOP_TYPE_EOS,
@@ -47,6 +64,7 @@ enum stop_type {
 enum slot_state {
     SLOT_STATE_IDLE,
     SLOT_STATE_STARTED, // TODO: this state is only used for setting up the initial prompt processing; maybe merge it with launch_slot_with_task in the future
+    SLOT_STATE_WAIT_PARENT, // fan-out: waiting for the slot of the parent task to evaluate its prompt
     SLOT_STATE_PROCESSING_PROMPT,
     SLOT_STATE_DONE_PROMPT,
     SLOT_STATE_GENERATING,
@@ -63,6 +81,8 @@ enum server_task_type {
     SERVER_TASK_TYPE_SLOT_SAVE,
     SERVER_TASK_TYPE_SLOT_RESTORE,
     SERVER_TASK_TYPE_SLOT_ERASE,
+    SERVER_TASK_TYPE_PROMPT_CACHE_PIN,
+    SERVER_TASK_TYPE_PROMPT_CACHE_UNPIN,
     SERVER_TASK_TYPE_SET_LORA,
 };
 
@@ -114,9 +134,15 @@ struct slot_params {
 
     int32_t n_keep    =  0; // number of tokens to keep from initial prompt
     int32_t n_discard =  0; // number of tokens after n_keep that may be discarded when shifting context, 0 defaults to half
+    int32_t n_sink    =  0; // streaming context shift: keep this many leading (attention sink) tokens instead of n_keep and advance by small steps
     int32_t n_predict = -1; // new tokens to predict
     int32_t n_indent  =  0; // minimum line indentation for the generated text in number of whitespace characters
 
+    int32_t priority  =  0; // a task can preempt the processing tasks of lower priority when no slot is available
+
+    int64_t     deadline_ms = -1; // if positive, the first token is due within this time after the arrival of the request
+    std::string slo;              // name of the SLO class, which defines the deadline if deadline_ms is not set
+
     int64_t t_max_prompt_ms  = -1; // TODO: implement
     int64_t t_max_predict_ms = -1; // if positive, limit the generation phase to this time limit
 
@@ -130,6 +156,9 @@ struct slot_params {
     struct common_params_sampling sampling;
     struct common_params_speculative speculative;
 
+    // set when the sampling parameters reduce to a simple kernel that replaces the sampler chain
+    fast_sampler_type fast_sampler = FAST_SAMPLER_NONE;
+
     // OAI-compat fields
     bool                         verbose                   = false;
     oaicompat_type               oaicompat                 = OAICOMPAT_TYPE_NONE;
@@ -180,6 +209,10 @@ struct slot_params {
                     {"n_predict",                 n_predict}, // TODO: deduplicate
                     {"n_keep",                    n_keep},
                     {"n_discard",                 n_discard},
+                    {"n_sink",                    n_sink},
+                    {"priority",                  priority},
+                    {"deadline_ms",               deadline_ms},
+                    {"slo",                       slo},
                     {"ignore_eos",                sampling.ignore_eos},
                     {"stream",                    stream},
                     {"n_probs",                   sampling.n_probs},
@@ -189,6 +222,7 @@ struct slot_params {
                     {"reasoning_in_content",      oaicompat_chat_syntax.reasoning_in_content},
                     {"thinking_forced_open",      oaicompat_chat_syntax.thinking_forced_open},
                     {"samplers",                  samplers},
+                    {"fast_sampler",              fast_sampler_type_name(fast_sampler)},
                     {"speculative.n_max",         speculative.n_max},
                     {"speculative.n_min",         speculative.n_min},
                     {"speculative.p_min",         speculative.p_min},
@@ -233,6 +267,10 @@ struct slot_params {
                 {"n_predict",                 n_predict}, // TODO: deduplicate
                 {"n_keep",                    n_keep},
                 {"n_discard",                 n_discard},
+                {"n_sink",                    n_sink},
+                {"priority",                  priority},
+                {"deadline_ms",               deadline_ms},
+                {"slo",                       slo},
                 {"ignore_eos",                sampling.ignore_eos},
                 {"stream",                    stream},
                 {"logit_bias",                format_logit_bias(sampling.logit_bias)},
@@ -247,6 +285,7 @@ struct slot_params {
                 {"reasoning_in_content",      oaicompat_chat_syntax.reasoning_in_content},
                 {"thinking_forced_open",      oaicompat_chat_syntax.thinking_forced_open},
                 {"samplers",                  samplers},
+                {"fast_sampler",              fast_sampler_type_name(fast_sampler)},
                 {"speculative.n_max",         speculative.n_max},
                 {"speculative.n_min",         speculative.n_min},
                 {"speculative.p_min",         speculative.p_min},
@@ -265,6 +304,18 @@ struct server_task {
     int id_target = -1;
     int id_slot   = -1;
 
+    // fan-out (n > 1 or prompts sharing a prefix): the state of the parent is forked once its prompt is evaluated
+    int id_parent = -1;
+
+    // time by which the first token is due (see server_context::slo_apply()), -1 if none
+    int64_t t_deadline = -1;
+
+    // time of the first post to the task queue, -1 until then
+    int64_t t_queued = -1;
+
+    // spans of the task in the Tracer, 0 if the request has no trace id
+    uint64_t trace_id = 0;
+
     // used by SERVER_TASK_TYPE_INFERENCE
     slot_params   params;
     server_tokens tokens;
@@ -276,6 +327,12 @@ struct server_task {
         int slot_id;
         std::string filename;
         std::string filepath;
+
+        // SERVER_TASK_TYPE_SLOT_RESTORE: the file read by the I/O thread, the task is posted again with it
+        std::shared_ptr<std::vector<uint8_t>> state;
+        llama_tokens state_tokens;
+        size_t  n_read    = 0;
+        int64_t t_read_us = 0;
     };
     slot_action slot_action;
 
@@ -285,6 +342,9 @@ struct server_task {
     // used by SERVER_TASK_TYPE_SET_LORA
     std::vector<common_adapter_lora_info> set_lora;
 
+    // used by SERVER_TASK_TYPE_PROMPT_CACHE_PIN, SERVER_TASK_TYPE_PROMPT_CACHE_UNPIN
+    std::string pin_name;
+
     server_task() = default;
 
     server_task(server_task_type type) : type(type) {}
@@ -320,6 +380,10 @@ struct server_task {
         params.n_indent         = json_value(data,       "n_indent",           defaults.n_indent);
         params.n_keep           = json_value(data,       "n_keep",             defaults.n_keep);
         params.n_discard        = json_value(data,       "n_discard",          defaults.n_discard);
+        params.n_sink           = json_value(data,       "n_sink",             defaults.n_sink);
+        params.priority         = json_value(data,       "priority",           defaults.priority);
+        params.deadline_ms      = json_value(data,       "deadline_ms",        defaults.deadline_ms);
+        params.slo              = json_value(data,       "slo",                defaults.slo);
         //params.t_max_prompt_ms  = json_value(data,       "t_max_prompt_ms",    defaults.t_max_prompt_ms); // TODO: implement
         params.t_max_predict_ms = json_value(data,       "t_max_predict_ms",   defaults.t_max_predict_ms);
         params.response_fields  = json_value(data,       "response_fields",   std::vector<std::string>());
@@ -414,7 +478,7 @@ struct server_task {
             try {
                 auto schema                  = json_value(data, "json_schema", json::object());
                 SRV_DBG("JSON schema: %s\n", schema.dump(2).c_str());
-                params.sampling.grammar      = json_schema_to_grammar(schema);
+                params.sampling.grammar      = json_schema_to_grammar_cached(schema);
                 SRV_DBG("Converted grammar: %s\n", params.sampling.grammar.c_str());
             } catch (const std::exception & e) {
                 throw std::runtime_error(std::string("\"json_schema\": ") + e.what());
@@ -595,6 +659,11 @@ struct server_task {
             }
         }
 
+        // the post-sampling probs are read from the candidates of the sampler chain
+        if (!(params.post_sampling_probs && params.sampling.n_probs > 0)) {
+            params.fast_sampler = fast_sampler_select(params.sampling);
+        }
+
         std::string model_name = params_base.model_alias.empty() ? DEFAULT_OAICOMPAT_MODEL : params_base.model_alias;
         params.oaicompat_model = json_value(data, "model", model_name);
 
@@ -901,7 +970,7 @@ struct server_task_result_cmpl_final : server_task_result {
 
         json choice {
                 {"finish_reason", finish_reason},
-                {"index", 0},
+                {"index", index},
                 {"message", msg.to_json_oaicompat<json>()},
         };
 
@@ -951,7 +1020,7 @@ struct server_task_result_cmpl_final : server_task_result {
                                      {"choices", json::array({
                                                                      json {
                                                                              {"finish_reason", nullptr},
-                                                                             {"index", 0},
+                                                                             {"index", index},
                                                                              {"delta", common_chat_msg_diff_to_json_oaicompat<json>(diff)},
                                                                      },
                                                              })},
@@ -967,7 +1036,7 @@ struct server_task_result_cmpl_final : server_task_result {
                                  {"choices", json::array({
                                                                  json {
                                                                          {"finish_reason", finish_reason},
-                                                                         {"index", 0},
+                                                                         {"index", index},
                                                                          {"delta", json::object()},
                                                                  },
                                                          })},
@@ -1125,7 +1194,7 @@ struct server_task_result_cmpl_partial : server_task_result {
                                      {"choices", json::array({
                                                                      json {
                                                                              {"finish_reason", nullptr},
-                                                                             {"index", 0},
+                                                                             {"index", index},
                                                                              {"delta", delta},
                                                                      },
                                                              })},
@@ -1315,10 +1384,26 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    // prompt tokens whose KV was copied from another slot instead of being evaluated
+    uint64_t n_prompt_tokens_shared_total = 0;
+
+    // tasks suspended for a task of higher priority, and resumed
+    uint64_t n_preempted_total = 0;
+    uint64_t n_resumed_total   = 0;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
 
+    // server_prompt_cache::to_json(), null if the prompt cache is disabled
+    json prompt_cache_data = nullptr;
+
+    // server_metrics::slo_to_json()
+    json slo_data = json::object();
+
+    // server_metrics::histograms_to_json()
+    json histograms_data = json::object();
+
     virtual json to_json() override {
         return json {
                 { "idle",                            n_idle_slots },
@@ -1341,7 +1426,15 @@ struct server_task_result_metrics : server_task_result {
                 { "n_decode_total",                  n_decode_total },
                 { "n_busy_slots_total",              n_busy_slots_total },
 
+                { "n_prompt_tokens_shared_total",    n_prompt_tokens_shared_total },
+
+                { "n_preempted_total",               n_preempted_total },
+                { "n_resumed_total",                 n_resumed_total },
+
                 { "slots",                           slots_data },
+                { "prompt_cache",                    prompt_cache_data },
+                { "slo",                             slo_data },
+                { "histograms",                      histograms_data },
         };
     }
 };
@@ -1396,11 +1489,59 @@ struct server_task_result_apply_lora : server_task_result {
     }
 };
 
+struct server_task_result_prompt_cache_pin : server_task_result {
+    std::string name;
+    bool is_pin; // true = pin, false = unpin
+
+    size_t n_tokens;
+
+    virtual json to_json() override {
+        return json {
+                { "name",     name },
+                { "pinned",   is_pin },
+                { "n_tokens", n_tokens },
+        };
+    }
+};
+
+// the data of a state, it is not modified once filled. the copies share the buffer, so that the states
+// of the prompt cache can be handed to the I/O thread without copying them
+struct server_state_data {
+    std::shared_ptr<const std::vector<uint8_t>> buf;
+
+    server_state_data() = default;
+
+    server_state_data(std::vector<uint8_t> && data) : buf(std::make_shared<const std::vector<uint8_t>>(std::move(data))) {}
+
+    // a new buffer of n bytes, the caller fills it before the data is copied
+    uint8_t * alloc(size_t n) {
+        auto res = std::make_shared<std::vector<uint8_t>>(n);
+        buf = res;
+        return res->data();
+    }
+
+    const uint8_t * data() const {
+        return buf ? buf->data() : nullptr;
+    }
+
+    size_t size() const {
+        return buf ? buf->size() : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    void clear() {
+        buf.reset();
+    }
+};
+
 struct server_prompt_checkpoint {
     llama_pos pos_min;
     llama_pos pos_max;
 
-    std::vector<uint8_t> data;
+    server_state_data data;
 
     size_t size() const {
         return data.size();
@@ -1410,10 +1551,16 @@ struct server_prompt_checkpoint {
 struct server_prompt {
     server_tokens tokens;
 
-    std::vector<uint8_t> data;
+    server_state_data data;
 
     std::list<server_prompt_checkpoint> checkpoints;
 
+    // number of times the prompt was reused from the prompt cache
+    uint32_t n_hits = 0;
+
+    // the data of the state and of the checkpoints is encoded with StateCodec
+    bool compressed = false;
+
     size_t size() const {
         size_t res = data.size();
 
@@ -1429,827 +1576,2437 @@ struct server_prompt {
     }
 };
 
-struct server_prompt_cache {
-    server_prompt_cache(int32_t limit_size_mib, size_t limit_tokens) {
-        this->limit_size   = 1024ull*1024ull*(limit_size_mib < 0 ? 0 : limit_size_mib);
-        this->limit_tokens = limit_tokens;
-    }
+// optional compression of the states held by the prompt cache
+struct server_prompt_compression {
+    bool enabled = false;
 
-    std::list<server_prompt> states;
+    // element width used to shuffle the bytes of the state, from the type of the KV cache
+    size_t width = 2;
 
-    // in bytes, 0 = no limit
-    size_t limit_size = 0;
+    // threads that code the blocks of a state, shared by the copies made for the slots and the snapshots.
+    // used from the task loop only, the coding runs inline without it
+    std::shared_ptr<ThreadPool> pool;
 
-    // in tokens, 0 = no limit
-    size_t limit_tokens = 0;
+    struct {
+        uint64_t n_compress     = 0;
+        uint64_t n_bytes_raw    = 0;
+        uint64_t n_bytes_stored = 0;
+        int64_t  t_compress_us  = 0;
 
-    size_t size() const {
-        size_t res = 0;
+        uint64_t n_decompress    = 0;
+        int64_t  t_decompress_us = 0;
+    } stats;
 
-        for (const auto & state : states) {
-            res += state.size();
+    void compress(server_prompt & prompt) {
+        if (!enabled || prompt.compressed) {
+            return;
         }
 
-        return res;
-    }
+        const int64_t t_start = ggml_time_us();
 
-    size_t n_tokens() const {
-        size_t res = 0;
+        const size_t size_raw = prompt.size();
 
-        for (const auto & state : states) {
-            res += state.n_tokens();
+        prompt.data = StateCodec::encode(prompt.data.data(), prompt.data.size(), width, pool.get());
+        for (auto & checkpoint : prompt.checkpoints) {
+            checkpoint.data = StateCodec::encode(checkpoint.data.data(), checkpoint.data.size(), width, pool.get());
         }
+        prompt.compressed = true;
 
-        return res;
+        stats.n_compress++;
+        stats.n_bytes_raw    += size_raw;
+        stats.n_bytes_stored += prompt.size();
+        stats.t_compress_us  += ggml_time_us() - t_start;
     }
 
-    server_prompt * alloc(const server_prompt & prompt, size_t state_size) {
-        // first check if the current state is contained fully in the cache
-        for (auto it = states.begin(); it != states.end(); ++it) {
-            const int cur_lcp_len = it->tokens.get_common_prefix(prompt.tokens);
+    bool decompress(const uint8_t * data, size_t size, std::vector<uint8_t> & out) {
+        const int64_t t_start = ggml_time_us();
 
-            if (cur_lcp_len == (int) prompt.tokens.size()) {
-                SRV_WRN("%s", " - prompt is already in the cache, skipping\n");
-                return nullptr;
-            }
+        if (!StateCodec::decode(data, size, out, pool.get())) {
+            return false;
         }
 
-        // next, remove any cached prompts that are fully contained in the current prompt
-        for (auto it = states.begin(); it != states.end();) {
-            const int len = it->tokens.get_common_prefix(prompt.tokens);
+        stats.n_decompress++;
+        stats.t_decompress_us += ggml_time_us() - t_start;
 
-            if (len == (int) it->tokens.size()) {
-                SRV_WRN(" - removing obsolete cached prompt with length %d\n", len);
+        return true;
+    }
 
-                it = states.erase(it);
-            } else {
-                ++it;
+    // decode the state (if present) and the checkpoints in place
+    bool decompress(server_prompt & prompt) {
+        if (!prompt.compressed) {
+            return true;
+        }
+
+        std::vector<uint8_t> raw;
+
+        if (!prompt.data.empty()) {
+            if (!decompress(prompt.data.data(), prompt.data.size(), raw)) {
+                return false;
             }
+            prompt.data = std::move(raw);
         }
 
-        std::vector<uint8_t> state_data;
+        for (auto & checkpoint : prompt.checkpoints) {
+            if (!decompress(checkpoint.data.data(), checkpoint.data.size(), raw)) {
+                return false;
+            }
+            checkpoint.data = std::move(raw);
+        }
 
-        // check if we can allocate enough memory for the new state
-        try {
-            state_data.resize(state_size);
-        } catch (const std::bad_alloc & e) {
-            SRV_ERR("failed to allocate memory for prompt cache state: %s\n", e.what());
+        prompt.compressed = false;
 
-            limit_size = std::max<size_t>(1, 0.4*size());
+        return true;
+    }
 
-            SRV_WRN(" - cache size limit reduced to %.3f MiB\n", limit_size / (1024.0 * 1024.0));
+    json to_json() const {
+        return json {
+            { "enabled",         enabled },
+            { "n_compress",      stats.n_compress },
+            { "n_bytes_raw",     stats.n_bytes_raw },
+            { "n_bytes_stored",  stats.n_bytes_stored },
+            { "ratio",           stats.n_bytes_stored > 0 ? double(stats.n_bytes_raw) / stats.n_bytes_stored : 0.0 },
+            { "t_compress_ms",   stats.t_compress_us / 1000.0 },
+            { "n_decompress",    stats.n_decompress },
+            { "t_decompress_ms", stats.t_decompress_us / 1000.0 },
+        };
+    }
+};
 
-            update();
+// second tier of the prompt cache: states evicted from memory are written to files in a local directory by a
+// background thread, and restored straight from a memory mapping of the file
+//
+// file layout (native byte order):
+//   u32 magic, u32 version,
+//   u32 n_tokens, n_tokens x llama_token,
+//   u32 n_hits, u32 flags (since version 2, bit 0: the state and the checkpoints are compressed),
+//   u64 n_data, n_data x u8,
+//   u32 n_checkpoints, n_checkpoints x (i32 pos_min, i32 pos_max, u64 n_data, n_data x u8)
+struct server_prompt_cache_disk {
+    static constexpr uint32_t FILE_MAGIC   = 0x43505347; // 'GSPC'
+    static constexpr uint32_t FILE_VERSION = 2;
+
+    static constexpr uint32_t FILE_FLAG_COMPRESSED = 1;
+
+    enum write_state {
+        WRITE_STATE_PENDING,
+        WRITE_STATE_DONE,
+        WRITE_STATE_CANCELLED,
+    };
 
-            return nullptr;
-        }
+    struct write_job {
+        std::string path;
 
-        // TODO: for some reason we can't copy server_tokens, so we have to do this workaround
-        auto & cur = states.emplace_back();
-        cur = {
-                /*.tokens      =*/ server_tokens(prompt.tokens.get_text_tokens(), false),
-                /*.data        =*/ std::move(state_data),
-                /*.checkpoints =*/ prompt.checkpoints,
-        };
+        std::shared_ptr<const server_prompt> prompt;
+
+        // whoever moves the job out of WRITE_STATE_PENDING last owns the file:
+        // the writer thread removes it if the job was cancelled, the cache removes it if the job is done
+        std::atomic<int> state { WRITE_STATE_PENDING };
+
+        bool ok = false; // valid once the state is WRITE_STATE_DONE
+    };
+
+    struct file {
+        int32_t id;
 
-        return &cur;
+        std::string path;
+
+        size_t size;
+        size_t n_tokens;
+
+        // set until the writer thread is done with the file - the state can be restored from memory in the meantime
+        std::shared_ptr<write_job> job;
+    };
+
+    server_prompt_cache_disk(const std::string & dir, int32_t limit_size_mib) : dir(dir) {
+        this->limit_size = 1024ull*1024ull*(limit_size_mib < 0 ? 0 : limit_size_mib);
     }
 
-    bool load(server_prompt & prompt, const server_tokens & tokens_new, llama_context * ctx, int32_t id_slot) {
-        const int lcp_best = prompt.tokens.get_common_prefix(tokens_new);
+    ~server_prompt_cache_disk() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            running = false;
+        }
+        condition_jobs.notify_all();
 
-        float f_keep_best = float(lcp_best) / prompt.tokens.size();
-        float sim_best    = float(lcp_best) / tokens_new.size();
+        // the writer finishes the pending jobs before exiting
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
 
-        SRV_WRN(" - looking for better prompt, base f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
+    std::string dir;
 
-        auto it_best = states.end();
+    // in bytes, 0 = no limit
+    size_t limit_size = 0;
 
-        // find the most similar cached prompt, that would also preserve the most context
-        for (auto it = states.begin(); it != states.end(); ++it) {
-            const int lcp_cur = it->tokens.get_common_prefix(tokens_new);
+    // oldest first
+    std::list<file> files;
 
-            const float f_keep_cur = float(lcp_cur) / it->tokens.size();
-            const float sim_cur    = float(lcp_cur) / tokens_new.size();
+    // file id -> position in the list, and a radix tree over the stored tokens keyed by file id
+    std::unordered_map<int32_t, std::list<file>::iterator> entries;
+    server_prefix_tree index;
 
-            // don't trash large prompts
-            if (f_keep_cur < 0.25f) {
-                continue;
-            }
+    // files that are still referenced by a write job
+    std::vector<int32_t> pending;
 
-            if (f_keep_best < f_keep_cur && sim_best < sim_cur) {
-                f_keep_best = f_keep_cur;
-                sim_best    = sim_cur;
+    // decodes the compressed states, owned by the prompt cache
+    server_prompt_compression * compression = nullptr;
 
-                it_best = it;
-            }
-        }
+    int32_t id_next = 0;
 
-        if (it_best != states.end()) {
-            SRV_WRN(" - found better prompt with f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
+    size_t size_total = 0;
 
-            const size_t size = it_best->data.size();
-            const size_t n = llama_state_seq_set_data_ext(ctx, it_best->data.data(), size, id_slot, 0);
-            if (n != size) {
-                SRV_WRN("failed to restore state with size %zu\n", size);
+    struct {
+        uint64_t n_store        = 0;
+        uint64_t n_load         = 0;
+        uint64_t n_write_failed = 0;
 
-                return false;
-            }
+        uint64_t n_bytes_load = 0;
+        int64_t  t_load_us    = 0;
+    } stats;
+
+    std::thread writer;
+
+    std::mutex mutex_jobs;
+    std::condition_variable condition_jobs;
+    std::deque<std::shared_ptr<write_job>> jobs;
+    int  n_writing = 0;
+    bool running = true;
 
-            it_best->data.clear();
-            it_best->data.shrink_to_fit();
+    // keep_files: leave the files of a previous run in place, until adopt() decides which ones are still valid
+    bool init(bool keep_files) {
+        std::error_code ec;
 
-            prompt = std::move(*it_best);
+        std::filesystem::create_directories(dir, ec);
+        if (ec) {
+            SRV_ERR("failed to create prompt cache directory '%s': %s\n", dir.c_str(), ec.message().c_str());
+            return false;
+        }
 
-            states.erase(it_best);
+        if (!keep_files) {
+            adopt({});
         }
 
+        writer = std::thread([this]() {
+            write_loop();
+        });
+
         return true;
     }
 
-    void update() {
-        if (limit_size > 0) {
-            // always keep at least one state, regardless of the limits
-            while (states.size() > 1 && size() > limit_size) {
-                if (states.empty()) {
-                    break;
-                }
+    // index the given files of a previous run and remove all the other ones
+    void adopt(const std::vector<std::string> & names) {
+        std::error_code ec;
+
+        std::unordered_set<std::string> keep;
 
-                SRV_WRN(" - cache size limit reached, removing oldest entry (size = %.3f MiB)\n", states.front().size() / (1024.0 * 1024.0));
+        for (const auto & name : names) {
+            const std::filesystem::path path = std::filesystem::path(dir) / name;
 
-                states.pop_front();
+            int32_t id = -1;
+            if (sscanf(name.c_str(), "prompt-%d.bin", &id) != 1 || id < 0 || entries.count(id)) {
+                continue;
             }
-        }
 
-        if (limit_tokens > 0) {
-            while (states.size() > 1 && n_tokens() > limit_tokens) {
-                if (states.empty()) {
-                    break;
-                }
+            FileMapping mapping;
 
-                SRV_WRN(" - cache token limit reached, removing oldest entry (size = %.3f MiB)\n", states.front().size() / (1024.0 * 1024.0));
+            server_prompt prompt;
+            const uint8_t * state   = nullptr;
+            size_t          n_state = 0;
+            if (!mapping.open(path.string()) || !parse(mapping.data(), mapping.size(), prompt, &state, &n_state) || prompt.tokens.empty()) {
+                continue;
+            }
 
-                states.pop_front();
+            if (limit_size > 0 && size_total + mapping.size() > limit_size) {
+                break;
             }
-        }
 
-        SRV_WRN(" - cache state: %zu prompts, %.3f MiB (limits: %.3f MiB, %zu tokens)\n",
-                states.size(), size() / (1024.0 * 1024.0), limit_size / (1024.0 * 1024.0), limit_tokens);
+            files.push_back({ id, path.string(), mapping.size(), prompt.tokens.size(), nullptr });
 
-        for (const auto & state : states) {
-            SRV_WRN("   - prompt %p: %7d tokens, checkpoints: %2zu, %9.3f MiB\n", (const void *)&state, state.n_tokens(), state.checkpoints.size(), state.size() / (1024.0 * 1024.0));
+            entries[id] = std::prev(files.end());
+            index.insert(id, prompt.tokens.get_text_tokens());
+
+            size_total += mapping.size();
+            id_next     = std::max(id_next, id + 1);
+
+            keep.insert(path.filename().string());
         }
-    }
-};
 
-struct server_slot {
-    int id;
+        for (const auto & entry : std::filesystem::directory_iterator(dir, ec)) {
+            if (is_cache_file(entry.path()) && keep.count(entry.path().filename().string()) == 0) {
+                std::filesystem::remove(entry.path(), ec);
+            }
+        }
 
-    llama_batch batch_spec = {};
+        if (!files.empty()) {
+            SRV_WRN(" - adopted %zu prompts from the disk cache (size = %.3f MiB)\n", files.size(), size_total / (1024.0 * 1024.0));
+        }
+    }
 
-    // TODO: change to unique_ptrs for consistency:
-    llama_context * ctx = nullptr;
-    llama_context * ctx_dft = nullptr;
+    // wait until all pending files are written
+    void flush() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            condition_jobs.wait(lock, [&]() {
+                return jobs.empty() && n_writing == 0;
+            });
+        }
 
-    // multimodal
-    mtmd_context * mctx = nullptr;
+        collect();
+    }
 
-    common_speculative * spec = nullptr;
+    // written: only the files that the writer thread is done with
+    std::vector<std::string> file_names(bool written = false) const {
+        std::vector<std::string> res;
+        res.reserve(files.size());
 
-    std::unique_ptr<const server_task> task;
-    std::unique_ptr<const server_task> task_prev; // used for debugging
+        for (const auto & cur : files) {
+            if (written && cur.job && !(cur.job->state == WRITE_STATE_DONE && cur.job->ok)) {
+                continue;
+            }
+            res.push_back(std::filesystem::path(cur.path).filename().string());
+        }
 
-    // used to determine the slot that has been used the longest
-    int64_t t_last_used = -1;
+        return res;
+    }
 
-    // generation props
-    int32_t n_ctx       = 0;  // context size per slot
-    int32_t n_past      = 0;
-    int32_t n_keep      = 0;
-    int32_t n_decoded   = 0;
-    int32_t n_remaining = -1;
-    int32_t i_batch     = -1;
+    static bool is_cache_file(const std::filesystem::path & path) {
+        const std::string name = path.filename().string();
 
-    int32_t n_prompt_tokens_cache     = 0;
-    int32_t n_prompt_tokens_processed = 0;
+        return name.rfind("prompt-", 0) == 0 && (path.extension() == ".bin" || path.extension() == ".tmp");
+    }
 
-    int32_t n_prompt_tokens() const {
-        return task->tokens.size();
+    size_t size() const {
+        return size_total;
     }
 
-    size_t last_nl_pos = 0;
+    std::list<file>::iterator erase(std::list<file>::iterator it) {
+        int expected = WRITE_STATE_PENDING;
+        if (!it->job || !it->job->state.compare_exchange_strong(expected, WRITE_STATE_CANCELLED)) {
+            std::error_code ec;
+            std::filesystem::remove(it->path, ec);
+        }
 
-    std::string  generated_text;
-    llama_tokens generated_tokens;
+        size_total -= it->size;
 
-    common_chat_msg chat_msg;
+        index.remove(it->id);
+        entries.erase(it->id);
 
-    std::vector<completion_token_output> generated_token_probs;
+        return files.erase(it);
+    }
 
-    bool has_next_token = true;
-    bool has_new_line   = false;
-    bool truncated      = false;
+    // remove the files that are fully contained in the tokens
+    void erase_prefixes(const llama_tokens & tokens) {
+        for (const int32_t id : index.find_prefixes(tokens)) {
+            erase(entries.at(id));
+        }
+    }
 
-    stop_type stop;
+    // release the states that have been written and drop the files that failed to write
+    void collect() {
+        for (size_t i = 0; i < pending.size();) {
+            auto it_entry = entries.find(pending[i]);
+            if (it_entry == entries.end()) {
+                pending[i] = pending.back();
+                pending.pop_back();
+                continue;
+            }
 
-    std::string stopping_word;
+            auto it = it_entry->second;
+            if (it->job->state != WRITE_STATE_DONE) {
+                ++i;
+                continue;
+            }
 
-    // state
-    slot_state state = SLOT_STATE_IDLE;
+            const bool ok = it->job->ok;
+            it->job.reset();
 
-    server_prompt prompt;
+            if (!ok) {
+                stats.n_write_failed++;
+                erase(it);
+            }
 
-    void prompt_save(server_prompt_cache & prompt_cache) const {
-        assert(prompt.data.size() == 0);
+            pending[i] = pending.back();
+            pending.pop_back();
+        }
+    }
 
-        const size_t cur_size = llama_state_seq_get_size_ext(ctx, id, 0);
+    void store(server_prompt && prompt) {
+        collect();
 
-        SRV_WRN(" - saving prompt with length %d, total state size = %.3f MiB\n",
-                (int) prompt.tokens.size(), cur_size / (1024.0 * 1024.0));
+        const size_t size     = prompt.size();
+        const size_t n_tokens = prompt.tokens.size();
 
-        auto * cur = prompt_cache.alloc(prompt, cur_size);
-        if (cur == nullptr) {
+        if (n_tokens == 0 || prompt.data.empty()) {
             return;
         }
 
-        llama_state_seq_get_data_ext(ctx, cur->data.data(), cur_size, id, 0);
-    }
+        if (limit_size > 0 && size > limit_size) {
+            SRV_WRN(" - prompt state does not fit in the disk cache (size = %.3f MiB)\n", size / (1024.0 * 1024.0));
+            return;
+        }
 
-    void prompt_load(server_prompt_cache & prompt_cache, const server_tokens & tokens) {
-        bool res = prompt_cache.load(prompt, tokens, ctx, id);
-        if (!res) {
-            SLT_WRN(*this, "%s", "failed to load prompt from cache\n");
+        // a file that holds the same or a longer prompt makes this one redundant
+        if (index.n_common_max(prompt.tokens.get_text_tokens()) == n_tokens) {
+            return;
         }
-    }
 
-    std::vector<common_adapter_lora_info> lora;
-    int32_t alora_invocation_start = -1;
+        erase_prefixes(prompt.tokens.get_text_tokens());
 
-    // sampling
-    json json_schema;
+        while (limit_size > 0 && !files.empty() && size_total + size > limit_size) {
+            SRV_WRN(" - disk cache size limit reached, removing oldest file (size = %.3f MiB)\n", files.front().size / (1024.0 * 1024.0));
 
-    struct common_sampler * smpl = nullptr;
+            erase(files.begin());
+        }
 
-    llama_token sampled;
+        const int32_t id = id_next++;
 
-    common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
-    std::vector<std::string> generated_tool_call_ids;
+        auto job = std::make_shared<write_job>();
+        job->path   = (std::filesystem::path(dir) / ("prompt-" + std::to_string(id) + ".bin")).string();
+        job->prompt = std::make_shared<const server_prompt>(std::move(prompt));
 
-    // stats
-    size_t n_sent_text = 0; // number of sent text character
+        files.push_back({ id, job->path, size, n_tokens, job });
 
-    int64_t t_start_process_prompt;
-    int64_t t_start_generation;
+        entries[id] = std::prev(files.end());
+        index.insert(id, job->prompt->tokens.get_text_tokens());
+        pending.push_back(id);
 
-    double t_prompt_processing; // ms
-    double t_token_generation;  // ms
+        size_total += size;
 
-    std::function<void(int)> callback_on_release;
+        stats.n_store++;
 
-    // Speculative decoding stats
-    int32_t n_draft_total = 0;      // Total draft tokens generated
-    int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
+        SRV_WRN(" - spilling prompt with %zu tokens to disk (size = %.3f MiB)\n", n_tokens, size / (1024.0 * 1024.0));
 
-    void reset() {
-        SLT_DBG(*this, "%s", "\n");
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            jobs.push_back(std::move(job));
+        }
+        condition_jobs.notify_all();
+    }
 
-        n_prompt_tokens_cache = 0;
+    // find a stored prompt that preserves more context than f_keep_best and is more similar than sim_best, -1 if none
+    int32_t find(const server_tokens & tokens_new, float & f_keep_best, float & sim_best) const {
+        int32_t id_best = -1;
 
-        last_nl_pos    = 0;
-        generated_text = "";
-        has_new_line   = false;
-        truncated      = false;
-        stop           = STOP_TYPE_NONE;
-        stopping_word  = "";
-        n_past         = 0;
-        n_sent_text    = 0;
-        chat_format    = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+        for (const auto & match : index.find(tokens_new.get_text_tokens())) {
+            const auto & cur = *entries.at(match.id);
 
-        generated_tokens.clear();
-        generated_token_probs.clear();
-        chat_msg = {};
-        json_schema = json();
-        generated_tool_call_ids.clear();
+            const float f_keep_cur = float(match.n_common) / cur.n_tokens;
+            const float sim_cur    = float(match.n_common) / tokens_new.size();
 
-        // clear speculative decoding stats
-        n_draft_total = 0;
-        n_draft_accepted = 0;
+            // don't trash large prompts
+            if (f_keep_cur < 0.25f) {
+                continue;
+            }
 
-        task.reset();
-        task_prev.reset();
+            if (f_keep_best < f_keep_cur && sim_best < sim_cur) {
+                f_keep_best = f_keep_cur;
+                sim_best    = sim_cur;
 
-        // clear alora start
-        alora_invocation_start = -1;
+                id_best = match.id;
+            }
+        }
+
+        return id_best;
     }
 
-    bool need_embd() const {
-        GGML_ASSERT(task);
+    // restore the stored prompt into the sequence of the slot - the file is removed from the cache
+    bool load(int32_t id, server_prompt & prompt, llama_context * ctx, int32_t id_slot) {
+        collect();
 
-        return server_task_type_need_embd(task->type);
-    }
+        // the write of the file may have failed since find(), in which case collect() dropped it
+        const auto it_entry = entries.find(id);
+        if (it_entry == entries.end()) {
+            return false;
+        }
 
-    bool need_logits() const {
-        GGML_ASSERT(task);
+        auto it = it_entry->second;
 
-        return server_task_type_need_logits(task->type);
-    }
+        const int64_t t_start = ggml_time_us();
 
-    // if the context does not have a memory module then all embeddings have to be computed within a single ubatch
-    // also we cannot split if the pooling would require any past tokens
-    bool can_split() const {
-        return
-                !need_embd() ||
-                (llama_get_memory(ctx) && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_LAST);
-    }
+        bool ok = false;
 
-    bool can_batch_with(server_slot & other_slot) const {
-        GGML_ASSERT(task);
+        server_prompt loaded;
 
-        return task->type == other_slot.task->type && are_lora_equal(lora, other_slot.lora);
-    }
+        FileMapping mapping;
 
-    bool has_budget(const common_params & global_params) {
-        GGML_ASSERT(task);
+        const uint8_t * state   = nullptr;
+        size_t          n_state = 0;
 
-        if (task->params.n_predict == -1 && global_params.n_predict == -1) {
-            return true; // limitless
+        if (it->job && it->job->state != WRITE_STATE_DONE) {
+            // not written yet - restore from memory
+            const auto & src = *it->job->prompt;
+
+            loaded.tokens      = server_tokens(src.tokens.get_text_tokens(), false);
+            loaded.checkpoints = src.checkpoints;
+            loaded.n_hits      = src.n_hits;
+            loaded.compressed  = src.compressed;
+
+            state   = src.data.data();
+            n_state = src.data.size();
+            ok      = true;
+        } else {
+            // the state is restored directly from the mapping
+            ok = mapping.open(it->path) && parse(mapping.data(), mapping.size(), loaded, &state, &n_state);
         }
 
-        n_remaining = -1;
+        std::vector<uint8_t> raw;
+        if (ok && loaded.compressed) {
+            ok = compression && compression->decompress(state, n_state, raw) && compression->decompress(loaded);
 
-        if (task->params.n_predict != -1) {
-            n_remaining = task->params.n_predict - n_decoded;
-        } else if (global_params.n_predict != -1) {
-            n_remaining = global_params.n_predict - n_decoded;
+            state   = raw.data();
+            n_state = raw.size();
         }
 
-        return n_remaining > 0; // no budget
-    }
+        ok = ok && llama_state_seq_set_data_ext(ctx, state, n_state, id_slot, 0) == n_state;
 
-    bool is_processing() const {
-        return state != SLOT_STATE_IDLE;
-    }
+        if (ok) {
+            prompt = std::move(loaded);
+        }
 
-    bool can_speculate() const {
-        return ctx_dft;
-    }
+        if (ok) {
+            stats.n_load++;
+            stats.n_bytes_load += it->size;
+            stats.t_load_us    += ggml_time_us() - t_start;
 
-    void add_token(const completion_token_output & token) {
-        if (!is_processing()) {
-            SLT_WRN(*this, "%s", "slot is not processing\n");
-            return;
+            SRV_WRN(" - loaded prompt with %zu tokens from disk in %.2f ms\n", it->n_tokens, (ggml_time_us() - t_start) / 1000.0);
+        } else {
+            SRV_WRN("failed to restore prompt from '%s'\n", it->path.c_str());
         }
-        generated_token_probs.push_back(token);
+
+        erase(it);
+
+        return ok;
     }
 
-    void release() {
-        if (is_processing()) {
-            GGML_ASSERT(task);
+    // parse a file into the prompt, without its state data - the state is returned as a pointer into the buffer
+    static bool parse(const uint8_t * data, size_t size, server_prompt & prompt, const uint8_t ** state, size_t * n_state) {
+        size_t off = 0;
 
-            SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
+        const auto read_raw = [&](void * dst, size_t n) {
+            if (size - off < n) {
+                return false;
+            }
+            memcpy(dst, data + off, n);
+            off += n;
+            return true;
+        };
 
-            t_last_used = ggml_time_us();
-            t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
-            state = SLOT_STATE_IDLE;
+        uint32_t magic   = 0;
+        uint32_t version = 0;
+        if (!read_raw(&magic, sizeof(magic)) || !read_raw(&version, sizeof(version)) || magic != FILE_MAGIC || version < 1 || version > FILE_VERSION) {
+            return false;
+        }
 
-            task_prev = std::move(task);
-            task.reset();
+        uint32_t n_tokens = 0;
+        if (!read_raw(&n_tokens, sizeof(n_tokens)) || (size - off) / sizeof(llama_token) < n_tokens) {
+            return false;
+        }
 
-            callback_on_release(id);
+        llama_tokens tokens(n_tokens);
+        read_raw(tokens.data(), n_tokens*sizeof(llama_token));
+
+        uint32_t n_hits = 0;
+        uint32_t flags  = 0;
+        uint64_t n_data = 0;
+        if (!read_raw(&n_hits, sizeof(n_hits)) || (version >= 2 && !read_raw(&flags, sizeof(flags))) ||
+            !read_raw(&n_data, sizeof(n_data)) || size - off < n_data) {
+            return false;
         }
-    }
 
-    result_timings get_timings() const {
-        result_timings timings;
-        timings.cache_n = n_prompt_tokens_cache;
+        *state   = data + off;
+        *n_state = n_data;
+        off += n_data;
 
-        timings.prompt_n            = n_prompt_tokens_processed;
-        timings.prompt_ms           = t_prompt_processing;
-        timings.prompt_per_token_ms = t_prompt_processing / n_prompt_tokens_processed;
-        timings.prompt_per_second   = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+        std::list<server_prompt_checkpoint> checkpoints;
 
-        timings.predicted_n            = n_decoded;
-        timings.predicted_ms           = t_token_generation;
-        timings.predicted_per_token_ms = t_token_generation / n_decoded;
-        timings.predicted_per_second   = 1e3 / t_token_generation * n_decoded;
+        uint32_t n_checkpoints = 0;
+        if (!read_raw(&n_checkpoints, sizeof(n_checkpoints))) {
+            return false;
+        }
 
-        // Add speculative metrics
-        if (n_draft_total > 0) {
-            timings.draft_n          = n_draft_total;
-            timings.draft_n_accepted = n_draft_accepted;
+        for (uint32_t i = 0; i < n_checkpoints; ++i) {
+            server_prompt_checkpoint cur;
+
+            uint64_t n_cur = 0;
+            if (!read_raw(&cur.pos_min, sizeof(cur.pos_min)) || !read_raw(&cur.pos_max, sizeof(cur.pos_max)) ||
+                !read_raw(&n_cur, sizeof(n_cur)) || size - off < n_cur) {
+                return false;
+            }
+
+            cur.data = std::vector<uint8_t>(data + off, data + off + n_cur);
+            off += n_cur;
+
+            checkpoints.push_back(std::move(cur));
         }
 
-        return timings;
+        prompt.tokens      = server_tokens(tokens, false);
+        prompt.checkpoints = std::move(checkpoints);
+        prompt.n_hits      = n_hits;
+        prompt.compressed  = flags & FILE_FLAG_COMPRESSED;
+        prompt.data.clear();
+
+        return true;
     }
 
-    const common_chat_msg & update_chat_msg(std::vector<common_chat_msg_diff> & diffs) {
-        GGML_ASSERT(task);
+    static bool write(const std::string & path, const server_prompt & prompt) {
+        // write to a temporary file first, so that a crash never leaves a truncated file behind
+        const std::string path_tmp = path + ".tmp";
 
-        auto previous_msg = chat_msg;
-        SRV_DBG("Parsing chat message: %s\n", generated_text.c_str());
-        auto new_msg = common_chat_parse(
-                generated_text,
-                /* is_partial= */ stop != STOP_TYPE_EOS,
-                task->params.oaicompat_chat_syntax);
-        if (!new_msg.empty()) {
-            new_msg.set_tool_call_ids(generated_tool_call_ids, gen_tool_call_id);
-            chat_msg = new_msg;
-            diffs = common_chat_msg_diff::compute_diffs(previous_msg, new_msg.empty() ? previous_msg : new_msg);
+        {
+            std::ofstream out(path_tmp, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                return false;
+            }
+
+            const auto write_raw = [&](const void * src, size_t n) {
+                out.write(reinterpret_cast<const char *>(src), n);
+            };
+
+            const auto & tokens = prompt.tokens.get_text_tokens();
+
+            const uint32_t magic         = FILE_MAGIC;
+            const uint32_t version       = FILE_VERSION;
+            const uint32_t n_tokens      = tokens.size();
+            const uint32_t n_hits        = prompt.n_hits;
+            const uint32_t flags         = prompt.compressed ? FILE_FLAG_COMPRESSED : 0;
+            const uint64_t n_data        = prompt.data.size();
+            const uint32_t n_checkpoints = prompt.checkpoints.size();
+
+            write_raw(&magic,    sizeof(magic));
+            write_raw(&version,  sizeof(version));
+            write_raw(&n_tokens, sizeof(n_tokens));
+            write_raw(tokens.data(), n_tokens*sizeof(llama_token));
+            write_raw(&n_hits,   sizeof(n_hits));
+            write_raw(&flags,    sizeof(flags));
+            write_raw(&n_data,   sizeof(n_data));
+            write_raw(prompt.data.data(), n_data);
+            write_raw(&n_checkpoints, sizeof(n_checkpoints));
+
+            for (const auto & cur : prompt.checkpoints) {
+                const uint64_t n_cur = cur.data.size();
+
+                write_raw(&cur.pos_min, sizeof(cur.pos_min));
+                write_raw(&cur.pos_max, sizeof(cur.pos_max));
+                write_raw(&n_cur,       sizeof(n_cur));
+                write_raw(cur.data.data(), n_cur);
+            }
+
+            out.flush();
+            if (!out) {
+                std::error_code ec;
+                std::filesystem::remove(path_tmp, ec);
+                return false;
+            }
         }
-        return chat_msg;
+
+        std::error_code ec;
+        std::filesystem::rename(path_tmp, path, ec);
+        if (ec) {
+            std::filesystem::remove(path_tmp, ec);
+            return false;
+        }
+
+        return true;
     }
 
-    size_t find_stopping_strings(const std::string & text, const size_t last_token_size, bool is_full_stop) {
-        GGML_ASSERT(task);
+    void write_loop() {
+        while (true) {
+            std::shared_ptr<write_job> job;
 
-        size_t stop_pos = std::string::npos;
+            {
+                std::unique_lock<std::mutex> lock(mutex_jobs);
+                condition_jobs.wait(lock, [&]() {
+                    return !jobs.empty() || !running;
+                });
 
-        for (const std::string & word : task->params.antiprompt) {
-            size_t pos;
+                if (jobs.empty()) {
+                    return;
+                }
 
-            if (is_full_stop) {
-                const size_t tmp      = word.size() + last_token_size;
-                const size_t from_pos = text.size() > tmp ? text.size() - tmp : 0;
+                job = std::move(jobs.front());
+                jobs.pop_front();
 
-                pos = text.find(word, from_pos);
-            } else {
-                // otherwise, partial stop
-                pos = string_find_partial_stop(text, word);
+                n_writing++;
             }
 
-            if (pos != std::string::npos && (stop_pos == std::string::npos || pos < stop_pos)) {
-                if (is_full_stop) {
-                    stop           = STOP_TYPE_WORD;
-                    stopping_word  = word;
-                    has_next_token = false;
+            if (job->state != WRITE_STATE_CANCELLED) {
+                job->ok = write(job->path, *job->prompt);
+
+                int expected = WRITE_STATE_PENDING;
+                if (!job->state.compare_exchange_strong(expected, WRITE_STATE_DONE)) {
+                    // the file was dropped from the cache while it was being written
+                    std::error_code ec;
+                    std::filesystem::remove(job->path, ec);
                 }
-                stop_pos = pos;
             }
-        }
 
-        return stop_pos;
+            {
+                std::unique_lock<std::mutex> lock(mutex_jobs);
+                n_writing--;
+            }
+            condition_jobs.notify_all();
+        }
     }
 
-    void print_timings() const {
-        const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
-        const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+    json to_json() const {
+        return json {
+            { "dir",            dir },
+            { "n_files",        files.size() },
+            { "size",           size() },
+            { "limit_size",     limit_size },
+            { "n_store",        stats.n_store },
+            { "n_load",         stats.n_load },
+            { "n_write_failed", stats.n_write_failed },
+            { "n_bytes_load",   stats.n_bytes_load },
+            { "t_load_ms",      stats.t_load_us / 1000.0 },
+        };
+    }
+};
 
-        const double t_gen        =       t_token_generation / n_decoded;
-        const double n_gen_second = 1e3 / t_token_generation * n_decoded;
+// background thread for the files of the slot save/restore tasks: the task loop only copies the state of the
+// slot to or from memory, the file is written or read here so that the other slots keep generating meanwhile
+//
+// the files have the layout of llama_state_seq_save_file():
+//   u32 magic, u32 version, u32 n_tokens, n_tokens x llama_token, state data
+struct server_slot_io {
+    server_slot_io() {
+        worker = std::thread([this]() {
+            loop();
+        });
+    }
 
-        SLT_INF(*this,
-                "\n"
-                "prompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
-                "       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
-                "      total time = %10.2f ms / %5d tokens\n",
-                t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
-                t_token_generation, n_decoded, t_gen, n_gen_second,
-                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+    ~server_slot_io() {
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            running = false;
+        }
+        condition_jobs.notify_all();
 
-        if (n_draft_total > 0) {
-            const float draft_ratio = (float) n_draft_accepted / n_draft_total;
-            SLT_INF(*this,
-                    "\n"
-                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
-                    draft_ratio, n_draft_accepted, n_draft_total
-            );
+        // the worker finishes the pending jobs before exiting
+        if (worker.joinable()) {
+            worker.join();
         }
     }
 
-    json to_json(bool only_metrics = false) const {
-        json res;
+    std::thread worker;
 
-        res = {
-                {"id",            id},
-                {"n_ctx",         n_ctx},
-                {"speculative",   can_speculate()},
-                {"is_processing", is_processing()},
-        };
+    std::mutex mutex_jobs;
+    std::condition_variable condition_jobs;
+    std::deque<std::function<void()>> jobs;
+    bool running = true;
 
-        const auto & ptask = task ? task : task_prev;
+    void submit(std::function<void()> && job) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs);
+            jobs.push_back(std::move(job));
+        }
+        condition_jobs.notify_one();
+    }
 
-        if (ptask) {
-            res["id_task"] = ptask->id;
-            res["params"] = ptask->params.to_json(only_metrics);
-            res["next_token"] = {
-                    {
-                            {"has_next_token", has_next_token},
-                            {"has_new_line",   has_new_line},
-                            {"n_remain",       n_remaining},
-                            {"n_decoded",      n_decoded},
-                    }
-            };
+    void loop() {
+        while (true) {
+            std::function<void()> job;
 
-            if (!only_metrics) {
-                res["prompt"] = ptask->tokens.detokenize(ctx, true);
-                res["generated"] = generated_text;
+            {
+                std::unique_lock<std::mutex> lock(mutex_jobs);
+                condition_jobs.wait(lock, [&]() {
+                    return !jobs.empty() || !running;
+                });
+
+                if (jobs.empty()) {
+                    return;
+                }
+
+                job = std::move(jobs.front());
+                jobs.pop_front();
             }
-        }
 
-        return res;
+            job();
+        }
     }
-};
-
-struct server_metrics {
-    int64_t t_start = 0;
 
-    uint64_t n_prompt_tokens_processed_total = 0;
-    uint64_t t_prompt_processing_total       = 0;
-    uint64_t n_tokens_predicted_total        = 0;
-    uint64_t t_tokens_generation_total       = 0;
+    // returns the size of the file, 0 on failure
+    static size_t write(const std::string & path, const llama_tokens & tokens, const std::vector<uint8_t> & state) {
+        // write to a temporary file first, so that a failed write never replaces a good file
+        const std::string path_tmp = path + ".tmp";
 
-    uint64_t n_past_max = 0;
+        const uint32_t magic    = LLAMA_STATE_SEQ_MAGIC;
+        const uint32_t version  = LLAMA_STATE_SEQ_VERSION;
+        const uint32_t n_tokens = tokens.size();
 
-    uint64_t n_prompt_tokens_processed = 0;
-    uint64_t t_prompt_processing       = 0;
+        FILE * f = fopen(path_tmp.c_str(), "wb");
+        if (f == nullptr) {
+            return 0;
+        }
 
-    uint64_t n_tokens_predicted  = 0;
-    uint64_t t_tokens_generation = 0;
+        // the state is written with a single large write, stdio buffering would only add a copy
+        setvbuf(f, nullptr, _IONBF, 0);
 
-    uint64_t n_decode_total     = 0;
-    uint64_t n_busy_slots_total = 0;
+        bool ok = true;
+        ok = ok && fwrite(&magic,    sizeof(magic),    1, f) == 1;
+        ok = ok && fwrite(&version,  sizeof(version),  1, f) == 1;
+        ok = ok && fwrite(&n_tokens, sizeof(n_tokens), 1, f) == 1;
+        ok = ok && fwrite(tokens.data(), sizeof(llama_token), n_tokens, f) == n_tokens;
+        ok = ok && fwrite(state.data(), 1, state.size(), f) == state.size();
+        ok = fclose(f) == 0 && ok;
 
-    void init() {
-        t_start = ggml_time_us();
-    }
-
-    void on_prompt_eval(const server_slot & slot) {
-        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
-        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
-        t_prompt_processing             += slot.t_prompt_processing;
-        t_prompt_processing_total       += slot.t_prompt_processing;
-
-        if (slot.n_past > 0) {
-            n_past_max = std::max(n_past_max, (uint64_t) slot.n_past);
+        std::error_code ec;
+        if (ok) {
+            std::filesystem::rename(path_tmp, path, ec);
         }
-    }
-
-    void on_prediction(const server_slot & slot) {
-        n_tokens_predicted_total   += slot.n_decoded;
-        n_tokens_predicted         += slot.n_decoded;
-        t_tokens_generation        += slot.t_token_generation;
-        t_tokens_generation_total  += slot.t_token_generation;
-    }
-
-    void on_decoded(const std::vector<server_slot> & slots) {
-        n_decode_total++;
-        for (const auto & slot : slots) {
-            if (slot.is_processing()) {
-                n_busy_slots_total++;
-            }
-            if (slot.n_past > 0) {
-                n_past_max = std::max(n_past_max, (uint64_t) slot.n_past);
-            }
+        if (!ok || ec) {
+            std::filesystem::remove(path_tmp, ec);
+            return 0;
         }
-    }
 
-    void reset_bucket() {
-        n_prompt_tokens_processed = 0;
-        t_prompt_processing       = 0;
-        n_tokens_predicted        = 0;
-        t_tokens_generation       = 0;
+        return 3*sizeof(uint32_t) + n_tokens*sizeof(llama_token) + state.size();
     }
-};
 
-struct server_queue {
-    int id = 0;
-    bool running;
+    // returns the size of the file, 0 on failure
+    static size_t read(const std::string & path, size_t n_tokens_max, llama_tokens & tokens, std::vector<uint8_t> & state) {
+        FileMapping mapping;
+        if (!mapping.open(path) || mapping.size() < 3*sizeof(uint32_t)) {
+            return 0;
+        }
 
-    // queues
-    std::deque<server_task> queue_tasks;
-    std::deque<server_task> queue_tasks_deferred;
+        const uint8_t * data = mapping.data();
 
-    std::mutex mutex_tasks;
-    std::condition_variable condition_tasks;
+        uint32_t header[3];
+        memcpy(header, data, sizeof(header));
 
-    // callback functions
-    std::function<void(server_task &&)> callback_new_task;
-    std::function<void(void)>           callback_update_slots;
+        const uint32_t magic    = header[0];
+        const uint32_t version  = header[1];
+        const uint32_t n_tokens = header[2];
 
-    // Add a new task to the end of the queue
-    int post(server_task && task, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        GGML_ASSERT(task.id != -1);
-        // if this is cancel task make sure to clean up pending tasks
-        if (task.type == SERVER_TASK_TYPE_CANCEL) {
-            cleanup_pending_task(task.id_target);
-        }
-        const int task_id = task.id;
-        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
-        if (front) {
-            queue_tasks.push_front(std::move(task));
-        } else {
-            queue_tasks.push_back(std::move(task));
+        if (magic != LLAMA_STATE_SEQ_MAGIC || version != LLAMA_STATE_SEQ_VERSION || n_tokens > n_tokens_max) {
+            return 0;
         }
-        condition_tasks.notify_one();
-        return task_id;
-    }
 
-    // multi-task version of post()
-    int post(std::vector<server_task> && tasks, bool front = false) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        for (auto & task : tasks) {
-            if (task.id == -1) {
-                task.id = id++;
-            }
-            // if this is cancel task make sure to clean up pending tasks
-            if (task.type == SERVER_TASK_TYPE_CANCEL) {
-                cleanup_pending_task(task.id_target);
-            }
-            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
-            if (front) {
-                queue_tasks.push_front(std::move(task));
-            } else {
-                queue_tasks.push_back(std::move(task));
-            }
+        const size_t offset = sizeof(header) + n_tokens*sizeof(llama_token);
+        if (mapping.size() < offset) {
+            return 0;
         }
-        condition_tasks.notify_one();
-        return 0;
-    }
 
-    // Add a new task, but defer until one slot is available
-    void defer(server_task && task) {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        QUE_DBG("defer task, id = %d\n", task.id);
-        queue_tasks_deferred.push_back(std::move(task));
-        condition_tasks.notify_one();
-    }
+        tokens.resize(n_tokens);
+        memcpy(tokens.data(), data + sizeof(header), n_tokens*sizeof(llama_token));
 
-    // Get the next id for creating a new task
-    int get_new_id() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        int new_id = id++;
-        return new_id;
-    }
+        // copied out of the mapping here, so that the page faults are taken by this thread and not by the task loop
+        state.assign(data + offset, data + mapping.size());
 
-    // Register function to process a new task
-    void on_new_task(std::function<void(server_task &&)> callback) {
-        callback_new_task = std::move(callback);
+        return mapping.size();
     }
+};
 
-    // Register the function to be called when all slots data is ready to be processed
-    void on_update_slots(std::function<void(void)> callback) {
-        callback_update_slots = std::move(callback);
+struct server_prompt_cache {
+    server_prompt_cache(int32_t limit_size_mib, size_t limit_tokens) {
+        this->limit_size   = 1024ull*1024ull*(limit_size_mib < 0 ? 0 : limit_size_mib);
+        this->limit_tokens = limit_tokens;
     }
 
-    // Call when the state of one slot is changed, it will move one task from deferred to main queue
-    void pop_deferred_task() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        if (!queue_tasks_deferred.empty()) {
-            queue_tasks.emplace_front(std::move(queue_tasks_deferred.front()));
-            queue_tasks_deferred.pop_front();
-        }
-        condition_tasks.notify_one();
-    }
+    enum entry_class {
+        ENTRY_CLASS_PINNED,   // holds a pinned prefix
+        ENTRY_CLASS_FREQUENT, // reused from the cache at least once
+        ENTRY_CLASS_ONE_SHOT, // never reused so far
 
-    // end the start_loop routine
-    void terminate() {
-        std::unique_lock<std::mutex> lock(mutex_tasks);
-        running = false;
-        condition_tasks.notify_all();
-    }
+        ENTRY_CLASS_COUNT,
+    };
 
-    /**
-     * Main loop consists of these steps:
-     * - Wait until a new task arrives
-     * - Process the task (i.e. maybe copy data into slot)
-     * - Check if multitask is finished
-     * - Update all slots
-     */
-    void start_loop() {
-        running = true;
+    struct entry {
+        int32_t id;
 
-        while (true) {
-            QUE_DBG("%s", "processing new tasks\n");
+        // as accounted in size_total and n_tokens_total - the prompt can be moved out before the entry is erased
+        size_t size;
+        size_t n_tokens;
 
-            while (true) {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    lock.unlock();
-                    break;
-                }
-                server_task task = std::move(queue_tasks.front());
-                queue_tasks.pop_front();
-                lock.unlock();
+        // access frequency, decayed as of t_last (us)
+        double  freq;
+        int64_t t_last;
 
-                QUE_DBG("processing task, id = %d\n", task.id);
-                callback_new_task(std::move(task));
-            }
+        // position in by_value - entries with a lower value are evicted first
+        double value;
 
-            // all tasks in the current loop is processed, slots data is now ready
-            QUE_DBG("%s", "update slots\n");
+        server_prompt prompt;
+    };
 
-            callback_update_slots();
+    // oldest first
+    std::list<entry> states;
 
-            QUE_DBG("%s", "waiting for new tasks\n");
-            {
-                std::unique_lock<std::mutex> lock(mutex_tasks);
-                if (!running) {
-                    QUE_DBG("%s", "terminate\n");
-                    return;
-                }
-                if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
-                        return (!queue_tasks.empty() || !running);
-                    });
-                }
-            }
-        }
-    }
+    // entry id -> position in the list, and a radix tree over the cached tokens keyed by entry id
+    std::unordered_map<int32_t, std::list<entry>::iterator> entries;
+    server_prefix_tree index;
 
-private:
-    void cleanup_pending_task(int id_target) {
-        // no need lock because this is called exclusively by post()
-        auto rm_func = [id_target](const server_task & task) {
-            return task.id == id_target;
-        };
-        queue_tasks.erase(
-                std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
-                queue_tasks.end());
-        queue_tasks_deferred.erase(
-                std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
-                queue_tasks_deferred.end());
-    }
-};
+    // eviction order
+    std::set<std::pair<double, int32_t>> by_value;
 
-struct server_response {
-    bool running = true;
+    // named prefixes that are never evicted: the last cached prompt that holds a pinned prefix is kept
+    std::map<std::string, llama_tokens> pins;
 
-    // for keeping track of all tasks waiting for the result
-    std::unordered_set<int> waiting_task_ids;
+    // optional second tier for the evicted prompts
+    std::unique_ptr<server_prompt_cache_disk> disk;
 
-    // the main result queue (using ptr for polymorphism)
-    std::vector<server_task_result_ptr> queue_results;
+    server_prompt_compression compression;
 
-    std::mutex mutex_results;
-    std::condition_variable condition_results;
+    int32_t id_next = 0;
 
-    // add the id_task to the list of tasks waiting for response
-    void add_waiting_task_id(int id_task) {
-        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+    // in bytes, 0 = no limit
+    size_t limit_size = 0;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.insert(id_task);
+    // in tokens, 0 = no limit
+    size_t limit_tokens = 0;
+
+    // the access frequency of an entry halves after this many seconds without use
+    double t_half_life_s = 300.0;
+
+    // tracked incrementally on insert and erase
+    size_t size_total     = 0;
+    size_t n_tokens_total = 0;
+
+    struct {
+        uint64_t n_lookup   = 0;
+        uint64_t n_miss     = 0;
+        uint64_t n_hit_disk = 0;
+
+        uint64_t n_hit  [ENTRY_CLASS_COUNT] = {};
+        uint64_t n_evict[ENTRY_CLASS_COUNT] = {};
+
+        // size of the uncompressed state per token, from the last state stored
+        double bytes_per_token = 0.0;
+    } stats;
+
+    // bytes restored by a lookup, and estimated bytes of the KV that the lookup could not provide
+    // owned by server_metrics
+    Histogram * hist_hit_bytes  = nullptr;
+    Histogram * hist_miss_bytes = nullptr;
+
+    size_t size() const {
+        return size_total;
     }
 
-    void add_waiting_tasks(const std::vector<server_task> & tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    size_t n_tokens() const {
+        return n_tokens_total;
+    }
 
-        for (const auto & task : tasks) {
-            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
-            waiting_task_ids.insert(task.id);
-        }
+    // the decayed frequency of an entry at time t is freq*2^(-(t - t_last)/t_half_life), so in log2 space all entries
+    // decay by the same amount and their order never changes - weigh it by the recompute cost (tokens) per byte held
+    double entry_value(const entry & e) const {
+        return std::log2(e.freq) + (e.t_last / 1e6) / t_half_life_s + std::log2(double(e.n_tokens + 1) / double(e.size + 1));
     }
 
-    // when the request is finished, we can remove task associated with it
-    void remove_waiting_task_id(int id_task) {
-        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+    void entry_touch(entry & e, int64_t t_now) {
+        by_value.erase({ e.value, e.id });
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        waiting_task_ids.erase(id_task);
-        // make sure to clean up all pending results
-        queue_results.erase(
-                std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
-                    return res->id == id_task;
-                }),
-                queue_results.end());
+        e.freq   = e.freq*std::exp2(-((t_now - e.t_last) / 1e6) / t_half_life_s) + 1.0;
+        e.t_last = t_now;
+        e.value  = entry_value(e);
+
+        by_value.insert({ e.value, e.id });
     }
 
-    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
-        std::unique_lock<std::mutex> lock(mutex_results);
+    static bool entry_holds(const entry & e, const llama_tokens & tokens) {
+        const auto & cur = e.prompt.tokens.get_text_tokens();
 
-        for (const auto & id_task : id_tasks) {
-            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
-            waiting_task_ids.erase(id_task);
+        return cur.size() >= tokens.size() && std::equal(tokens.begin(), tokens.end(), cur.begin());
+    }
+
+    entry_class get_class(const entry & e) const {
+        for (const auto & pin : pins) {
+            if (entry_holds(e, pin.second)) {
+                return ENTRY_CLASS_PINNED;
+            }
         }
+
+        return e.prompt.n_hits > 0 ? ENTRY_CLASS_FREQUENT : ENTRY_CLASS_ONE_SHOT;
     }
 
-    // This function blocks the thread until there is a response for one of the id_tasks
-    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
-        while (true) {
-            std::unique_lock<std::mutex> lock(mutex_results);
-            condition_results.wait(lock, [&]{
-                if (!running) {
-                    SRV_DBG("%s : queue result stop\n", __func__);
-                    std::terminate(); // we cannot return here since the caller is HTTP code
+    // ids of the entries that are protected because they are the only one that holds one of the pinned prefixes
+    std::unordered_set<int32_t> protected_ids() const {
+        std::unordered_set<int32_t> res;
+        for (const auto & pin : pins) {
+            int     n_holders = 0;
+            int32_t id_holder = -1;
+            for (const auto & match : index.find(pin.second)) {
+                if (match.n_common == pin.second.size()) {
+                    n_holders++;
+                    id_holder = match.id;
                 }
-                return !queue_results.empty();
-            });
+            }
 
-            for (size_t i = 0; i < queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
-                }
+            if (n_holders == 1) {
+                res.insert(id_holder);
             }
         }
 
-        // should never reach here
+        return res;
+    }
+
+    void pin(const std::string & name, const llama_tokens & tokens) {
+        pins[name] = tokens;
+    }
+
+    bool unpin(const std::string & name) {
+        return pins.erase(name) > 0;
+    }
+
+    std::list<entry>::iterator erase(std::list<entry>::iterator it) {
+        size_total     -= it->size;
+        n_tokens_total -= it->n_tokens;
+
+        by_value.erase({ it->value, it->id });
+        index.remove(it->id);
+        entries.erase(it->id);
+
+        return states.erase(it);
+    }
+
+    // evict the entry with the lowest value that is not protected by a pin
+    bool evict() {
+        const auto ids_protected = protected_ids();
+
+        for (const auto & cur : by_value) {
+            if (ids_protected.count(cur.second) > 0) {
+                continue;
+            }
+
+            auto it = entries.at(cur.second);
+
+            SRV_WRN(" - removing entry with %d tokens, %d hits (size = %.3f MiB, value = %.3f)\n",
+                    (int) it->n_tokens, (int) it->prompt.n_hits, it->size / (1024.0 * 1024.0), it->value);
+
+            stats.n_evict[get_class(*it)]++;
+
+            if (disk) {
+                disk->store(std::move(it->prompt));
+            }
+
+            erase(it);
+
+            return true;
+        }
+
+        return false;
+    }
+
+    // add an entry for the prompt and return the buffer to fill with its state, then call commit().
+    // returns nullptr if the prompt is not cached
+    uint8_t * alloc(const server_prompt & prompt, size_t state_size) {
+        const auto & tokens = prompt.tokens.get_text_tokens();
+
+        if (!tokens.empty()) {
+            stats.bytes_per_token = double(state_size) / tokens.size();
+        }
+
+        const int64_t t_now = ggml_time_us();
+
+        // first check if the current state is contained fully in the cache
+        if (index.n_common_max(tokens) == tokens.size()) {
+            SRV_WRN("%s", " - prompt is already in the cache, skipping\n");
+
+            // count this as a use of the cached prompts that contain it
+            for (const auto & match : index.find(tokens)) {
+                if (match.n_common == tokens.size()) {
+                    entry_touch(*entries.at(match.id), t_now);
+                }
+            }
+
+            return nullptr;
+        }
+
+        double   freq   = 0.0;
+        uint32_t n_hits = prompt.n_hits;
+
+        // next, remove any cached prompts that are fully contained in the current prompt
+        for (const int32_t id : index.find_prefixes(tokens)) {
+            auto it = entries.at(id);
+
+            SRV_WRN(" - removing obsolete cached prompt with length %d\n", it->prompt.n_tokens());
+
+            // the new prompt inherits the history of the prompts it replaces
+            freq   = std::max(freq, it->freq*std::exp2(-((t_now - it->t_last) / 1e6) / t_half_life_s));
+            n_hits = std::max(n_hits, it->prompt.n_hits);
+
+            erase(it);
+        }
+
+        if (disk) {
+            disk->erase_prefixes(tokens);
+        }
+
+        // TODO: for some reason we can't copy server_tokens, so we have to do this workaround
+        server_prompt cur = {
+                /*.tokens      =*/ server_tokens(tokens, false),
+                /*.data        =*/ {},
+                /*.checkpoints =*/ prompt.checkpoints,
+                /*.n_hits      =*/ n_hits,
+        };
+
+        uint8_t * state_data = nullptr;
+
+        // check if we can allocate enough memory for the new state
+        try {
+            state_data = cur.data.alloc(state_size);
+        } catch (const std::bad_alloc & e) {
+            SRV_ERR("failed to allocate memory for prompt cache state: %s\n", e.what());
+
+            limit_size = std::max<size_t>(1, 0.4*size());
+
+            SRV_WRN(" - cache size limit reduced to %.3f MiB\n", limit_size / (1024.0 * 1024.0));
+
+            update();
+
+            return nullptr;
+        }
+
+        insert(std::move(cur), std::max(freq, double(n_hits)) + 1.0);
+
+        return state_data;
+    }
+
+    void set_disk(std::unique_ptr<server_prompt_cache_disk> && tier) {
+        disk = std::move(tier);
+        disk->compression = &compression;
+    }
+
+    // called once the state of the last allocated prompt has been filled
+    void commit() {
+        auto & cur = states.back();
+
+        if (!compression.enabled) {
+            return;
+        }
+
+        compression.compress(cur.prompt);
+
+        by_value.erase({ cur.value, cur.id });
+
+        size_total -= cur.size;
+        cur.size    = cur.prompt.size();
+        size_total += cur.size;
+
+        cur.value = entry_value(cur);
+        by_value.insert({ cur.value, cur.id });
+    }
+
+    // add a prompt with its state to the cache, the caller is responsible for the limits (see update())
+    server_prompt * insert(server_prompt && prompt, double freq) {
+        auto & cur = states.emplace_back();
+        cur.id       = id_next++;
+        cur.prompt   = std::move(prompt);
+        cur.size     = cur.prompt.size();
+        cur.n_tokens = cur.prompt.n_tokens();
+        cur.freq     = freq;
+        cur.t_last   = ggml_time_us();
+        cur.value    = entry_value(cur);
+
+        size_total     += cur.size;
+        n_tokens_total += cur.n_tokens;
+
+        index.insert(cur.id, cur.prompt.tokens.get_text_tokens());
+        entries[cur.id] = std::prev(states.end());
+        by_value.insert({ cur.value, cur.id });
+
+        return &cur.prompt;
+    }
+
+    bool load(server_prompt & prompt, const server_tokens & tokens_new, llama_context * ctx, int32_t id_slot) {
+        const int lcp_best = prompt.tokens.get_common_prefix(tokens_new);
+
+        float f_keep_best = float(lcp_best) / prompt.tokens.size();
+        float sim_best    = float(lcp_best) / tokens_new.size();
+
+        SRV_WRN(" - looking for better prompt, base f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
+
+        auto it_best = states.end();
+
+        // find the most similar cached prompt, that would also preserve the most context
+        // only the cached prompts that share a prefix with the new tokens are visited
+        for (const auto & match : index.find(tokens_new.get_text_tokens())) {
+            auto it = entries.at(match.id);
+
+            const int lcp_cur = match.n_common;
+
+            const float f_keep_cur = float(lcp_cur) / it->prompt.tokens.size();
+            const float sim_cur    = float(lcp_cur) / tokens_new.size();
+
+            // don't trash large prompts
+            if (f_keep_cur < 0.25f) {
+                continue;
+            }
+
+            if (f_keep_best < f_keep_cur && sim_best < sim_cur) {
+                f_keep_best = f_keep_cur;
+                sim_best    = sim_cur;
+
+                it_best = it;
+            }
+        }
+
+        stats.n_lookup++;
+
+        // a prompt spilled to disk is used only if it is better than the ones in memory
+        // the finished writes are collected first, so that find() does not return a file whose write failed
+        if (disk) {
+            disk->collect();
+        }
+        const int32_t id_disk = disk ? disk->find(tokens_new, f_keep_best, sim_best) : -1;
+
+        if (id_disk >= 0) {
+            SRV_WRN(" - found better prompt on disk with f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
+
+            const uint64_t n_bytes_load = disk->stats.n_bytes_load;
+
+            if (!disk->load(id_disk, prompt, ctx, id_slot)) {
+                return false;
+            }
+
+            stats.n_hit_disk++;
+            prompt.n_hits++;
+
+            if (hist_hit_bytes) {
+                hist_hit_bytes->observe(disk->stats.n_bytes_load - n_bytes_load);
+            }
+        } else if (it_best == states.end()) {
+            stats.n_miss++;
+        } else {
+            SRV_WRN(" - found better prompt with f_keep = %.3f, sim = %.3f\n", f_keep_best, sim_best);
+
+            if (!compression.decompress(it_best->prompt)) {
+                SRV_WRN("%s", "failed to decompress cached prompt\n");
+
+                erase(it_best);
+
+                return false;
+            }
+
+            const size_t size = it_best->prompt.data.size();
+            const size_t n = llama_state_seq_set_data_ext(ctx, it_best->prompt.data.data(), size, id_slot, 0);
+            if (n != size) {
+                SRV_WRN("failed to restore state with size %zu\n", size);
+
+                // the entry is decompressed now and no longer matches its accounted size
+                erase(it_best);
+
+                return false;
+            }
+
+            stats.n_hit[get_class(*it_best)]++;
+
+            if (hist_hit_bytes) {
+                hist_hit_bytes->observe(size);
+            }
+
+            it_best->prompt.data.clear();
+            it_best->prompt.n_hits++;
+
+            prompt = std::move(it_best->prompt);
+
+            erase(it_best);
+        }
+
+        if (hist_miss_bytes && stats.bytes_per_token > 0.0) {
+            hist_miss_bytes->observe((1.0f - sim_best)*tokens_new.size()*stats.bytes_per_token);
+        }
+
+        return true;
+    }
+
+    void update() {
+        if (limit_size > 0) {
+            // always keep at least one state, regardless of the limits
+            while (states.size() > 1 && size() > limit_size) {
+                if (!evict()) {
+                    SRV_WRN("%s", " - cache size limit reached, but all remaining entries hold pinned prefixes\n");
+                    break;
+                }
+            }
+        }
+
+        if (limit_tokens > 0) {
+            while (states.size() > 1 && n_tokens() > limit_tokens) {
+                if (!evict()) {
+                    SRV_WRN("%s", " - cache token limit reached, but all remaining entries hold pinned prefixes\n");
+                    break;
+                }
+            }
+        }
+
+        SRV_WRN(" - cache state: %zu prompts, %.3f MiB (limits: %.3f MiB, %zu tokens)\n",
+                states.size(), size() / (1024.0 * 1024.0), limit_size / (1024.0 * 1024.0), limit_tokens);
+
+        for (const auto & state : states) {
+            SRV_WRN("   - prompt %p: %7d tokens, checkpoints: %2zu, %9.3f MiB\n", (const void *)&state.prompt, state.prompt.n_tokens(), state.prompt.checkpoints.size(), state.size / (1024.0 * 1024.0));
+        }
+    }
+
+    json to_json() const {
+        static const char * class_names[ENTRY_CLASS_COUNT] = { "pinned", "frequent", "one_shot" };
+
+        // the lookups that failed to restore a state are neither hits nor misses
+        uint64_t n_hit_total = stats.n_hit_disk;
+
+        json classes = json::object();
+        for (int i = 0; i < ENTRY_CLASS_COUNT; ++i) {
+            const uint64_t n_hit   = stats.n_hit[i];
+            const uint64_t n_evict = stats.n_evict[i];
+
+            n_hit_total += n_hit;
+
+            classes[class_names[i]] = {
+                { "n_hit",           n_hit },
+                { "n_evict",         n_evict },
+                // share of the lookups served by an entry of the class, the rates of the classes and of the disk add up to hit_rate
+                { "hit_rate",        stats.n_lookup > 0 ? double(n_hit) / stats.n_lookup : 0.0 },
+                // share of the entries of the class that left the cache through a hit rather than an eviction
+                { "hit_evict_ratio", n_hit + n_evict > 0 ? double(n_hit) / (n_hit + n_evict) : 0.0 },
+            };
+        }
+
+        json pins_data = json::array();
+        for (const auto & pin : pins) {
+            int n_holders = 0;
+            for (const auto & match : index.find(pin.second)) {
+                n_holders += match.n_common == pin.second.size();
+            }
+
+            pins_data.push_back({
+                { "name",      pin.first },
+                { "n_tokens",  pin.second.size() },
+                { "n_holders", n_holders },
+            });
+        }
+
+        return json {
+            { "n_prompts",    states.size() },
+            { "n_tokens",     n_tokens() },
+            { "size",         size() },
+            { "limit_size",   limit_size },
+            { "limit_tokens", limit_tokens },
+            { "n_lookup",     stats.n_lookup },
+            { "n_miss",       stats.n_miss },
+            { "n_hit_disk",   stats.n_hit_disk },
+            { "hit_rate",     stats.n_lookup > 0 ? double(n_hit_total) / stats.n_lookup : 0.0 },
+            { "classes",      classes },
+            { "pins",         pins_data },
+            { "disk",         disk ? disk->to_json() : json(nullptr) },
+            { "compression",  compression.to_json() },
+        };
+    }
+};
+
+// a task preempted by a task of higher priority, with what is needed to resume it in any slot
+struct server_slot_suspended {
+    std::unique_ptr<const server_task> task;
+
+    slot_state state = SLOT_STATE_IDLE;
+
+    // the sampler is moved out of the slot, the generation continues with the same sampling state (RNG, penalties, grammar)
+    struct common_sampler * smpl = nullptr;
+    std::mt19937            rng;
+    std::string             smpl_key;
+
+    // cached tokens, checkpoints and state of the sequence
+    server_prompt prompt;
+
+    std::vector<common_adapter_lora_info> lora;
+    int32_t alora_invocation_start = -1;
+
+    json               json_schema;
+    llama_token        sampled = LLAMA_TOKEN_NULL;
+    common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+
+    int32_t n_past                    = 0;
+    int32_t n_decoded                 = 0;
+    int32_t n_prompt_tokens_cache     = 0;
+    int32_t n_prompt_tokens_processed = 0;
+
+    size_t       last_nl_pos = 0;
+    std::string  generated_text;
+    utf8_tail    generated_utf8;
+    llama_tokens generated_tokens;
+
+    StopMatcher stop_matcher;
+
+    common_chat_msg chat_msg;
+    size_t          chat_msg_n_parsed = 0;
+
+    std::vector<completion_token_output> generated_token_probs;
+    std::vector<std::string>             generated_tool_call_ids;
+
+    bool has_new_line = false;
+    bool truncated    = false;
+
+    size_t n_sent_text = 0;
+
+    int64_t t_start_process_prompt = 0;
+    int64_t t_start_generation     = 0;
+    double  t_prompt_processing    = 0.0;
+
+    int32_t n_draft_total    = 0;
+    int32_t n_draft_accepted = 0;
+
+    bool deadline_met = false;
+
+    int64_t t_suspend = 0;
+};
+
+struct server_slot {
+    int id;
+
+    llama_batch batch_spec = {};
+
+    // TODO: change to unique_ptrs for consistency:
+    llama_context * ctx = nullptr;
+    llama_context * ctx_dft = nullptr;
+
+    // multimodal
+    mtmd_context * mctx = nullptr;
+
+    common_speculative * spec = nullptr;
+
+    std::unique_ptr<const server_task> task;
+    std::unique_ptr<const server_task> task_prev; // used for debugging
+
+    // used to determine the slot that has been used the longest
+    int64_t t_last_used = -1;
+
+    // generation props
+    int32_t n_ctx       = 0;  // context size per slot
+    int32_t n_past      = 0;
+    int32_t n_keep      = 0;
+    int32_t n_decoded   = 0;
+    int32_t n_remaining = -1;
+    int32_t i_batch     = -1;
+
+    // the slot has tokens in the batch that is being built
+    bool batched = false;
+
+    // the first token was produced before the deadline of the task
+    bool deadline_met = false;
+
+    int32_t n_prompt_tokens_cache     = 0;
+    int32_t n_prompt_tokens_processed = 0;
+
+    int32_t n_prompt_tokens() const {
+        return task->tokens.size();
+    }
+
+    size_t last_nl_pos = 0;
+
+    std::string  generated_text;
+    utf8_tail    generated_utf8; // state of the last character of generated_text
+    llama_tokens generated_tokens;
+
+    // stop strings of the task, advanced over generated_text as it grows
+    StopMatcher stop_matcher;
+
+    common_chat_msg chat_msg;
+
+    // length of generated_text when chat_msg was last parsed from it, see update_chat_msg()
+    size_t chat_msg_n_parsed = 0;
+
+    std::vector<completion_token_output> generated_token_probs;
+
+    // scratch buffer for the top tokens when computing the probs from the logits
+    std::vector<llama_token_data> probs_top;
+
+    bool has_next_token = true;
+    bool has_new_line   = false;
+    bool truncated      = false;
+
+    stop_type stop;
+
+    std::string stopping_word;
+
+    // state
+    slot_state state = SLOT_STATE_IDLE;
+
+    server_prompt prompt;
+
+    void prompt_save(server_prompt_cache & prompt_cache) const {
+        assert(prompt.data.size() == 0);
+
+        const size_t cur_size = llama_state_seq_get_size_ext(ctx, id, 0);
+
+        SRV_WRN(" - saving prompt with length %d, total state size = %.3f MiB\n",
+                (int) prompt.tokens.size(), cur_size / (1024.0 * 1024.0));
+
+        uint8_t * cur = prompt_cache.alloc(prompt, cur_size);
+        if (cur == nullptr) {
+            return;
+        }
+
+        llama_state_seq_get_data_ext(ctx, cur, cur_size, id, 0);
+
+        prompt_cache.commit();
+    }
+
+    void prompt_load(server_prompt_cache & prompt_cache, const server_tokens & tokens) {
+        bool res = prompt_cache.load(prompt, tokens, ctx, id);
+        if (!res) {
+            SLT_WRN(*this, "%s", "failed to load prompt from cache\n");
+        }
+    }
+
+    std::vector<common_adapter_lora_info> lora;
+    int32_t alora_invocation_start = -1;
+
+    // sampling
+    json json_schema;
+
+    struct common_sampler * smpl = nullptr;
+
+    // RNG of the fast samplers (see slot_params::fast_sampler)
+    std::mt19937 rng;
+
+    // key of the sampler in the sampler cache, empty if it was not created from the cache
+    std::string smpl_key;
+
+    llama_token sampled;
+
+    common_chat_format chat_format = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+    std::vector<std::string> generated_tool_call_ids;
+
+    // stats
+    size_t n_sent_text = 0; // number of sent text character
+
+    int64_t t_start_process_prompt;
+    int64_t t_start_generation;
+
+    double t_prompt_processing; // ms
+    double t_token_generation;  // ms
+
+    // time of the last generated token, 0 before the first one (see server_metrics::on_token())
+    int64_t t_last_token = 0;
+
+    std::function<void(int)> callback_on_release;
+
+    // Speculative decoding stats
+    int32_t n_draft_total = 0;      // Total draft tokens generated
+    int32_t n_draft_accepted = 0;   // Draft tokens actually accepted
+
+    void reset() {
+        SLT_DBG(*this, "%s", "\n");
+
+        n_prompt_tokens_cache = 0;
+
+        last_nl_pos    = 0;
+        generated_text = "";
+        generated_utf8 = {};
+        has_new_line   = false;
+        truncated      = false;
+        stop           = STOP_TYPE_NONE;
+        stopping_word  = "";
+        n_past         = 0;
+        n_sent_text    = 0;
+        chat_format    = COMMON_CHAT_FORMAT_CONTENT_ONLY;
+
+        generated_tokens.clear();
+        generated_token_probs.clear();
+        stop_matcher = StopMatcher();
+        chat_msg = {};
+        chat_msg_n_parsed = 0;
+        json_schema = json();
+        generated_tool_call_ids.clear();
+
+        // clear speculative decoding stats
+        n_draft_total = 0;
+        n_draft_accepted = 0;
+
+        t_last_token = 0;
+
+        deadline_met = false;
+
+        task.reset();
+        task_prev.reset();
+
+        // clear alora start
+        alora_invocation_start = -1;
+    }
+
+    bool need_embd() const {
+        GGML_ASSERT(task);
+
+        return server_task_type_need_embd(task->type);
+    }
+
+    bool need_logits() const {
+        GGML_ASSERT(task);
+
+        return server_task_type_need_logits(task->type);
+    }
+
+    // if the context does not have a memory module then all embeddings have to be computed within a single ubatch
+    // also we cannot split if the pooling would require any past tokens
+    bool can_split() const {
+        return
+                !need_embd() ||
+                (llama_get_memory(ctx) && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_LAST);
+    }
+
+    bool can_batch_with(server_slot & other_slot) const {
+        GGML_ASSERT(task);
+
+        return task->type == other_slot.task->type && are_lora_equal(lora, other_slot.lora);
+    }
+
+    bool has_budget(const common_params & global_params) {
+        GGML_ASSERT(task);
+
+        if (task->params.n_predict == -1 && global_params.n_predict == -1) {
+            return true; // limitless
+        }
+
+        n_remaining = -1;
+
+        if (task->params.n_predict != -1) {
+            n_remaining = task->params.n_predict - n_decoded;
+        } else if (global_params.n_predict != -1) {
+            n_remaining = global_params.n_predict - n_decoded;
+        }
+
+        return n_remaining > 0; // no budget
+    }
+
+    bool is_processing() const {
+        return state != SLOT_STATE_IDLE;
+    }
+
+    bool can_speculate() const {
+        return ctx_dft;
+    }
+
+    void add_token(const completion_token_output & token) {
+        if (!is_processing()) {
+            SLT_WRN(*this, "%s", "slot is not processing\n");
+            return;
+        }
+        generated_token_probs.push_back(token);
+    }
+
+    // move the task and its state out of the slot, the state of the sequence is saved to host memory
+    void suspend(server_slot_suspended & res) {
+        GGML_ASSERT(task);
+
+        const size_t size = llama_state_seq_get_size_ext(ctx, id, 0);
+
+        llama_state_seq_get_data_ext(ctx, res.prompt.data.alloc(size), size, id, 0);
+
+        llama_memory_seq_rm(llama_get_memory(ctx), id, -1, -1);
+
+        res.prompt.tokens      = std::move(prompt.tokens);
+        res.prompt.checkpoints = std::move(prompt.checkpoints);
+
+        prompt.tokens = server_tokens();
+        prompt.tokens.has_mtmd = mctx != nullptr;
+        prompt.checkpoints.clear();
+
+        res.smpl     = smpl;
+        smpl         = nullptr;
+        res.rng      = rng;
+        res.smpl_key = std::move(smpl_key);
+
+        res.lora                   = lora;
+        res.alora_invocation_start = alora_invocation_start;
+
+        res.json_schema = std::move(json_schema);
+        res.sampled     = sampled;
+        res.chat_format = chat_format;
+
+        res.n_past                    = n_past;
+        res.n_decoded                 = n_decoded;
+        res.n_prompt_tokens_cache     = n_prompt_tokens_cache;
+        res.n_prompt_tokens_processed = n_prompt_tokens_processed;
+
+        res.last_nl_pos      = last_nl_pos;
+        res.generated_text   = std::move(generated_text);
+        res.generated_utf8   = generated_utf8;
+        res.generated_tokens = std::move(generated_tokens);
+        res.stop_matcher     = std::move(stop_matcher);
+        res.chat_msg         = std::move(chat_msg);
+        res.chat_msg_n_parsed = chat_msg_n_parsed;
+
+        res.generated_token_probs   = std::move(generated_token_probs);
+        res.generated_tool_call_ids = std::move(generated_tool_call_ids);
+
+        res.has_new_line = has_new_line;
+        res.truncated    = truncated;
+        res.n_sent_text  = n_sent_text;
+
+        res.t_start_process_prompt = t_start_process_prompt;
+        res.t_start_generation     = t_start_generation;
+        res.t_prompt_processing    = t_prompt_processing;
+
+        res.n_draft_total    = n_draft_total;
+        res.n_draft_accepted = n_draft_accepted;
+
+        res.deadline_met = deadline_met;
+
+        res.state     = state;
+        res.task      = std::move(task);
+        res.t_suspend = ggml_time_us();
+
+        SLT_INF(*this, "suspended task %d, n_past = %d, n_decoded = %d, state size = %.3f MiB\n",
+                res.task->id, res.n_past, res.n_decoded, size / (1024.0 * 1024.0));
+
+        reset();
+
+        t_last_used = ggml_time_us();
+        state       = SLOT_STATE_IDLE;
+    }
+
+    // continue a suspended task in this slot, the data of the state must not be compressed
+    bool resume(server_slot_suspended & src) {
+        const size_t size = src.prompt.data.size();
+        if (llama_state_seq_set_data_ext(ctx, src.prompt.data.data(), size, id, 0) != size) {
+            llama_memory_seq_rm(llama_get_memory(ctx), id, -1, -1);
+            return false;
+        }
+
+        reset();
+
+        prompt.tokens      = std::move(src.prompt.tokens);
+        prompt.checkpoints = std::move(src.prompt.checkpoints);
+        src.prompt.data.clear();
+
+        if (smpl != nullptr) {
+            common_sampler_free(smpl);
+        }
+        smpl     = src.smpl;
+        src.smpl = nullptr;
+        rng      = src.rng;
+        smpl_key = std::move(src.smpl_key);
+
+        lora                   = src.lora;
+        alora_invocation_start = src.alora_invocation_start;
+
+        json_schema = std::move(src.json_schema);
+        sampled     = src.sampled;
+        chat_format = src.chat_format;
+
+        n_past                    = src.n_past;
+        n_decoded                 = src.n_decoded;
+        n_prompt_tokens_cache     = src.n_prompt_tokens_cache;
+        n_prompt_tokens_processed = src.n_prompt_tokens_processed;
+
+        last_nl_pos      = src.last_nl_pos;
+        generated_text   = std::move(src.generated_text);
+        generated_utf8   = src.generated_utf8;
+        generated_tokens = std::move(src.generated_tokens);
+        stop_matcher     = std::move(src.stop_matcher);
+        chat_msg         = std::move(src.chat_msg);
+        chat_msg_n_parsed = src.chat_msg_n_parsed;
+
+        generated_token_probs   = std::move(src.generated_token_probs);
+        generated_tool_call_ids = std::move(src.generated_tool_call_ids);
+
+        has_new_line = src.has_new_line;
+        truncated    = src.truncated;
+        n_sent_text  = src.n_sent_text;
+
+        // the time spent suspended does not count in the timings and in the time limits
+        const int64_t t_suspended = ggml_time_us() - src.t_suspend;
+
+        t_start_process_prompt = src.t_start_process_prompt + t_suspended;
+        t_start_generation     = src.t_start_generation > 0 ? src.t_start_generation + t_suspended : 0;
+        t_prompt_processing    = src.t_prompt_processing;
+
+        n_draft_total    = src.n_draft_total;
+        n_draft_accepted = src.n_draft_accepted;
+
+        // the gap of the suspension is not an inter-token latency
+        t_last_token = 0;
+
+        deadline_met = src.deadline_met;
+
+        i_batch = -1;
+        task    = std::move(src.task);
+        state   = src.state;
+
+        // the draft batch is sized for the task
+        if (ctx_dft) {
+            llama_batch_free(batch_spec);
+
+            batch_spec = llama_batch_init(task->params.speculative.n_max + 1, 0, 1);
+        }
+
+        SLT_INF(*this, "resumed task %d after %.3f s, n_past = %d, n_decoded = %d\n",
+                task->id, t_suspended / 1e6, n_past, n_decoded);
+
+        return true;
+    }
+
+    void release() {
+        if (is_processing()) {
+            GGML_ASSERT(task);
+
+            SLT_INF(*this, "stop processing: n_past = %d, truncated = %d\n", n_past, truncated);
+
+            t_last_used = ggml_time_us();
+            t_token_generation = (ggml_time_us() - t_start_generation) / 1e3;
+            state = SLOT_STATE_IDLE;
+
+            task_prev = std::move(task);
+            task.reset();
+
+            callback_on_release(id);
+        }
+    }
+
+    result_timings get_timings() const {
+        result_timings timings;
+        timings.cache_n = n_prompt_tokens_cache;
+
+        timings.prompt_n            = n_prompt_tokens_processed;
+        timings.prompt_ms           = t_prompt_processing;
+        timings.prompt_per_token_ms = t_prompt_processing / n_prompt_tokens_processed;
+        timings.prompt_per_second   = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+
+        timings.predicted_n            = n_decoded;
+        timings.predicted_ms           = t_token_generation;
+        timings.predicted_per_token_ms = t_token_generation / n_decoded;
+        timings.predicted_per_second   = 1e3 / t_token_generation * n_decoded;
+
+        // Add speculative metrics
+        if (n_draft_total > 0) {
+            timings.draft_n          = n_draft_total;
+            timings.draft_n_accepted = n_draft_accepted;
+        }
+
+        return timings;
+    }
+
+    // with is_final set, the message is always parsed from the whole text
+    const common_chat_msg & update_chat_msg(std::vector<common_chat_msg_diff> & diffs, bool is_final = false) {
+        GGML_ASSERT(task);
+
+        const auto & syntax = task->params.oaicompat_chat_syntax;
+
+        // plain content: the parsed message is the generated text itself, so append the new text and emit it
+        // as the diff instead of re-parsing the whole output on every token
+        if (syntax.format == COMMON_CHAT_FORMAT_CONTENT_ONLY && syntax.reasoning_format == COMMON_REASONING_FORMAT_NONE) {
+            if (generated_text.size() < chat_msg.content.size()) {
+                // a stop string was erased from the end of the text, nothing new to send
+                chat_msg.content.resize(generated_text.size());
+            } else if (generated_text.size() > chat_msg.content.size()) {
+                common_chat_msg_diff diff;
+                diff.content_delta = generated_text.substr(chat_msg.content.size());
+
+                chat_msg.role = "assistant";
+                chat_msg.content += diff.content_delta;
+
+                diffs.push_back(std::move(diff));
+            }
+            return chat_msg;
+        }
+
+        // the other formats have no incremental parser and every parse covers the whole text. On long outputs
+        // the text is parsed again only once it grew by a fraction of its size: the deltas come in larger
+        // chunks, but the total parsing time stays linear in the output length
+        if (!is_final && generated_text.size() > CHAT_MSG_PARSE_FULL &&
+            generated_text.size() < chat_msg_n_parsed + chat_msg_n_parsed / CHAT_MSG_PARSE_STEP) {
+            return chat_msg;
+        }
+        chat_msg_n_parsed = generated_text.size();
+
+        SRV_DBG("Parsing chat message: %s\n", generated_text.c_str());
+        auto new_msg = common_chat_parse(
+                generated_text,
+                /* is_partial= */ stop != STOP_TYPE_EOS,
+                syntax);
+        if (!new_msg.empty()) {
+            new_msg.set_tool_call_ids(generated_tool_call_ids, gen_tool_call_id);
+            diffs = common_chat_msg_diff::compute_diffs(chat_msg, new_msg);
+            chat_msg = std::move(new_msg);
+        }
+        return chat_msg;
+    }
+
+    // position in generated_text of the first stop string found after pos (is_full_stop),
+    // or of the beginning of a stop string at the end of the text, npos if there is none
+    size_t find_stopping_strings(size_t pos, bool is_full_stop) {
+        GGML_ASSERT(task);
+
+        if (stop_matcher.empty()) {
+            return std::string::npos;
+        }
+
+        if (stop_matcher.consumed() > generated_text.size()) {
+            // the text was cut, start over
+            stop_matcher.reset();
+        }
+
+        // only the text generated since the last call is scanned
+        size_t word = 0;
+        const size_t stop_pos = stop_matcher.feed(
+                generated_text.data() + stop_matcher.consumed(),
+                generated_text.size() - stop_matcher.consumed(), pos, &word);
+
+        if (stop_pos == std::string::npos) {
+            return is_full_stop ? stop_pos : stop_matcher.partial(pos);
+        }
+
+        if (is_full_stop) {
+            stop           = STOP_TYPE_WORD;
+            stopping_word  = stop_matcher.word(word);
+            has_next_token = false;
+        }
+
+        return stop_pos;
+    }
+
+    void print_timings() const {
+        const double t_prompt        =       t_prompt_processing / n_prompt_tokens_processed;
+        const double n_prompt_second = 1e3 / t_prompt_processing * n_prompt_tokens_processed;
+
+        const double t_gen        =       t_token_generation / n_decoded;
+        const double n_gen_second = 1e3 / t_token_generation * n_decoded;
+
+        SLT_INF(*this,
+                "\n"
+                "prompt eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
+                "       eval time = %10.2f ms / %5d tokens (%8.2f ms per token, %8.2f tokens per second)\n"
+                "      total time = %10.2f ms / %5d tokens\n",
+                t_prompt_processing, n_prompt_tokens_processed, t_prompt, n_prompt_second,
+                t_token_generation, n_decoded, t_gen, n_gen_second,
+                t_prompt_processing + t_token_generation, n_prompt_tokens_processed + n_decoded);
+
+        if (n_draft_total > 0) {
+            const float draft_ratio = (float) n_draft_accepted / n_draft_total;
+            SLT_INF(*this,
+                    "\n"
+                    "draft acceptance rate = %0.5f (%5d accepted / %5d generated)\n",
+                    draft_ratio, n_draft_accepted, n_draft_total
+            );
+        }
+    }
+
+    json to_json(bool only_metrics = false) const {
+        json res;
+
+        res = {
+                {"id",            id},
+                {"n_ctx",         n_ctx},
+                {"speculative",   can_speculate()},
+                {"is_processing", is_processing()},
+        };
+
+        const auto & ptask = task ? task : task_prev;
+
+        if (ptask) {
+            res["id_task"] = ptask->id;
+            res["params"] = ptask->params.to_json(only_metrics);
+            res["next_token"] = {
+                    {
+                            {"has_next_token", has_next_token},
+                            {"has_new_line",   has_new_line},
+                            {"n_remain",       n_remaining},
+                            {"n_decoded",      n_decoded},
+                    }
+            };
+
+            if (!only_metrics) {
+                res["prompt"] = ptask->tokens.detokenize(ctx, true);
+                res["generated"] = generated_text;
+            }
+        }
+
+        return res;
+    }
+};
+
+struct server_metrics {
+    int64_t t_start = 0;
+
+    uint64_t n_prompt_tokens_processed_total = 0;
+    uint64_t t_prompt_processing_total       = 0;
+    uint64_t n_tokens_predicted_total        = 0;
+    uint64_t t_tokens_generation_total       = 0;
+
+    uint64_t n_past_max = 0;
+
+    uint64_t n_prompt_tokens_processed = 0;
+    uint64_t t_prompt_processing       = 0;
+
+    uint64_t n_tokens_predicted  = 0;
+    uint64_t t_tokens_generation = 0;
+
+    uint64_t n_decode_total     = 0;
+    uint64_t n_busy_slots_total = 0;
+
+    // prompt tokens whose KV was copied from another slot instead of being evaluated
+    uint64_t n_prompt_tokens_shared_total = 0;
+
+    // tasks suspended for a task of higher priority, and resumed
+    uint64_t n_preempted_total = 0;
+    uint64_t n_resumed_total   = 0;
+
+    // distributions, the inter-token latency is observed by the sampling threads
+    Histogram h_queue_wait        { Histogram::exponential(0.001, 2.0, 16) };   // s, 1 ms .. 33 s
+    Histogram h_ttft              { Histogram::exponential(0.005, 2.0, 16) };   // s, 5 ms .. 164 s
+    Histogram h_inter_token       { Histogram::exponential(0.001, 1.5, 20) };   // s, 1 ms .. 2.2 s
+    Histogram h_prefill_tps       { Histogram::exponential(16.0, 2.0, 14) };    // tokens/s, 16 .. 131072
+    Histogram h_batch_occupancy   { Histogram::linear(0.1, 0.1, 10) };          // tokens per decode / n_batch
+    Histogram h_cache_hit_bytes   { Histogram::exponential(1 << 20, 2.0, 16) }; // 1 MiB .. 32 GiB
+    Histogram h_cache_miss_bytes  { Histogram::exponential(1 << 20, 2.0, 16) };
+    Histogram h_spec_acceptance   { Histogram::linear(0.1, 0.1, 10) };          // accepted / drafted tokens
+
+    void init() {
+        t_start = ggml_time_us();
+    }
+
+    void on_launch(const server_task & task, int64_t t_current) {
+        if (task.t_queued >= 0) {
+            h_queue_wait.observe((t_current - task.t_queued) / 1e6);
+        }
+    }
+
+    void on_token(server_slot & slot, int64_t t_current) {
+        if (slot.t_last_token > 0) {
+            h_inter_token.observe((t_current - slot.t_last_token) / 1e6);
+        }
+        slot.t_last_token = t_current;
+    }
+
+    void on_speculated(size_t n_accepted, size_t n_draft) {
+        if (n_draft > 0) {
+            h_spec_acceptance.observe(double(n_accepted) / n_draft);
+        }
+    }
+
+    // attainment of the deadlines, per SLO class
+    struct slo_stats {
+        uint64_t n_requests = 0; // requests with a deadline that reached the first token or were rejected
+        uint64_t n_met      = 0;
+        uint64_t n_missed   = 0;
+        uint64_t n_rejected = 0; // early errors, the deadline could not be met
+
+        uint64_t n_completed_met  = 0;
+        uint64_t n_tokens_goodput = 0; // tokens generated by the requests that met their deadline
+    };
+
+    std::map<std::string, slo_stats> slo;
+
+    static std::string slo_name(const server_task & task) {
+        return task.params.slo.empty() ? "default" : task.params.slo;
+    }
+
+    void on_first_token(server_slot & slot, int64_t t_current) {
+        h_ttft.observe((t_current - (slot.task->t_queued >= 0 ? slot.task->t_queued : slot.t_start_process_prompt)) / 1e6);
+
+        if (slot.task->t_deadline < 0) {
+            return;
+        }
+
+        auto & cur = slo[slo_name(*slot.task)];
+
+        cur.n_requests++;
+
+        slot.deadline_met = t_current <= slot.task->t_deadline;
+        if (slot.deadline_met) {
+            cur.n_met++;
+        } else {
+            cur.n_missed++;
+        }
+    }
+
+    void on_deadline_rejected(const server_task & task) {
+        auto & cur = slo[slo_name(task)];
+
+        cur.n_requests++;
+        cur.n_rejected++;
+    }
+
+    json slo_to_json() const {
+        json res = json::object();
+        for (const auto & [name, cur] : slo) {
+            res[name] = json {
+                { "n_requests",       cur.n_requests },
+                { "n_met",            cur.n_met },
+                { "n_missed",         cur.n_missed },
+                { "n_rejected",       cur.n_rejected },
+                { "attainment",       cur.n_requests > 0 ? double(cur.n_met) / cur.n_requests : 0.0 },
+                { "n_completed_met",  cur.n_completed_met },
+                { "n_tokens_goodput", cur.n_tokens_goodput },
+            };
+        }
+
+        return res;
+    }
+
+    void on_prompt_eval(const server_slot & slot) {
+        n_prompt_tokens_processed_total += slot.n_prompt_tokens_processed;
+        n_prompt_tokens_processed       += slot.n_prompt_tokens_processed;
+        t_prompt_processing             += slot.t_prompt_processing;
+        t_prompt_processing_total       += slot.t_prompt_processing;
+
+        if (slot.n_prompt_tokens_processed > 0 && slot.t_prompt_processing > 0) {
+            h_prefill_tps.observe(1e3*slot.n_prompt_tokens_processed / slot.t_prompt_processing);
+        }
+
+        if (slot.n_past > 0) {
+            n_past_max = std::max(n_past_max, (uint64_t) slot.n_past);
+        }
+    }
+
+    void on_prediction(const server_slot & slot) {
+        if (slot.deadline_met) {
+            auto & cur = slo[slo_name(*slot.task)];
+
+            cur.n_completed_met++;
+            cur.n_tokens_goodput += slot.n_decoded;
+        }
+
+        n_tokens_predicted_total   += slot.n_decoded;
+        n_tokens_predicted         += slot.n_decoded;
+        t_tokens_generation        += slot.t_token_generation;
+        t_tokens_generation_total  += slot.t_token_generation;
+    }
+
+    void on_prefix_copied(int32_t n_tokens) {
+        n_prompt_tokens_shared_total += n_tokens;
+    }
+
+    void on_preempted() {
+        n_preempted_total++;
+    }
+
+    void on_resumed() {
+        n_resumed_total++;
+    }
+
+    void on_decoded(const std::vector<server_slot> & slots, double occupancy) {
+        h_batch_occupancy.observe(occupancy);
+
+        n_decode_total++;
+        for (const auto & slot : slots) {
+            if (slot.is_processing()) {
+                n_busy_slots_total++;
+            }
+            if (slot.n_past > 0) {
+                n_past_max = std::max(n_past_max, (uint64_t) slot.n_past);
+            }
+        }
+    }
+
+    void reset_bucket() {
+        n_prompt_tokens_processed = 0;
+        t_prompt_processing       = 0;
+        n_tokens_predicted        = 0;
+        t_tokens_generation       = 0;
+    }
+
+    // name, histogram, help - in the order of the exposition
+    std::vector<std::tuple<const char *, const Histogram *, const char *>> histograms() const {
+        return {
+            { "queue_wait_seconds",           &h_queue_wait,       "Time from the arrival of a task to its start in a slot." },
+            { "time_to_first_token_seconds",  &h_ttft,             "Time from the arrival of a task to its first generated token." },
+            { "inter_token_latency_seconds",  &h_inter_token,      "Time between two generated tokens of a slot." },
+            { "prefill_tokens_per_second",    &h_prefill_tps,      "Prompt processing throughput of a task." },
+            { "batch_occupancy_ratio",        &h_batch_occupancy,  "Tokens per llama_decode call over the batch size." },
+            { "prompt_cache_hit_bytes",       &h_cache_hit_bytes,  "Bytes of state restored from the prompt cache per lookup." },
+            { "prompt_cache_miss_bytes",      &h_cache_miss_bytes, "Estimated bytes of state the prompt cache could not provide per lookup." },
+            { "speculative_acceptance_ratio", &h_spec_acceptance,  "Accepted draft tokens over drafted tokens per speculative step." },
+        };
+    }
+
+    // the histograms are read without the task loop, the counters above must go through a metrics task
+    void write_prometheus(std::string & out) const {
+        for (const auto & [name, hist, help] : histograms()) {
+            hist->write_prometheus(out, std::string("llamacpp:") + name, help);
+        }
+    }
+
+    json histograms_to_json() const {
+        json res = json::object();
+        for (const auto & [name, hist, help] : histograms()) {
+            res[name] = json {
+                { "count", hist->count() },
+                { "p50",   hist->quantile(0.50) },
+                { "p90",   hist->quantile(0.90) },
+                { "p99",   hist->quantile(0.99) },
+            };
+        }
+
+        return res;
+    }
+};
+
+struct server_queue {
+    int id = 0;
+    bool running;
+
+    // queues
+    std::deque<server_task> queue_tasks;
+    std::deque<server_task> queue_tasks_deferred;
+
+    std::mutex mutex_tasks;
+    std::condition_variable condition_tasks;
+
+    // callback functions
+    std::function<void(server_task &&)> callback_new_task;
+    std::function<void(void)>           callback_update_slots;
+
+    // Add a new task to the end of the queue
+    int post(server_task && task, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        GGML_ASSERT(task.id != -1);
+        // if this is cancel task make sure to clean up pending tasks
+        if (task.type == SERVER_TASK_TYPE_CANCEL) {
+            cleanup_pending_task(task.id_target);
+        }
+        const int task_id = task.id;
+        if (task.t_queued < 0) {
+            task.t_queued = ggml_time_us();
+        }
+        QUE_DBG("new task, id = %d, front = %d\n", task_id, front);
+        if (front) {
+            queue_tasks.push_front(std::move(task));
+        } else {
+            queue_tasks.push_back(std::move(task));
+        }
+        condition_tasks.notify_one();
+        return task_id;
+    }
+
+    // multi-task version of post()
+    int post(std::vector<server_task> && tasks, bool front = false) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        const int64_t t_queued = ggml_time_us();
+        for (auto & task : tasks) {
+            if (task.id == -1) {
+                task.id = id++;
+            }
+            if (task.t_queued < 0) {
+                task.t_queued = t_queued;
+            }
+            // if this is cancel task make sure to clean up pending tasks
+            if (task.type == SERVER_TASK_TYPE_CANCEL) {
+                cleanup_pending_task(task.id_target);
+            }
+            QUE_DBG("new task, id = %d/%d, front = %d\n", task.id, (int) tasks.size(), front);
+            if (front) {
+                queue_tasks.push_front(std::move(task));
+            } else {
+                queue_tasks.push_back(std::move(task));
+            }
+        }
+        condition_tasks.notify_one();
+        return 0;
+    }
+
+    // Add a new task, but defer until one slot is available
+    void defer(server_task && task) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        QUE_DBG("defer task, id = %d\n", task.id);
+        queue_tasks_deferred.push_back(std::move(task));
+        condition_tasks.notify_one();
+    }
+
+    // Get the next id for creating a new task
+    int get_new_id() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        int new_id = id++;
+        return new_id;
+    }
+
+    // Register function to process a new task
+    void on_new_task(std::function<void(server_task &&)> callback) {
+        callback_new_task = std::move(callback);
+    }
+
+    // Register the function to be called when all slots data is ready to be processed
+    void on_update_slots(std::function<void(void)> callback) {
+        callback_update_slots = std::move(callback);
+    }
+
+    // remove the deferred tasks for which the deadline cannot be met anymore
+    std::vector<server_task> pop_deferred_expired(const std::function<bool(const server_task &)> & expired) {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+
+        std::vector<server_task> res;
+        for (auto it = queue_tasks_deferred.begin(); it != queue_tasks_deferred.end();) {
+            if (it->t_deadline >= 0 && expired(*it)) {
+                res.push_back(std::move(*it));
+                it = queue_tasks_deferred.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        return res;
+    }
+
+    // Call when the state of one slot is changed, it will move one task from deferred to main queue
+    // the task of highest priority goes first, in the order of arrival among equals
+    void pop_deferred_task() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        if (!queue_tasks_deferred.empty()) {
+            // then the earliest deadline
+            auto deadline = [](const server_task & task) {
+                return task.t_deadline < 0 ? INT64_MAX : task.t_deadline;
+            };
+
+            auto it = queue_tasks_deferred.begin();
+            for (auto cur = it + 1; cur != queue_tasks_deferred.end(); ++cur) {
+                if (cur->params.priority > it->params.priority ||
+                   (cur->params.priority == it->params.priority && deadline(*cur) < deadline(*it))) {
+                    it = cur;
+                }
+            }
+            queue_tasks.emplace_front(std::move(*it));
+            queue_tasks_deferred.erase(it);
+        }
+        condition_tasks.notify_one();
+    }
+
+    // end the start_loop routine
+    void terminate() {
+        std::unique_lock<std::mutex> lock(mutex_tasks);
+        running = false;
+        condition_tasks.notify_all();
+    }
+
+    /**
+     * Main loop consists of these steps:
+     * - Wait until a new task arrives
+     * - Process the task (i.e. maybe copy data into slot)
+     * - Check if multitask is finished
+     * - Update all slots
+     */
+    void start_loop() {
+        running = true;
+
+        while (true) {
+            QUE_DBG("%s", "processing new tasks\n");
+
+            while (true) {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    lock.unlock();
+                    break;
+                }
+                server_task task = std::move(queue_tasks.front());
+                queue_tasks.pop_front();
+                lock.unlock();
+
+                QUE_DBG("processing task, id = %d\n", task.id);
+                callback_new_task(std::move(task));
+            }
+
+            // all tasks in the current loop is processed, slots data is now ready
+            QUE_DBG("%s", "update slots\n");
+
+            callback_update_slots();
+
+            QUE_DBG("%s", "waiting for new tasks\n");
+            {
+                std::unique_lock<std::mutex> lock(mutex_tasks);
+                if (!running) {
+                    QUE_DBG("%s", "terminate\n");
+                    return;
+                }
+                if (queue_tasks.empty()) {
+                    condition_tasks.wait(lock, [&]{
+                        return (!queue_tasks.empty() || !running);
+                    });
+                }
+            }
+        }
+    }
+
+private:
+    void cleanup_pending_task(int id_target) {
+        // no need lock because this is called exclusively by post()
+        auto rm_func = [id_target](const server_task & task) {
+            return task.id == id_target;
+        };
+        queue_tasks.erase(
+                std::remove_if(queue_tasks.begin(),          queue_tasks.end(),          rm_func),
+                queue_tasks.end());
+        queue_tasks_deferred.erase(
+                std::remove_if(queue_tasks_deferred.begin(), queue_tasks_deferred.end(), rm_func),
+                queue_tasks_deferred.end());
+    }
+};
+
+struct server_response {
+    bool running = true;
+
+    // for keeping track of all tasks waiting for the result
+    std::unordered_set<int> waiting_task_ids;
+
+    // the main result queue (using ptr for polymorphism)
+    std::vector<server_task_result_ptr> queue_results;
+
+    std::mutex mutex_results;
+    std::condition_variable condition_results;
+
+    // add the id_task to the list of tasks waiting for response
+    void add_waiting_task_id(int id_task) {
+        SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.insert(id_task);
+    }
+
+    void add_waiting_tasks(const std::vector<server_task> & tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & task : tasks) {
+            SRV_DBG("add task %d to waiting list. current waiting = %d (before add)\n", task.id, (int) waiting_task_ids.size());
+            waiting_task_ids.insert(task.id);
+        }
+    }
+
+    // when the request is finished, we can remove task associated with it
+    void remove_waiting_task_id(int id_task) {
+        SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        waiting_task_ids.erase(id_task);
+        // make sure to clean up all pending results
+        queue_results.erase(
+                std::remove_if(queue_results.begin(), queue_results.end(), [id_task](const server_task_result_ptr & res) {
+                    return res->id == id_task;
+                }),
+                queue_results.end());
+    }
+
+    void remove_waiting_task_ids(const std::unordered_set<int> & id_tasks) {
+        std::unique_lock<std::mutex> lock(mutex_results);
+
+        for (const auto & id_task : id_tasks) {
+            SRV_DBG("remove task %d from waiting list. current waiting = %d (before remove)\n", id_task, (int) waiting_task_ids.size());
+            waiting_task_ids.erase(id_task);
+        }
+    }
+
+    // This function blocks the thread until there is a response for one of the id_tasks
+    server_task_result_ptr recv(const std::unordered_set<int> & id_tasks) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_results);
+            condition_results.wait(lock, [&]{
+                if (!running) {
+                    SRV_DBG("%s : queue result stop\n", __func__);
+                    std::terminate(); // we cannot return here since the caller is HTTP code
+                }
+                return !queue_results.empty();
+            });
+
+            for (size_t i = 0; i < queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
+                    server_task_result_ptr res = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+        }
+
+        // should never reach here
     }
 
     // same as recv(), but have timeout in seconds
@@ -2258,330 +4015,1274 @@ struct server_response {
         while (true) {
             std::unique_lock<std::mutex> lock(mutex_results);
 
-            for (int i = 0; i < (int) queue_results.size(); i++) {
-                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
-                    server_task_result_ptr res = std::move(queue_results[i]);
-                    queue_results.erase(queue_results.begin() + i);
-                    return res;
+            for (int i = 0; i < (int) queue_results.size(); i++) {
+                if (id_tasks.find(queue_results[i]->id) != id_tasks.end()) {
+                    server_task_result_ptr res = std::move(queue_results[i]);
+                    queue_results.erase(queue_results.begin() + i);
+                    return res;
+                }
+            }
+
+            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
+            if (!running) {
+                SRV_DBG("%s : queue result stop\n", __func__);
+                std::terminate(); // we cannot return here since the caller is HTTP code
+            }
+            if (cr_res == std::cv_status::timeout) {
+                return nullptr;
+            }
+        }
+
+        // should never reach here
+    }
+
+    // single-task version of recv()
+    server_task_result_ptr recv(int id_task) {
+        std::unordered_set<int> id_tasks = {id_task};
+        return recv(id_tasks);
+    }
+
+    // Send a new result to a waiting id_task
+    void send(server_task_result_ptr && result) {
+        SRV_DBG("sending result for task id = %d\n", result->id);
+
+        std::unique_lock<std::mutex> lock(mutex_results);
+        for (const auto & id_task : waiting_task_ids) {
+            if (result->id == id_task) {
+                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+
+                queue_results.emplace_back(std::move(result));
+                condition_results.notify_all();
+                return;
+            }
+        }
+    }
+
+    // terminate the waiting loop
+    void terminate() {
+        running = false;
+        condition_results.notify_all();
+    }
+};
+
+
+struct server_context {
+    common_params params_base;
+
+    // note: keep these alive - they determine the lifetime of the model, context, etc.
+    common_init_result llama_init;
+    common_init_result llama_init_dft;
+
+    llama_model * model = nullptr;
+    llama_context * ctx = nullptr;
+
+    // multimodal
+    mtmd_context * mctx = nullptr;
+
+    const llama_vocab * vocab = nullptr;
+    bool vocab_dft_compatible = true;
+
+    // text of the tokens of the vocab, used instead of detokenizing the generated tokens one by one
+    TokenPieces token_pieces;
+
+    llama_model * model_dft = nullptr;
+
+    llama_context_params cparams_dft;
+
+    llama_batch batch {};
+
+    bool clean_kv_cache = true;
+    bool add_bos_token  = true;
+
+    int32_t n_ctx; // total context for all clients / slots
+
+    // slots / clients
+    std::vector<server_slot> slots;
+
+    int slots_debug = 0;
+
+    server_queue    queue_tasks;
+    server_response queue_results;
+
+    std::unique_ptr<server_prompt_cache> prompt_cache;
+
+    // writes and reads the slot save files, started by the first slot save/restore task
+    std::unique_ptr<server_slot_io> slot_io;
+
+    server_metrics metrics;
+
+    // Necessary similarity of prompt for slot selection
+    float slot_prompt_similarity = 0.0f;
+
+    // radix index over the cached tokens of each slot (text-only models)
+    server_prefix_tree slot_index;
+
+    // how much a cached token that would be lost (not reused and not shared with another slot) weighs
+    // against a token that is reused when selecting a slot by prompt similarity
+    const float slot_evict_cost = 0.5f;
+
+    // copy the KV cells of a common prefix held by another slot instead of evaluating the prefix again
+    // requires a unified KV cache in which the positions of the cells are never shifted (see init())
+    bool slot_prefix_share = false;
+
+    // minimum number of tokens gained for a copy to be worth it
+    const int32_t slot_prefix_share_min = 32;
+
+    // elastic context (LLAMA_SERVER_ELASTIC_CTX): with a unified KV cache, every slot can grow up to the full context
+    // and the cells are taken on demand from a budget shared by all slots (see ctx_budget_acquire())
+    bool    slot_ctx_elastic = false;
+    int32_t ctx_budget_total = 0;
+
+    // cells that must be left for the generation when admitting a task without a smaller n_predict
+    const int32_t ctx_budget_reserve = 256;
+
+    // deadlines of the SLO classes in ms (LLAMA_SERVER_SLO_CLASSES, e.g. "interactive=2000,batch=60000")
+    std::map<std::string, int64_t> slo_classes;
+
+    // tasks preempted by tasks of higher priority, waiting for a slot (see slot_preempt())
+    std::list<server_slot_suspended> slots_suspended;
+
+    // fan-out of the tasks of a request from the state of its first prompt (see slot_fork())
+    // the fork copies the sequence of the parent, which shares the cells with a unified KV cache: this is safe only
+    // when the positions of the cells are never shifted, as for slot_prefix_share (see init())
+    bool slot_fanout = false;
+
+    // minimum common prefix for the prompts of a batch request to wait for the state of the first prompt
+    const int32_t fanout_prefix_min = 64;
+
+    // minimum number of tokens discarded by a streaming context shift (see slot_params::n_sink)
+    // a shift costs about the size of the kept window whatever the step, so the work of the shifts over a
+    // generation grows as the step gets smaller: the step trades the context kept for the shift overhead
+    const int32_t ctx_shift_stream_step = 64;
+
+    // samplers with a grammar as returned by common_sampler_init(), most recently used first.
+    // requests with the same sampling params get a clone, which is much cheaper than parsing the grammar again
+    std::list<std::pair<std::string, common_sampler *>> sampler_cache;
+    std::unordered_map<std::string, std::list<std::pair<std::string, common_sampler *>>::iterator> sampler_cache_index;
+
+    const size_t sampler_cache_max = 32;
+
+    // threads processing the next token of the generating slots after each decode (LLAMA_SERVER_SAMPLING_THREADS)
+    std::unique_ptr<ThreadPool> sampling_pool;
+
+    // slots sampling from the current batch view and whether they continue the generation
+    std::vector<server_slot *> slots_sample;
+    std::vector<const float *> slots_sample_logits;
+    std::vector<llama_token>   slots_sample_id;
+    std::vector<uint8_t>       slots_sample_next;
+
+    // warm restarts: the prompt cache (and optionally the slots) is saved to a snapshot directory at shutdown
+    // or periodically while idle, and restored on start if the model file is the same
+    std::string snapshot_dir;
+    bool        snapshot_slots       = false;
+    int64_t     snapshot_interval_us = 0; // 0 = only at shutdown
+    int64_t     t_snapshot_last      = 0;
+    bool        snapshot_dirty       = false;
+
+    // set while the I/O thread writes a snapshot
+    std::atomic<bool> snapshot_writing { false };
+    std::string model_fingerprint;
+
+    common_chat_templates_ptr chat_templates;
+    oaicompat_parser_options  oai_parser_opt;
+
+    ~server_context() {
+        // the pending slot files are finished first, the jobs send their results through the queues
+        slot_io.reset();
+
+        mtmd_free(mctx);
+
+        // Clear any sampling context
+        for (server_slot & slot : slots) {
+            common_sampler_free(slot.smpl);
+            slot.smpl = nullptr;
+
+            llama_free(slot.ctx_dft);
+            slot.ctx_dft = nullptr;
+
+            common_speculative_free(slot.spec);
+            slot.spec = nullptr;
+
+            llama_batch_free(slot.batch_spec);
+        }
+
+        for (auto & cur : slots_suspended) {
+            common_sampler_free(cur.smpl);
+        }
+
+        for (auto & cur : sampler_cache) {
+            common_sampler_free(cur.second);
+        }
+
+        llama_batch_free(batch);
+    }
+
+    bool load_model(const common_params & params) {
+        SRV_INF("loading model '%s'\n", params.model.path.c_str());
+
+        params_base = params;
+
+        llama_init = common_init_from_params(params_base);
+
+        model = llama_init.model.get();
+        ctx   = llama_init.context.get();
+
+        if (model == nullptr) {
+            SRV_ERR("failed to load model, '%s'\n", params_base.model.path.c_str());
+            return false;
+        }
+
+        vocab = llama_model_get_vocab(model);
+
+        token_pieces.build(vocab);
+
+        // a new vocab can get the address of the one of a previous model
+        prompt_tokenize_cache().clear();
+
+        n_ctx = llama_n_ctx(ctx);
+
+        add_bos_token = llama_vocab_get_add_bos(vocab);
+
+        if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
+            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
+
+            auto params_dft = params_base;
+
+            params_dft.devices      = params_base.speculative.devices;
+            params_dft.model        = params_base.speculative.model;
+            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
+            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
+            params_dft.n_parallel   = 1;
+            params_dft.cache_type_k = params_base.speculative.cache_type_k;
+            params_dft.cache_type_v = params_base.speculative.cache_type_v;
+
+            params_dft.cpuparams.n_threads = params_base.speculative.cpuparams.n_threads;
+            params_dft.cpuparams_batch.n_threads = params_base.speculative.cpuparams_batch.n_threads;
+            params_dft.tensor_buft_overrides = params_base.speculative.tensor_buft_overrides;
+
+            llama_init_dft = common_init_from_params(params_dft);
+
+            model_dft = llama_init_dft.model.get();
+
+            if (model_dft == nullptr) {
+                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
+                return false;
+            }
+
+            vocab_dft_compatible = common_speculative_are_compatible(ctx, llama_init_dft.context.get());
+            if (!vocab_dft_compatible) {
+                SRV_INF("the draft model '%s' is not compatible with the target model '%s'. tokens will be translated between the draft and target models.\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
+            }
+
+            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+
+            cparams_dft = common_context_params_to_llama(params_dft);
+            cparams_dft.n_batch = n_ctx_dft;
+
+            // the context is not needed - we will create one for each slot
+            llama_init_dft.context.reset();
+        }
+
+        chat_templates = common_chat_templates_init(model, params_base.chat_template);
+        try {
+            common_chat_format_example(chat_templates.get(), params.use_jinja, params.default_template_kwargs);
+        } catch (const std::exception & e) {
+            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
+            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
+            chat_templates = common_chat_templates_init(model, "chatml");
+        }
+
+        std::string & mmproj_path = params_base.mmproj.path;
+        if (!mmproj_path.empty()) {
+            mtmd_context_params mparams = mtmd_context_params_default();
+            mparams.use_gpu       = params_base.mmproj_use_gpu;
+            mparams.print_timings = false;
+            mparams.n_threads     = params_base.cpuparams.n_threads;
+            mparams.verbosity     = params_base.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
+            mctx = mtmd_init_from_file(mmproj_path.c_str(), model, mparams);
+            if (mctx == nullptr) {
+                SRV_ERR("failed to load multimodal model, '%s'\n", mmproj_path.c_str());
+                return false;
+            }
+            SRV_INF("loaded multimodal model, '%s'\n", mmproj_path.c_str());
+
+            if (params_base.ctx_shift) {
+                params_base.ctx_shift = false;
+                SRV_WRN("%s\n", "ctx_shift is not supported by multimodal, it will be disabled");
+            }
+
+            if (params_base.n_cache_reuse) {
+                params_base.n_cache_reuse = 0;
+                SRV_WRN("%s\n", "cache_reuse is not supported by multimodal, it will be disabled");
+            }
+
+            if (!params_base.speculative.model.path.empty()) {
+                SRV_ERR("%s\n", "err: speculative decode is not supported by multimodal");
+                return false;
+            }
+        }
+
+        if (!llama_memory_can_shift(llama_get_memory(ctx))) {
+            if (params_base.ctx_shift) {
+                params_base.ctx_shift = false;
+                SRV_WRN("%s\n", "ctx_shift is not supported by this context, it will be disabled");
+            }
+
+            if (params_base.n_cache_reuse) {
+                params_base.n_cache_reuse = 0;
+                SRV_WRN("%s\n", "cache_reuse is not supported by this context, it will be disabled");
+            }
+        }
+
+        return true;
+    }
+
+    // the LLAMA_SERVER_* settings are read here, returns false if one of them is invalid
+    bool init() {
+        {
+            int64_t elastic_ctx = 0;
+            if (!server_env_int("LLAMA_SERVER_ELASTIC_CTX", 0, 1, elastic_ctx)) {
+                return false;
+            }
+
+            if (elastic_ctx != 0 && params_base.n_parallel > 1) {
+                if (params_base.kv_unified) {
+                    slot_ctx_elastic = true;
+                } else {
+                    SRV_WRN("%s", "elastic context requires a unified KV cache (--kv-unified), it will be disabled\n");
+                }
+            }
+
+            // leave room for the drafts of speculative decoding
+            ctx_budget_total = n_ctx;
+            if (model_dft) {
+                ctx_budget_total -= params_base.n_parallel*(params_base.speculative.n_max + 1);
+            }
+
+            if (slot_ctx_elastic) {
+                SRV_WRN("elastic context is enabled, budget = %d tokens\n", ctx_budget_total);
+            }
+        }
+
+        {
+            const char * LLAMA_SERVER_SLO_CLASSES = getenv("LLAMA_SERVER_SLO_CLASSES");
+            if (LLAMA_SERVER_SLO_CLASSES) {
+                for (const auto & item : string_split<std::string>(LLAMA_SERVER_SLO_CLASSES, ',')) {
+                    const auto pos = item.find('=');
+
+                    char * end = nullptr;
+                    const long long deadline_ms = pos == std::string::npos ? 0 : std::strtoll(item.c_str() + pos + 1, &end, 10);
+                    if (pos == std::string::npos || pos == 0 || end == item.c_str() + pos + 1 || *end != '\0' || deadline_ms <= 0) {
+                        SRV_ERR("invalid SLO class '%s', expected name=deadline_ms\n", item.c_str());
+                        return false;
+                    }
+
+                    slo_classes[item.substr(0, pos)] = deadline_ms;
+                }
+
+                for (const auto & [name, deadline_ms] : slo_classes) {
+                    SRV_INF("SLO class '%s', deadline = %" PRId64 " ms\n", name.c_str(), deadline_ms);
+                }
+            }
+        }
+
+        {
+            // the slots process their token independently of each other (the samplers that do not need the context,
+            // the probabilities, the stop strings), by default one thread per slot up to the number of decode threads
+            int64_t n_threads = std::min(params_base.n_parallel, params_base.cpuparams.n_threads);
+            if (!server_env_int("LLAMA_SERVER_SAMPLING_THREADS", 1, INT32_MAX, n_threads)) {
+                return false;
+            }
+            n_threads = std::max<int64_t>(1, std::min<int64_t>(n_threads, params_base.n_parallel));
+
+            sampling_pool = std::make_unique<ThreadPool>(n_threads);
+
+            SRV_INF("sampling threads = %d\n", (int) n_threads);
+        }
+
+        const int32_t n_ctx_slot = get_n_ctx_slot();
+
+        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
+
+        for (int i = 0; i < params_base.n_parallel; i++) {
+            server_slot slot;
+
+            slot.id = i;
+            slot.ctx = ctx;
+            slot.n_ctx = n_ctx_slot;
+            slot.mctx = mctx;
+            slot.prompt.tokens.has_mtmd = mctx != nullptr;
+
+            if (model_dft) {
+                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+
+                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
+                if (slot.ctx_dft == nullptr) {
+                    SRV_ERR("%s", "failed to create draft context\n");
+                    return false;
+                }
+
+                slot.spec = common_speculative_init(slot.ctx, slot.ctx_dft);
+                if (slot.spec == nullptr) {
+                    SRV_ERR("%s", "failed to create speculator\n");
+                    return false;
+                }
+                for (auto & pair : params_base.speculative.replacements) {
+                    common_speculative_add_replacement_tgt_dft(slot.spec, pair.first.c_str(), pair.second.c_str());
                 }
             }
 
-            std::cv_status cr_res = condition_results.wait_for(lock, std::chrono::seconds(timeout));
-            if (!running) {
-                SRV_DBG("%s : queue result stop\n", __func__);
-                std::terminate(); // we cannot return here since the caller is HTTP code
+            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+
+            slot.callback_on_release = [this](int id_slot) {
+                slot_index_update(slots[id_slot]);
+
+                snapshot_dirty = true;
+
+                queue_tasks.pop_deferred_task();
+            };
+
+            slot.reset();
+
+            slots.push_back(std::move(slot));
+        }
+
+        {
+            int64_t value = 0;
+            if (!server_env_int("LLAMA_SERVER_SLOTS_DEBUG", 0, 1, value)) {
+                return false;
             }
-            if (cr_res == std::cv_status::timeout) {
-                return nullptr;
+            slots_debug = value;
+
+            if (slots_debug) {
+                SRV_WRN("slots debug = %d\n", slots_debug);
             }
         }
 
-        // should never reach here
+        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
+        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
+        {
+            const int32_t n_batch = llama_n_batch(ctx);
+            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+        }
+
+        metrics.init();
+
+        // the shared cells have a single position, so shifting the KV of one slot would corrupt the others
+        slot_prefix_share = params_base.kv_unified && !mctx &&
+            !params_base.ctx_shift && params_base.n_cache_reuse == 0 &&
+            !llama_model_is_recurrent(model) && !llama_model_is_hybrid(model) && llama_model_n_swa(model) == 0;
+
+        if (slot_prefix_share) {
+            SRV_INF("%s", "sharing of common prefixes between slots is enabled\n");
+        }
+
+        // without a unified KV cache, each slot has its own stream and the copy of a sequence is a copy of the cells
+        slot_fanout = !params_base.kv_unified || slot_prefix_share;
+
+        {
+            const char * LLAMA_SERVER_SNAPSHOT_DIR = getenv("LLAMA_SERVER_SNAPSHOT_DIR");
+            if (LLAMA_SERVER_SNAPSHOT_DIR && LLAMA_SERVER_SNAPSHOT_DIR[0] != '\0') {
+                int64_t slots_saved = 0;
+                int64_t interval_s  = 0;
+                if (!server_env_int("LLAMA_SERVER_SNAPSHOT_SLOTS", 0, 1, slots_saved) ||
+                    !server_env_int("LLAMA_SERVER_SNAPSHOT_INTERVAL", 0, INT32_MAX, interval_s)) {
+                    return false;
+                }
+
+                snapshot_dir         = LLAMA_SERVER_SNAPSHOT_DIR;
+                snapshot_slots       = slots_saved != 0;
+                snapshot_interval_us = 1000000ll*interval_s;
+                t_snapshot_last      = ggml_time_us();
+
+                model_fingerprint = model_file_fingerprint(params_base.model.path);
+
+                SRV_WRN("snapshots are enabled, dir: %s, slots: %d, interval: %d s, model: %s\n",
+                        snapshot_dir.c_str(), snapshot_slots, (int) (snapshot_interval_us / 1000000), model_fingerprint.c_str());
+            }
+        }
+
+        if (params_base.cache_ram_mib != 0) {
+            if (params_base.cache_ram_mib < 0) {
+                SRV_WRN("prompt cache is enabled, size limit: %s\n", "no limit");
+            } else {
+                SRV_WRN("prompt cache is enabled, size limit: %d MiB\n", params_base.cache_ram_mib);
+            }
+            SRV_WRN("%s", "use `--cache-ram 0` to disable the prompt cache\n");
+
+            prompt_cache = std::make_unique<server_prompt_cache>(params_base.cache_ram_mib, n_ctx);
+            prompt_cache->hist_hit_bytes  = &metrics.h_cache_hit_bytes;
+            prompt_cache->hist_miss_bytes = &metrics.h_cache_miss_bytes;
+
+            int64_t cache_compress = 0;
+            if (!server_env_int("LLAMA_SERVER_CACHE_COMPRESS", 0, 1, cache_compress)) {
+                return false;
+            }
+
+            if (cache_compress != 0) {
+                auto & compression = prompt_cache->compression;
+
+                compression.enabled   = true;
+                compression.pool      = std::make_shared<ThreadPool>(std::max(1, params_base.cpuparams.n_threads));
+
+                // group the bytes of the elements of the KV cache, the other states are shuffled with the same width
+                switch (params_base.cache_type_k) {
+                    case GGML_TYPE_F32:  compression.width = 4; break;
+                    case GGML_TYPE_F16:
+                    case GGML_TYPE_BF16: compression.width = 2; break;
+                    default:             compression.width = 1; break;
+                }
+
+                SRV_WRN("prompt cache compression is enabled, element width = %zu\n", compression.width);
+            }
+
+            const char * LLAMA_SERVER_CACHE_DISK_DIR = getenv("LLAMA_SERVER_CACHE_DISK_DIR");
+            if (LLAMA_SERVER_CACHE_DISK_DIR && LLAMA_SERVER_CACHE_DISK_DIR[0] != '\0') {
+                int64_t cache_disk_mib = 16384;
+                if (!server_env_int("LLAMA_SERVER_CACHE_DISK_MIB", 0, INT32_MAX, cache_disk_mib)) {
+                    return false;
+                }
+
+                // the disk tier always has a size limit, a size of 0 turns it off
+                if (cache_disk_mib == 0) {
+                    SRV_WRN("%s", "prompt cache disk tier is disabled, size limit: 0 MiB\n");
+                } else {
+                    auto disk = std::make_unique<server_prompt_cache_disk>(LLAMA_SERVER_CACHE_DISK_DIR, cache_disk_mib);
+                    // with snapshots enabled, the files of the previous run are adopted or removed by snapshot_load()
+                    if (disk->init(!snapshot_dir.empty())) {
+                        SRV_WRN("prompt cache disk tier is enabled, dir: %s, size limit: %d MiB\n", LLAMA_SERVER_CACHE_DISK_DIR, (int) cache_disk_mib);
+
+                        prompt_cache->set_disk(std::move(disk));
+                    }
+                }
+            }
+        } else {
+            SRV_WRN("%s", "prompt cache is disabled - use `--cache-ram N` to enable it\n");
+        }
+        SRV_WRN("%s", "for more info see https://github.com/ggml-org/llama.cpp/pull/16391\n");
+
+        // thinking is enabled if:
+        // 1. It's not explicitly disabled (reasoning_budget == 0)
+        // 2. The chat template supports it
+        const bool enable_thinking = params_base.use_jinja && params_base.reasoning_budget != 0 && common_chat_templates_support_enable_thinking(chat_templates.get());
+        SRV_INF("thinking = %d\n", enable_thinking);
+
+        oai_parser_opt = {
+                /* use_jinja             */ params_base.use_jinja,
+                /* prefill_assistant     */ params_base.prefill_assistant,
+                /* reasoning_format      */ params_base.reasoning_format,
+                /* chat_template_kwargs  */ params_base.default_template_kwargs,
+                /* common_chat_templates */ chat_templates.get(),
+                /* allow_image           */ mctx ? mtmd_support_vision(mctx) : false,
+                /* allow_audio           */ mctx ? mtmd_support_audio (mctx) : false,
+                /* enable_thinking       */ enable_thinking,
+        };
+
+        return true;
+    }
+
+    // the LLAMA_SERVER_* settings in effect, reported by /props
+    json settings_to_json() const {
+        const server_prompt_cache_disk * disk = prompt_cache ? prompt_cache->disk.get() : nullptr;
+
+        return json {
+            { "elastic_ctx",       slot_ctx_elastic },
+            { "slo_classes",       slo_classes },
+            { "sampling_threads",  sampling_pool ? sampling_pool->size() : 0 },
+            { "slots_debug",       slots_debug },
+            { "snapshot_dir",      snapshot_dir },
+            { "snapshot_slots",    snapshot_slots },
+            { "snapshot_interval", snapshot_interval_us / 1000000 },
+            { "cache_compress",    prompt_cache && prompt_cache->compression.enabled },
+            { "cache_disk_dir",    disk ? disk->dir : std::string() },
+            { "cache_disk_mib",    disk ? disk->limit_size / (1024 * 1024) : 0 },
+        };
+    }
+
+    // the states are taken here and written by the I/O thread, so that the requests are not held up by the disk.
+    // the states of the prompt cache are shared with the writer, the states of the slots are copied
+    // wait: write the snapshot before returning (at shutdown, the pending disk cache files are written first too)
+    bool snapshot_save(bool wait = false) {
+        if (snapshot_dir.empty()) {
+            return false;
+        }
+
+        // TODO: mtmd does not support prompt cache and slot save/restore
+        if (mctx) {
+            return false;
+        }
+
+        // a periodic snapshot is skipped while the previous one is being written
+        if (snapshot_writing.exchange(true)) {
+            if (!wait) {
+                return false;
+            }
+            slot_io.reset();
+            snapshot_writing = true;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        // the files of each snapshot have unique names, so the previous snapshot stays valid until the manifest is replaced.
+        // the names do not start with the prefix of the disk cache files, the two directories may be the same
+        const std::string prefix = std::to_string(t_start);
+
+        std::vector<std::pair<std::string, std::shared_ptr<const server_prompt>>> prompts;
+        std::vector<std::tuple<int, std::string, std::shared_ptr<const server_prompt>>> slots_saved;
+
+        json disk_data = nullptr;
+
+        if (prompt_cache) {
+            for (const auto & cur : prompt_cache->states) {
+                auto prompt = std::make_shared<server_prompt>();
+                prompt->tokens      = server_tokens(cur.prompt.tokens.get_text_tokens(), false);
+                prompt->data        = cur.prompt.data;
+                prompt->checkpoints = cur.prompt.checkpoints;
+                prompt->n_hits      = cur.prompt.n_hits;
+                prompt->compressed  = cur.prompt.compressed;
+
+                prompts.emplace_back("snapshot-prompt-" + prefix + "-" + std::to_string(cur.id) + ".bin", std::move(prompt));
+            }
+
+            if (prompt_cache->disk) {
+                if (wait) {
+                    prompt_cache->disk->flush();
+                }
+
+                // the files that are still being written are not part of the snapshot
+                disk_data = {
+                    { "dir",   prompt_cache->disk->dir },
+                    { "files", prompt_cache->disk->file_names(true) },
+                };
+            }
+        }
+
+        if (snapshot_slots) {
+            for (const server_slot & slot : slots) {
+                if (slot.is_processing() || slot.prompt.tokens.empty()) {
+                    continue;
+                }
+
+                auto cur = std::make_shared<server_prompt>();
+                cur->tokens      = server_tokens(slot.prompt.tokens.get_text_tokens(), false);
+                cur->checkpoints = slot.prompt.checkpoints;
+
+                const size_t size = llama_state_seq_get_size_ext(ctx, slot.id, 0);
+                llama_state_seq_get_data_ext(ctx, cur->data.alloc(size), size, slot.id, 0);
+
+                slots_saved.emplace_back(slot.id, "snapshot-slot-" + prefix + "-" + std::to_string(slot.id) + ".bin", std::move(cur));
+            }
+        }
+
+        const int n_ctx_slot = slots.empty() ? 0 : slots[0].n_ctx;
+
+        t_snapshot_last = ggml_time_us();
+        snapshot_dirty  = false;
+
+        if (!slot_io) {
+            slot_io = std::make_unique<server_slot_io>();
+        }
+
+        slot_io->submit([this, prefix, prompts = std::move(prompts), slots_saved = std::move(slots_saved), disk_data, n_ctx_slot, t_start]() {
+            snapshot_write(prefix, prompts, slots_saved, disk_data, n_ctx_slot, t_start);
+            snapshot_writing = false;
+        });
+
+        if (wait) {
+            // the I/O thread finishes the pending jobs before exiting
+            slot_io.reset();
+        }
+
+        return true;
+    }
+
+    // runs on the I/O thread, only uses the states taken by snapshot_save() and the settings of the snapshots
+    void snapshot_write(
+            const std::string & prefix,
+            const std::vector<std::pair<std::string, std::shared_ptr<const server_prompt>>> & prompts,
+            const std::vector<std::tuple<int, std::string, std::shared_ptr<const server_prompt>>> & slots_saved,
+            const json & disk_data,
+            int n_ctx_slot,
+            int64_t t_start) const {
+        std::error_code ec;
+        std::filesystem::create_directories(snapshot_dir, ec);
+        if (ec) {
+            SRV_ERR("failed to create snapshot directory '%s': %s\n", snapshot_dir.c_str(), ec.message().c_str());
+            return;
+        }
+
+        json prompts_data = json::array();
+        json slots_data   = json::array();
+
+        size_t n_bytes = 0;
+
+        for (const auto & [name, prompt] : prompts) {
+            if (server_prompt_cache_disk::write((std::filesystem::path(snapshot_dir) / name).string(), *prompt)) {
+                prompts_data.push_back(name);
+                n_bytes += prompt->size();
+            }
+        }
+
+        for (const auto & [id, name, prompt] : slots_saved) {
+            if (server_prompt_cache_disk::write((std::filesystem::path(snapshot_dir) / name).string(), *prompt)) {
+                slots_data.push_back({
+                    { "id",   id },
+                    { "file", name },
+                });
+                n_bytes += prompt->size();
+            }
+        }
+
+        const json manifest = {
+            { "version",    1 },
+            { "model",      model_fingerprint },
+            { "n_ctx_slot", n_ctx_slot },
+            { "prompts",    prompts_data },
+            { "slots",      slots_data },
+            { "disk",       disk_data },
+        };
+
+        const std::filesystem::path path_manifest = std::filesystem::path(snapshot_dir) / "manifest.json";
+        const std::filesystem::path path_tmp      = std::filesystem::path(snapshot_dir) / "manifest.json.tmp";
+
+        {
+            std::ofstream out(path_tmp, std::ios::trunc);
+            out << manifest.dump();
+            if (!out) {
+                SRV_ERR("failed to write snapshot manifest '%s'\n", path_tmp.string().c_str());
+                return;
+            }
+        }
+
+        std::filesystem::rename(path_tmp, path_manifest, ec);
+        if (ec) {
+            SRV_ERR("failed to write snapshot manifest '%s': %s\n", path_manifest.string().c_str(), ec.message().c_str());
+            return;
+        }
+
+        // remove the files of the previous snapshots
+        for (const auto & entry : std::filesystem::directory_iterator(snapshot_dir, ec)) {
+            const std::string name = entry.path().filename().string();
+
+            if (name.rfind("snapshot-", 0) == 0 && name.rfind("-" + prefix + "-") == std::string::npos) {
+                std::filesystem::remove(entry.path(), ec);
+            }
+        }
+
+        SRV_WRN("saved snapshot: %zu prompts, %zu slots, %.3f MiB in %.2f ms\n",
+                prompts_data.size(), slots_data.size(), n_bytes / (1024.0 * 1024.0), (ggml_time_us() - t_start) / 1000.0);
     }
 
-    // single-task version of recv()
-    server_task_result_ptr recv(int id_task) {
-        std::unordered_set<int> id_tasks = {id_task};
-        return recv(id_tasks);
+    void snapshot_load() {
+        if (snapshot_dir.empty()) {
+            return;
+        }
+
+        server_prompt_cache_disk * disk = prompt_cache ? prompt_cache->disk.get() : nullptr;
+
+        json manifest;
+        {
+            std::ifstream in(std::filesystem::path(snapshot_dir) / "manifest.json");
+            if (in) {
+                manifest = json::parse(in, nullptr, false);
+            }
+        }
+
+        if (!manifest.is_object() || json_value(manifest, "version", 0) != 1) {
+            SRV_WRN("%s", "no valid snapshot to restore\n");
+            if (disk) {
+                disk->adopt({});
+            }
+            return;
+        }
+
+        if (model_fingerprint.empty() || json_value(manifest, "model", std::string()) != model_fingerprint) {
+            SRV_WRN("%s", "snapshot was saved with a different model, ignoring it\n");
+            if (disk) {
+                disk->adopt({});
+            }
+            return;
+        }
+
+        // TODO: mtmd does not support prompt cache and slot save/restore
+        if (mctx) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        if (disk) {
+            const json disk_data = manifest.contains("disk") ? manifest.at("disk") : json();
+            if (disk_data.is_object() && json_value(disk_data, "dir", std::string()) == disk->dir) {
+                disk->adopt(json_value(disk_data, "files", std::vector<std::string>()));
+            } else {
+                disk->adopt({});
+            }
+        }
+
+        size_t n_prompts = 0;
+        size_t n_slots   = 0;
+
+        if (prompt_cache) {
+            for (const auto & name : json_value(manifest, "prompts", std::vector<std::string>())) {
+                FileMapping mapping;
+
+                server_prompt cur;
+                const uint8_t * state   = nullptr;
+                size_t          n_state = 0;
+                if (!mapping.open((std::filesystem::path(snapshot_dir) / name).string()) ||
+                    !server_prompt_cache_disk::parse(mapping.data(), mapping.size(), cur, &state, &n_state)) {
+                    SRV_WRN("failed to read snapshot file '%s'\n", name.c_str());
+                    continue;
+                }
+
+                cur.data = std::vector<uint8_t>(state, state + n_state);
+
+                const double freq = cur.n_hits + 1.0;
+                prompt_cache->insert(std::move(cur), freq);
+
+                n_prompts++;
+            }
+
+            prompt_cache->update();
+        }
+
+        if (json_value(manifest, "n_ctx_slot", 0) == (slots.empty() ? 0 : slots[0].n_ctx)) {
+            for (const auto & slot_data : json_value(manifest, "slots", json::array())) {
+                server_slot * slot = get_slot_by_id(json_value(slot_data, "id", -1));
+                if (slot == nullptr) {
+                    continue;
+                }
+
+                const std::string name = json_value(slot_data, "file", std::string());
+
+                FileMapping mapping;
+
+                server_prompt cur;
+                const uint8_t * state   = nullptr;
+                size_t          n_state = 0;
+                bool ok = mapping.open((std::filesystem::path(snapshot_dir) / name).string()) &&
+                          server_prompt_cache_disk::parse(mapping.data(), mapping.size(), cur, &state, &n_state);
+
+                // the slots are saved uncompressed, but the decoding does not depend on the configuration
+                std::vector<uint8_t> raw;
+                if (ok && cur.compressed) {
+                    server_prompt_compression compression;
+                    if (prompt_cache) {
+                        compression.pool = prompt_cache->compression.pool;
+                    }
+                    ok = compression.decompress(state, n_state, raw) && compression.decompress(cur);
+
+                    state   = raw.data();
+                    n_state = raw.size();
+                }
+
+                if (!ok || llama_state_seq_set_data_ext(ctx, state, n_state, slot->id, 0) != n_state) {
+                    SRV_WRN("failed to restore slot %d from snapshot file '%s'\n", slot->id, name.c_str());
+                    llama_memory_seq_rm(llama_get_memory(ctx), slot->id, -1, -1);
+                    continue;
+                }
+
+                slot->prompt.tokens      = std::move(cur.tokens);
+                slot->prompt.checkpoints = std::move(cur.checkpoints);
+                slot_index_update(*slot);
+
+                n_slots++;
+            }
+        } else {
+            SRV_WRN("%s", "snapshot was saved with a different slot context size, not restoring the slots\n");
+        }
+
+        SRV_WRN("restored snapshot: %zu prompts, %zu slots in %.2f ms\n", n_prompts, n_slots, (ggml_time_us() - t_start) / 1000.0);
     }
 
-    // Send a new result to a waiting id_task
-    void send(server_task_result_ptr && result) {
-        SRV_DBG("sending result for task id = %d\n", result->id);
+    // extend the cached prefix of the slot with the KV cells of the slot that shares the longest prefix with the prompt
+    void slot_prefix_copy(server_slot & slot, const server_tokens & tokens) {
+        server_slot * src   = nullptr;
+        int32_t       n_src = slot.n_past + slot_prefix_share_min;
 
-        std::unique_lock<std::mutex> lock(mutex_results);
-        for (const auto & id_task : waiting_task_ids) {
-            if (result->id == id_task) {
-                SRV_DBG("task id = %d pushed to result queue\n", result->id);
+        for (const auto & match : slot_index.find(tokens.get_text_tokens())) {
+            if (match.id == slot.id || (int32_t) match.n_common < n_src) {
+                continue;
+            }
 
-                queue_results.emplace_back(std::move(result));
-                condition_results.notify_all();
-                return;
+            server_slot & cur = slots[match.id];
+
+            // the index includes the tokens of the batch being built, only the cells that are already computed can be copied
+            const llama_pos pos_max = llama_memory_seq_pos_max(llama_get_memory(ctx), cur.id);
+
+            const int32_t n_cur = std::min<int32_t>(cur.prompt.tokens.get_common_prefix(tokens), pos_max + 1);
+            if (n_cur >= n_src) {
+                src   = &cur;
+                n_src = n_cur;
             }
         }
-    }
 
-    // terminate the waiting loop
-    void terminate() {
-        running = false;
-        condition_results.notify_all();
-    }
-};
+        if (src == nullptr) {
+            return;
+        }
 
+        auto * mem = llama_get_memory(ctx);
 
-struct server_context {
-    common_params params_base;
+        llama_memory_seq_rm(mem, slot.id, slot.n_past, -1);
+        llama_memory_seq_cp(mem, src->id, slot.id, slot.n_past, n_src);
 
-    // note: keep these alive - they determine the lifetime of the model, context, etc.
-    common_init_result llama_init;
-    common_init_result llama_init_dft;
+        SLT_INF(slot, "copied KV of the common prefix from slot %d, [%d, %d)\n", src->id, slot.n_past, n_src);
 
-    llama_model * model = nullptr;
-    llama_context * ctx = nullptr;
+        slot.prompt.tokens.keep_first(slot.n_past);
+        for (int32_t i = slot.n_past; i < n_src; i++) {
+            slot.prompt.tokens.push_back(tokens[i]);
+        }
 
-    // multimodal
-    mtmd_context * mctx = nullptr;
+        metrics.on_prefix_copied(n_src - slot.n_past);
 
-    const llama_vocab * vocab = nullptr;
-    bool vocab_dft_compatible = true;
+        slot.n_past = n_src;
+    }
 
-    llama_model * model_dft = nullptr;
+    // the slot of the fan-out parent of the task, while the parent has not evaluated its prompt yet
+    server_slot * slot_parent(const server_slot & slot) {
+        if (slot.task->id_parent == -1) {
+            return nullptr;
+        }
 
-    llama_context_params cparams_dft;
+        for (server_slot & cur : slots) {
+            if (cur.task && cur.task->id == slot.task->id_parent) {
+                const bool pending =
+                    cur.state == SLOT_STATE_STARTED ||
+                    cur.state == SLOT_STATE_WAIT_PARENT ||
+                    cur.state == SLOT_STATE_PROCESSING_PROMPT ||
+                    cur.state == SLOT_STATE_DONE_PROMPT;
 
-    llama_batch batch {};
+                return pending ? &cur : nullptr;
+            }
+        }
 
-    bool clean_kv_cache = true;
-    bool add_bos_token  = true;
+        return nullptr;
+    }
 
-    int32_t n_ctx; // total context for all clients / slots
+    // copy the state of a slot that has just evaluated its prompt into the slots waiting for it
+    // the children with the same prompt sample from the logits of the parent, the others continue with their own prompt
+    void slot_fork(server_slot & parent) {
+        for (server_slot & child : slots) {
+            if (child.state != SLOT_STATE_WAIT_PARENT || child.task->id_parent != parent.task->id) {
+                continue;
+            }
 
-    // slots / clients
-    std::vector<server_slot> slots;
+            auto * mem = llama_get_memory(ctx);
 
-    int slots_debug = 0;
+            llama_memory_seq_rm(mem, child.id, -1, -1);
+            llama_memory_seq_cp(mem, parent.id, child.id, -1, -1);
 
-    server_queue    queue_tasks;
-    server_response queue_results;
+            child.prompt.tokens      = server_tokens(parent.prompt.tokens.get_text_tokens(), false);
+            child.prompt.checkpoints = parent.prompt.checkpoints;
 
-    std::unique_ptr<server_prompt_cache> prompt_cache;
+            const auto & input_tokens = child.task->tokens;
 
-    server_metrics metrics;
+            const bool same = input_tokens.size() == parent.task->tokens.size() &&
+                              input_tokens.get_common_prefix(parent.task->tokens) == input_tokens.size();
 
-    // Necessary similarity of prompt for slot selection
-    float slot_prompt_similarity = 0.0f;
+            if (!same) {
+                SLT_INF(child, "forked the prompt of slot %d, n_tokens = %d\n", parent.id, (int) child.prompt.tokens.size());
 
-    common_chat_templates_ptr chat_templates;
-    oaicompat_parser_options  oai_parser_opt;
+                child.state = SLOT_STATE_STARTED;
+                continue;
+            }
 
-    ~server_context() {
-        mtmd_free(mctx);
+            child.t_start_process_prompt = parent.t_start_process_prompt;
+            child.t_start_generation     = 0;
 
-        // Clear any sampling context
-        for (server_slot & slot : slots) {
-            common_sampler_free(slot.smpl);
-            slot.smpl = nullptr;
+            child.n_past                    = parent.n_past;
+            child.n_prompt_tokens_cache     = child.n_past;
+            child.n_prompt_tokens_processed = 0;
 
-            llama_free(slot.ctx_dft);
-            slot.ctx_dft = nullptr;
+            sampler_reset(child);
+            for (int i = 0; i < child.n_prompt_tokens(); ++i) {
+                common_sampler_accept(child.smpl, input_tokens[i], false);
+            }
 
-            common_speculative_free(slot.spec);
-            slot.spec = nullptr;
+            child.n_decoded = 0;
+            child.i_batch   = parent.i_batch;
+            child.state     = SLOT_STATE_DONE_PROMPT;
 
-            llama_batch_free(slot.batch_spec);
-        }
+            metrics.on_prefix_copied(child.n_past);
 
-        llama_batch_free(batch);
+            SLT_INF(child, "forked the evaluated prompt of slot %d, n_past = %d\n", parent.id, child.n_past);
+        }
     }
 
-    bool load_model(const common_params & params) {
-        SRV_INF("loading model '%s'\n", params.model.path.c_str());
+    // suspend the processing task of lowest priority (the newest one among equals) for a task of higher priority
+    // returns the slot that was freed
+    server_slot * slot_preempt(const server_task & task) {
+        // bound the memory held by the suspended states
+        if (slots_suspended.size() >= slots.size()) {
+            return nullptr;
+        }
 
-        params_base = params;
+        server_slot * victim = nullptr;
 
-        llama_init = common_init_from_params(params_base);
+        for (server_slot & slot : slots) {
+            const bool can_suspend =
+                slot.state == SLOT_STATE_STARTED ||
+                slot.state == SLOT_STATE_PROCESSING_PROMPT ||
+                slot.state == SLOT_STATE_GENERATING;
 
-        model = llama_init.model.get();
-        ctx   = llama_init.context.get();
+            if (!can_suspend || (slot.task->type != SERVER_TASK_TYPE_COMPLETION && slot.task->type != SERVER_TASK_TYPE_INFILL)) {
+                continue;
+            }
 
-        if (model == nullptr) {
-            SRV_ERR("failed to load model, '%s'\n", params_base.model.path.c_str());
-            return false;
+            const int32_t priority = slot.task->params.priority;
+            if (priority >= task.params.priority) {
+                continue;
+            }
+
+            if (victim == nullptr || priority < victim->task->params.priority ||
+                (priority == victim->task->params.priority && slot.task->id > victim->task->id)) {
+                victim = &slot;
+            }
         }
 
-        vocab = llama_model_get_vocab(model);
+        if (victim == nullptr) {
+            return nullptr;
+        }
 
-        n_ctx = llama_n_ctx(ctx);
+        SLT_WRN(*victim, "preempting task %d (priority %d) for task %d (priority %d)\n",
+                victim->task->id, victim->task->params.priority, task.id, task.params.priority);
 
-        add_bos_token = llama_vocab_get_add_bos(vocab);
+        slots_suspended.emplace_back();
 
-        if (!params_base.speculative.model.path.empty() || !params_base.speculative.model.hf_repo.empty()) {
-            SRV_INF("loading draft model '%s'\n", params_base.speculative.model.path.c_str());
+        auto & cur = slots_suspended.back();
+        victim->suspend(cur);
 
-            auto params_dft = params_base;
+        if (prompt_cache) {
+            prompt_cache->compression.compress(cur.prompt);
+        }
 
-            params_dft.devices      = params_base.speculative.devices;
-            params_dft.model        = params_base.speculative.model;
-            params_dft.n_ctx        = params_base.speculative.n_ctx == 0 ? params_base.n_ctx / params_base.n_parallel : params_base.speculative.n_ctx;
-            params_dft.n_gpu_layers = params_base.speculative.n_gpu_layers;
-            params_dft.n_parallel   = 1;
-            params_dft.cache_type_k = params_base.speculative.cache_type_k;
-            params_dft.cache_type_v = params_base.speculative.cache_type_v;
+        slot_index_update(*victim);
 
-            params_dft.cpuparams.n_threads = params_base.speculative.cpuparams.n_threads;
-            params_dft.cpuparams_batch.n_threads = params_base.speculative.cpuparams_batch.n_threads;
-            params_dft.tensor_buft_overrides = params_base.speculative.tensor_buft_overrides;
+        metrics.on_preempted();
 
-            llama_init_dft = common_init_from_params(params_dft);
+        return victim;
+    }
 
-            model_dft = llama_init_dft.model.get();
+    // continue the suspended tasks with a priority of at least min_priority in the idle slots, highest priority first
+    void slots_resume(int32_t min_priority) {
+        while (!slots_suspended.empty()) {
+            auto it = slots_suspended.end();
+            for (auto cur = slots_suspended.begin(); cur != slots_suspended.end(); ++cur) {
+                if (cur->task->params.priority >= min_priority &&
+                    (it == slots_suspended.end() || cur->task->params.priority > it->task->params.priority)) {
+                    it = cur;
+                }
+            }
 
-            if (model_dft == nullptr) {
-                SRV_ERR("failed to load draft model, '%s'\n", params_base.speculative.model.path.c_str());
-                return false;
+            if (it == slots_suspended.end()) {
+                break;
             }
 
-            vocab_dft_compatible = common_speculative_are_compatible(ctx, llama_init_dft.context.get());
-            if (!vocab_dft_compatible) {
-                SRV_INF("the draft model '%s' is not compatible with the target model '%s'. tokens will be translated between the draft and target models.\n", params_base.speculative.model.path.c_str(), params_base.model.path.c_str());
+            // the least recently used idle slot
+            server_slot * slot = nullptr;
+            for (server_slot & cur : slots) {
+                if (!cur.is_processing() && (slot == nullptr || cur.t_last_used < slot->t_last_used)) {
+                    slot = &cur;
+                }
             }
 
-            const int n_ctx_dft = llama_n_ctx(llama_init_dft.context.get());
+            if (slot == nullptr || (slot_ctx_elastic && !ctx_budget_admit(*it->task))) {
+                break;
+            }
 
-            cparams_dft = common_context_params_to_llama(params_dft);
-            cparams_dft.n_batch = n_ctx_dft;
+            // the state of the suspended task replaces the one cached by the slot, keep the latter in the prompt cache
+            if (prompt_cache && !mctx && !slot->prompt.tokens.empty() && slot_index.n_shared(slot->id) < slot->prompt.tokens.size()) {
+                slot->prompt_save(*prompt_cache);
+                prompt_cache->update();
+            }
 
-            // the context is not needed - we will create one for each slot
-            llama_init_dft.context.reset();
-        }
+            server_prompt_compression compression;
+            if (prompt_cache) {
+                compression.pool = prompt_cache->compression.pool;
+            }
 
-        chat_templates = common_chat_templates_init(model, params_base.chat_template);
-        try {
-            common_chat_format_example(chat_templates.get(), params.use_jinja, params.default_template_kwargs);
-        } catch (const std::exception & e) {
-            SRV_WRN("%s: Chat template parsing error: %s\n", __func__, e.what());
-            SRV_WRN("%s: The chat template that comes with this model is not yet supported, falling back to chatml. This may cause the model to output suboptimal responses\n", __func__);
-            chat_templates = common_chat_templates_init(model, "chatml");
-        }
+            if (!compression.decompress(it->prompt) || !slot->resume(*it)) {
+                SRV_ERR("failed to resume task %d\n", it->task->id);
+                send_error(*it->task, "failed to resume the task after preemption", ERROR_TYPE_SERVER);
 
-        std::string & mmproj_path = params_base.mmproj.path;
-        if (!mmproj_path.empty()) {
-            mtmd_context_params mparams = mtmd_context_params_default();
-            mparams.use_gpu       = params_base.mmproj_use_gpu;
-            mparams.print_timings = false;
-            mparams.n_threads     = params_base.cpuparams.n_threads;
-            mparams.verbosity     = params_base.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
-            mctx = mtmd_init_from_file(mmproj_path.c_str(), model, mparams);
-            if (mctx == nullptr) {
-                SRV_ERR("failed to load multimodal model, '%s'\n", mmproj_path.c_str());
-                return false;
+                common_sampler_free(it->smpl);
+            } else {
+                metrics.on_resumed();
             }
-            SRV_INF("loaded multimodal model, '%s'\n", mmproj_path.c_str());
 
-            if (params_base.ctx_shift) {
-                params_base.ctx_shift = false;
-                SRV_WRN("%s\n", "ctx_shift is not supported by multimodal, it will be disabled");
-            }
+            slot_index_update(*slot);
 
-            if (params_base.n_cache_reuse) {
-                params_base.n_cache_reuse = 0;
-                SRV_WRN("%s\n", "cache_reuse is not supported by multimodal, it will be disabled");
+            slots_suspended.erase(it);
+        }
+    }
+
+    // resolve the deadline of a new task from its parameters, throws for an unknown SLO class
+    void slo_apply(server_task & task) const {
+        int64_t deadline_ms = task.params.deadline_ms;
+
+        if (!task.params.slo.empty()) {
+            const auto it = slo_classes.find(task.params.slo);
+            if (it == slo_classes.end()) {
+                throw std::runtime_error("unknown SLO class: " + task.params.slo);
             }
 
-            if (!params_base.speculative.model.path.empty()) {
-                SRV_ERR("%s\n", "err: speculative decode is not supported by multimodal");
-                return false;
+            if (deadline_ms < 0) {
+                deadline_ms = it->second;
             }
         }
 
-        if (!llama_memory_can_shift(llama_get_memory(ctx))) {
-            if (params_base.ctx_shift) {
-                params_base.ctx_shift = false;
-                SRV_WRN("%s\n", "ctx_shift is not supported by this context, it will be disabled");
-            }
+        task.t_deadline = deadline_ms >= 0 ? ggml_time_us() + 1000*deadline_ms : -1;
+    }
 
-            if (params_base.n_cache_reuse) {
-                params_base.n_cache_reuse = 0;
-                SRV_WRN("%s\n", "cache_reuse is not supported by this context, it will be disabled");
-            }
+    // estimated time to evaluate n_tokens of prompt, from the prompt throughput measured so far
+    int64_t estimate_prompt_us(int32_t n_tokens) const {
+        if (metrics.n_prompt_tokens_processed_total < 256) {
+            return 0;
         }
 
-        return true;
+        return (int64_t) (1000.0*metrics.t_prompt_processing_total/metrics.n_prompt_tokens_processed_total*n_tokens);
     }
 
-    void init() {
-        const int32_t n_ctx_slot = n_ctx / params_base.n_parallel;
+    // the first token of the task can still be produced before its deadline
+    bool deadline_feasible(const server_task & task, int32_t n_tokens) const {
+        return task.t_deadline < 0 || ggml_time_us() + estimate_prompt_us(n_tokens) <= task.t_deadline;
+    }
 
-        SRV_INF("initializing slots, n_slots = %d\n", params_base.n_parallel);
+    // the prompts are processed in the order of their deadlines, the prompts without a deadline last
+    std::vector<server_slot *> slots_by_deadline() {
+        std::vector<server_slot *> res;
+        for (server_slot & slot : slots) {
+            res.push_back(&slot);
+        }
 
-        for (int i = 0; i < params_base.n_parallel; i++) {
-            server_slot slot;
+        auto deadline = [](const server_slot * slot) {
+            return slot->task && slot->task->t_deadline >= 0 ? slot->task->t_deadline : INT64_MAX;
+        };
 
-            slot.id = i;
-            slot.ctx = ctx;
-            slot.n_ctx = n_ctx_slot;
-            slot.mctx = mctx;
-            slot.prompt.tokens.has_mtmd = mctx != nullptr;
+        std::stable_sort(res.begin(), res.end(), [&](const server_slot * a, const server_slot * b) {
+            return deadline(a) < deadline(b);
+        });
 
-            if (model_dft) {
-                slot.batch_spec = llama_batch_init(params_base.speculative.n_max + 1, 0, 1);
+        return res;
+    }
 
-                slot.ctx_dft = llama_init_from_model(model_dft, cparams_dft);
-                if (slot.ctx_dft == nullptr) {
-                    SRV_ERR("%s", "failed to create draft context\n");
-                    return;
-                }
+    int32_t get_n_ctx_slot() const {
+        return slot_ctx_elastic ? n_ctx : n_ctx / params_base.n_parallel;
+    }
 
-                slot.spec = common_speculative_init(slot.ctx, slot.ctx_dft);
-                if (slot.spec == nullptr) {
-                    SRV_ERR("%s", "failed to create speculator\n");
-                    return;
-                }
-                for (auto & pair : params_base.speculative.replacements) {
-                    common_speculative_add_replacement_tgt_dft(slot.spec, pair.first.c_str(), pair.second.c_str());
-                }
+    // number of KV cells held by the slots, the cells shared by several slots are counted for each of them
+    int32_t ctx_budget_used() const {
+        int32_t res = 0;
+        for (const server_slot & slot : slots) {
+            res += slot.prompt.tokens.size();
+        }
+
+        return res;
+    }
+
+    // a task is admitted if its prompt and a reserve for the generation fit next to the other processing slots
+    // the KV of the idle slots does not count, it is freed on demand
+    bool ctx_budget_admit(const server_task & task) const {
+        int32_t n_busy = 0;
+        bool    busy   = false;
+
+        for (const server_slot & slot : slots) {
+            if (slot.is_processing()) {
+                n_busy += slot.prompt.tokens.size();
+                busy    = true;
             }
+        }
 
-            SLT_INF(slot, "new slot n_ctx_slot = %d\n", slot.n_ctx);
+        const int32_t n_reserve = task.params.n_predict > 0 ? std::min(task.params.n_predict, ctx_budget_reserve) : ctx_budget_reserve;
 
-            slot.callback_on_release = [this](int) {
-                queue_tasks.pop_deferred_task();
-            };
+        return !busy || n_busy + (int32_t) task.tokens.size() + n_reserve <= ctx_budget_total;
+    }
 
-            slot.reset();
+    // make room in the budget for n_tokens more cells of the slot
+    // the KV of the idle slots is freed first (least recently used first), then the slots admitted after this one
+    // are preempted (newest first) - returns false if the slot cannot grow
+    bool ctx_budget_acquire(server_slot & slot, int32_t n_tokens) {
+        while (ctx_budget_used() + n_tokens > ctx_budget_total) {
+            server_slot * victim = nullptr;
 
-            slots.push_back(std::move(slot));
-        }
+            for (server_slot & cur : slots) {
+                if (&cur == &slot || cur.batched || cur.prompt.tokens.empty()) {
+                    continue;
+                }
 
-        {
-            const char * LLAMA_SERVER_SLOTS_DEBUG = getenv("LLAMA_SERVER_SLOTS_DEBUG");
-            slots_debug = LLAMA_SERVER_SLOTS_DEBUG ? atoi(LLAMA_SERVER_SLOTS_DEBUG) : 0;
+                if (!cur.is_processing()) {
+                    if (victim == nullptr || victim->is_processing() || cur.t_last_used < victim->t_last_used) {
+                        victim = &cur;
+                    }
+                } else if (cur.task->id > slot.task->id) {
+                    if (victim == nullptr || (victim->is_processing() && cur.task->id > victim->task->id)) {
+                        victim = &cur;
+                    }
+                }
+            }
 
-            if (slots_debug) {
-                SRV_WRN("slots debug = %d\n", slots_debug);
+            if (victim == nullptr) {
+                return false;
+            }
+
+            if (victim->is_processing()) {
+                ctx_budget_preempt(*victim);
+            } else {
+                ctx_budget_reclaim(*victim);
             }
         }
 
-        // the update_slots() logic will always submit a maximum of n_batch or n_parallel tokens
-        // note that n_batch can be > n_ctx (e.g. for non-causal attention models such as BERT where the KV cache is not used)
-        {
-            const int32_t n_batch = llama_n_batch(ctx);
-            batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
+        return true;
+    }
+
+    // free the KV of an idle slot, saving it to the prompt cache
+    void ctx_budget_reclaim(server_slot & slot) {
+        SLT_INF(slot, "freeing %d cached tokens for the context budget\n", (int) slot.prompt.tokens.size());
+
+        if (prompt_cache && !mctx && slot_index.n_shared(slot.id) < slot.prompt.tokens.size()) {
+            slot.prompt_save(*prompt_cache);
+            prompt_cache->update();
         }
 
-        metrics.init();
+        llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
 
+        slot.prompt.tokens.clear();
+        slot.prompt.checkpoints.clear();
 
-        if (params_base.cache_ram_mib != 0) {
-            if (params_base.cache_ram_mib < 0) {
-                SRV_WRN("prompt cache is enabled, size limit: %s\n", "no limit");
-            } else {
-                SRV_WRN("prompt cache is enabled, size limit: %d MiB\n", params_base.cache_ram_mib);
-            }
-            SRV_WRN("%s", "use `--cache-ram 0` to disable the prompt cache\n");
+        slot_index_update(slot);
+    }
 
-            prompt_cache = std::make_unique<server_prompt_cache>(params_base.cache_ram_mib, n_ctx);
-        } else {
-            SRV_WRN("%s", "prompt cache is disabled - use `--cache-ram N` to enable it\n");
+    // a generation that cannot grow is stopped as if it reached the end of its context: the client gets the text
+    // generated so far with truncated set, and unlike a task preempted by priority (see slot_preempt()) it is not
+    // resumed later. a prompt is dropped and processed again once there is room
+    void ctx_budget_preempt(server_slot & slot) {
+        if (slot.state == SLOT_STATE_GENERATING) {
+            SLT_WRN(slot, "context budget exhausted, stopping the generation, n_past = %d\n", slot.n_past);
+
+            slot.stop           = STOP_TYPE_LIMIT;
+            slot.has_next_token = false;
+            slot.truncated      = true;
+
+            slot.print_timings();
+            send_final_response(slot);
+            metrics.on_prediction(slot);
+            slot.release();
+
+            return;
         }
-        SRV_WRN("%s", "for more info see https://github.com/ggml-org/llama.cpp/pull/16391\n");
 
-        // thinking is enabled if:
-        // 1. It's not explicitly disabled (reasoning_budget == 0)
-        // 2. The chat template supports it
-        const bool enable_thinking = params_base.use_jinja && params_base.reasoning_budget != 0 && common_chat_templates_support_enable_thinking(chat_templates.get());
-        SRV_INF("thinking = %d\n", enable_thinking);
+        SLT_WRN(slot, "context budget exhausted, dropping the prompt, n_past = %d\n", slot.n_past);
 
-        oai_parser_opt = {
-                /* use_jinja             */ params_base.use_jinja,
-                /* prefill_assistant     */ params_base.prefill_assistant,
-                /* reasoning_format      */ params_base.reasoning_format,
-                /* chat_template_kwargs  */ params_base.default_template_kwargs,
-                /* common_chat_templates */ chat_templates.get(),
-                /* allow_image           */ mctx ? mtmd_support_vision(mctx) : false,
-                /* allow_audio           */ mctx ? mtmd_support_audio (mctx) : false,
-                /* enable_thinking       */ enable_thinking,
-        };
+        llama_memory_seq_rm(llama_get_memory(ctx), slot.id, -1, -1);
+
+        slot.prompt.tokens.clear();
+        slot.prompt.checkpoints.clear();
+
+        slot.n_past = 0;
+        if (slot.state != SLOT_STATE_WAIT_PARENT) {
+            slot.state = SLOT_STATE_STARTED;
+        }
     }
 
     server_slot * get_slot_by_id(int id) {
@@ -2594,6 +5295,27 @@ struct server_context {
         return nullptr;
     }
 
+    // the index holds the tokens that are in the KV cache of the slots
+    void slot_index_update(const server_slot & slot) {
+        // the media chunks of multimodal prompts have no token ids to index
+        if (mctx) {
+            return;
+        }
+
+        slot_index.insert(slot.id, slot.prompt.tokens.get_text_tokens());
+    }
+
+    // index only the first n_tokens of the prompt of the slot
+    void slot_index_update(const server_slot & slot, size_t n_tokens) {
+        if (mctx) {
+            return;
+        }
+
+        const auto & tokens = slot.prompt.tokens.get_text_tokens();
+
+        slot_index.insert(slot.id, llama_tokens(tokens.begin(), tokens.begin() + std::min(n_tokens, tokens.size())));
+    }
+
     server_slot * get_available_slot(const server_task & task) {
         server_slot * ret = nullptr;
 
@@ -2601,27 +5323,44 @@ struct server_context {
 
         // find the slot that has at least n% prompt similarity
         if (ret == nullptr && slot_prompt_similarity != 0.0f) {
+            // a single walk of the index yields the common prefix of the prompt with every slot
+            // the media chunks have no token ids, so the slots of a multimodal model are compared one by one
+            std::vector<server_prefix_tree::match> matches;
+            if (mctx == nullptr) {
+                matches = slot_index.find(task.tokens.get_text_tokens());
+            } else {
+                for (const server_slot & slot : slots) {
+                    if (!slot.prompt.tokens.empty()) {
+                        matches.push_back({ slot.id, slot.prompt.tokens.get_common_prefix(task.tokens) });
+                    }
+                }
+            }
+
             float sim_best = 0;
+            float score_best = 0;
+
+            for (const auto & match : matches) {
+                server_slot & slot = slots[match.id];
 
-            for (server_slot & slot : slots) {
                 // skip the slot if it is not available
                 if (slot.is_processing()) {
                     continue;
                 }
 
-                const auto & tokens = slot.prompt.tokens;
-
-                // skip the slot if it does not contains cached tokens
-                if (tokens.empty()) {
+                const float sim_cur = float(match.n_common) / task.tokens.size();
+                if (sim_cur <= slot_prompt_similarity) {
                     continue;
                 }
 
-                // fraction of the Longest Common Prefix length with respect to the input prompt length
-                const float sim_cur = float(tokens.get_common_prefix(task.tokens)) / task.tokens.size();
+                // among the similar slots, prefer the one that loses the fewest cached tokens that no other slot holds
+                const size_t n_cached = slot.prompt.tokens.size();
+                const size_t n_kept   = std::min(n_cached, std::max(match.n_common, slot_index.n_shared(slot.id)));
 
-                // select the current slot if the criteria match
-                if (sim_cur > sim_best && sim_cur > slot_prompt_similarity) {
-                    sim_best = sim_cur;
+                const float score_cur = match.n_common - slot_evict_cost*(n_cached - n_kept);
+
+                if (ret == nullptr || score_cur > score_best) {
+                    sim_best   = sim_cur;
+                    score_best = score_cur;
 
                     ret = &slot;
                 }
@@ -2678,6 +5417,9 @@ struct server_context {
             // TODO: mtmd does not support prompt cache
             update_cache = update_cache && (ret->mctx == nullptr);
 
+            // no need to save the slot's context if another slot already holds all of it
+            update_cache = update_cache && slot_index.n_shared(ret->id) < tokens.size();
+
             if (update_cache) {
                 SRV_WRN("%s", "updating prompt cache\n");
 
@@ -2688,6 +5430,8 @@ struct server_context {
 
                 prompt_cache->update();
 
+                slot_index_update(*ret);
+
                 SRV_WRN("prompt cache update took %.2f ms\n", (ggml_time_us() - t_start) / 1000.0);
             }
         }
@@ -2695,14 +5439,90 @@ struct server_context {
         return ret;
     }
 
+    // only the samplers with a grammar are cached. The RNG state is cloned as well, so a request without
+    // a fixed seed can share its sampler only if it does not draw from the distribution (greedy)
+    static std::string sampler_cache_key(const slot_params & params) {
+        if (params.sampling.grammar.empty()) {
+            return "";
+        }
+        if (params.sampling.seed == LLAMA_DEFAULT_SEED && params.sampling.temp > 0.0f) {
+            return "";
+        }
+
+        json data = params.to_json();
+        for (const char * key : { "stop", "max_tokens", "n_predict", "n_keep", "n_discard", "n_sink", "priority",
+                                  "deadline_ms", "slo", "stream", "timings_per_token", "post_sampling_probs" }) {
+            data.erase(key);
+        }
+
+        return data.dump();
+    }
+
+    common_sampler * sampler_init(const slot_params & params, std::string & key) {
+        key = sampler_cache_key(params);
+        if (key.empty()) {
+            return common_sampler_init(model, params.sampling);
+        }
+
+        auto it = sampler_cache_index.find(key);
+        if (it != sampler_cache_index.end()) {
+            sampler_cache.splice(sampler_cache.begin(), sampler_cache, it->second);
+            return common_sampler_clone(it->second->second);
+        }
+
+        common_sampler * smpl = common_sampler_init(model, params.sampling);
+        if (smpl == nullptr) {
+            key.clear();
+            return nullptr;
+        }
+
+        sampler_cache.emplace_front(key, smpl);
+        sampler_cache_index.emplace(key, sampler_cache.begin());
+
+        if (sampler_cache.size() > sampler_cache_max) {
+            common_sampler_free(sampler_cache.back().second);
+            sampler_cache_index.erase(sampler_cache.back().first);
+            sampler_cache.pop_back();
+        }
+
+        return common_sampler_clone(smpl);
+    }
+
+    // bring the sampler of the slot back to its initial state, resetting a grammar sampler parses the grammar again
+    // so a cached one is cloned instead
+    void sampler_reset(server_slot & slot) {
+        if (!slot.smpl_key.empty()) {
+            auto it = sampler_cache_index.find(slot.smpl_key);
+            if (it != sampler_cache_index.end()) {
+                common_sampler_free(slot.smpl);
+                slot.smpl = common_sampler_clone(it->second->second);
+                return;
+            }
+        }
+
+        common_sampler_reset(slot.smpl);
+    }
+
     bool launch_slot_with_task(server_slot & slot, server_task && task) {
         slot.reset();
 
+        const int64_t t_launch = ggml_time_us();
+
+        metrics.on_launch(task, t_launch);
+
+        if (task.t_queued >= 0 && Tracer::instance().enabled()) {
+            // queue_wait covers the time spent in the deferred queue as well. t_queued is a ggml time, the span
+            // is placed on the clock of the tracer like the other spans
+            const int64_t t_end = Tracer::now_us();
+            Tracer::instance().record(task.trace_id, "queue_wait", t_end - (t_launch - task.t_queued), t_end, slot.id);
+        }
+
         if (!are_lora_equal(task.params.lora, slot.lora)) {
             // if lora has changed, check to see if the cache should be cleared
             if (lora_should_clear_cache(slot.lora, task.params.lora)) {
                 SLT_INF(slot, "clearing cache for lora change. %zu loras -> %zu loras\n", slot.lora.size(), task.params.lora.size());
                 slot.prompt.tokens.clear();
+                slot_index_update(slot);
             } else {
                 SLT_INF(slot, "keeping cache for alora. %zu target loras\n", task.params.lora.size());
             }
@@ -2770,12 +5590,15 @@ struct server_context {
                 common_sampler_free(slot.smpl);
             }
 
-            slot.smpl = common_sampler_init(model, task.params.sampling);
+            slot.smpl = sampler_init(task.params, slot.smpl_key);
             if (slot.smpl == nullptr) {
                 // for now, the only error that may happen here is invalid grammar
                 send_error(task, "Failed to parse grammar", ERROR_TYPE_INVALID_REQUEST);
                 return false;
             }
+
+            const uint32_t seed = task.params.sampling.seed;
+            slot.rng.seed(seed == LLAMA_DEFAULT_SEED ? std::random_device()() : seed);
         }
 
         // initialize draft batch
@@ -2785,9 +5608,17 @@ struct server_context {
             slot.batch_spec = llama_batch_init(task.params.speculative.n_max + 1, 0, 1);
         }
 
+        // the slot keeps the part of its prompt that the task shares, the rest of the task is not computed yet
+        // and must not count as shared with the other slots - the index is refreshed on release
+        if (!mctx) {
+            slot_index_update(slot, slot.prompt.tokens.get_common_prefix(task.tokens));
+        }
+
         slot.task = std::make_unique<const server_task>(std::move(task));
 
-        slot.state = SLOT_STATE_STARTED;
+        slot.stop_matcher = StopMatcher(slot.task->params.antiprompt);
+
+        slot.state = slot_parent(slot) ? SLOT_STATE_WAIT_PARENT : SLOT_STATE_STARTED;
 
         SLT_INF(slot, "%s", "processing task\n");
 
@@ -2804,47 +5635,48 @@ struct server_context {
 
     bool process_token(completion_token_output & result, server_slot & slot) {
         // remember which tokens were sampled - used for repetition penalties during sampling
-        const std::string token_str = result.text_to_send;
         slot.sampled = result.tok;
 
-        slot.generated_text += token_str;
+        slot.generated_text += result.text_to_send;
+        slot.generated_utf8.append(result.text_to_send);
         if (slot.task->params.return_tokens) {
             slot.generated_tokens.push_back(result.tok);
         }
         slot.has_next_token = true;
 
-        // check if there is incomplete UTF-8 character at the end
-        bool incomplete = validate_utf8(slot.generated_text) < slot.generated_text.size();
+        // check if there is incomplete UTF-8 character at the end, only the bytes of the new token are inspected
+        const bool incomplete = slot.generated_utf8.incomplete();
 
         // search stop word and delete it
         if (!incomplete) {
             size_t pos = std::min(slot.n_sent_text, slot.generated_text.size());
 
-            const std::string str_test = slot.generated_text.substr(pos);
             bool send_text = true;
 
-            size_t stop_pos = slot.find_stopping_strings(str_test, token_str.size(), true);
+            size_t stop_pos = slot.find_stopping_strings(pos, true);
             if (stop_pos != std::string::npos) {
                 slot.generated_text.erase(
-                        slot.generated_text.begin() + pos + stop_pos,
+                        slot.generated_text.begin() + stop_pos,
                         slot.generated_text.end());
                 pos = std::min(slot.n_sent_text, slot.generated_text.size());
             } else if (slot.has_next_token) {
-                stop_pos = slot.find_stopping_strings(str_test, token_str.size(), false);
+                stop_pos = slot.find_stopping_strings(pos, false);
                 send_text = stop_pos == std::string::npos;
             }
 
             // check if there is any token to predict
             if (send_text) {
                 // no send the stop word in the response
-                result.text_to_send = slot.generated_text.substr(pos, std::string::npos);
+                result.text_to_send.assign(slot.generated_text, pos, std::string::npos);
                 slot.n_sent_text += result.text_to_send.size();
-                // add the token to slot queue and cache
             } else {
-                result.text_to_send = "";
+                result.text_to_send.clear();
             }
 
-            slot.add_token(result);
+            // the token probs are only kept for the final response
+            if (slot.task->params.sampling.n_probs > 0) {
+                slot.add_token(result);
+            }
             if (slot.task->params.stream) {
                 send_partial_response(slot, result, false);
             }
@@ -2949,14 +5781,14 @@ struct server_context {
                     slot.task->params.n_predict, n_ctx_train);
         }
 
-        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining, result.tok, token_str.c_str());
+        SLT_DBG(slot, "n_decoded = %d, n_remaining = %d, next token: %5d '%s'\n", slot.n_decoded, slot.n_remaining, result.tok, result.text_to_send.c_str());
 
         return slot.has_next_token; // continue
     }
 
-    void populate_token_probs(const server_slot & slot, completion_token_output & result, bool post_sampling, bool special, int idx) const {
+    // logits: the logits of the slot, read by the caller (the sampling threads must not use the context)
+    void populate_token_probs(server_slot & slot, completion_token_output & result, bool post_sampling, bool special, const float * logits) const {
         size_t n_probs = slot.task->params.sampling.n_probs;
-        size_t n_vocab = llama_vocab_n_tokens(vocab);
 
         if (post_sampling) {
             const auto * cur_p = common_sampler_get_candidates(slot.smpl, true);
@@ -2975,29 +5807,21 @@ struct server_context {
             for (size_t i = 0; i < std::min(max_probs, n_probs); i++) {
                 result.probs.push_back({
                                                cur_p->data[i].id,
-                                               common_token_to_piece(ctx, cur_p->data[i].id, special),
+                                               std::string(token_pieces.piece(cur_p->data[i].id, special)),
                                                cur_p->data[i].p
                                        });
             }
         } else {
-            // TODO: optimize this with min-p optimization
-            std::vector<llama_token_data> cur = get_token_probabilities(ctx, idx);
+            auto & cur = slot.probs_top;
 
-            // set probability for sampled token
-            for (size_t i = 0; i < n_vocab; i++) {
-                // set probability for sampled token
-                if (cur[i].id == result.tok) {
-                    result.prob = cur[i].p;
-                    break;
-                }
-            }
+            // set probability for sampled token and top n_probs tokens
+            result.prob = get_token_probabilities(logits, llama_vocab_n_tokens(vocab), result.tok, n_probs, cur);
 
-            // set probability for top n_probs tokens
-            result.probs.reserve(n_probs);
-            for (size_t i = 0; i < std::min(n_vocab, n_probs); i++) {
+            result.probs.reserve(cur.size());
+            for (size_t i = 0; i < cur.size(); i++) {
                 result.probs.push_back({
                                                cur[i].id,
-                                               common_token_to_piece(ctx, cur[i].id, special),
+                                               std::string(token_pieces.piece(cur[i].id, special)),
                                                cur[i].p
                                        });
             }
@@ -3040,6 +5864,8 @@ struct server_context {
     }
 
     void send_partial_response(server_slot & slot, const completion_token_output & tkn, bool is_progress) {
+        Tracer::Span span(slot.task->trace_id, "send_partial", slot.id);
+
         auto res = std::make_unique<server_task_result_cmpl_partial>();
 
         res->id    = slot.task->id;
@@ -3108,7 +5934,7 @@ struct server_context {
         res->oaicompat         = slot.task->params.oaicompat;
         res->oaicompat_model   = slot.task->params.oaicompat_model;
         res->oaicompat_cmpl_id = slot.task->params.oaicompat_cmpl_id;
-        res->oaicompat_msg     = slot.update_chat_msg(res->oaicompat_msg_diffs);
+        res->oaicompat_msg     = slot.update_chat_msg(res->oaicompat_msg_diffs, true);
 
         // populate res.probs_output
         if (slot.task->params.sampling.n_probs > 0) {
@@ -3319,8 +6145,22 @@ struct server_context {
             {
                 const int id_slot = task.id_slot;
 
+                if (task.t_deadline >= 0 && !mctx && !deadline_feasible(task, task.tokens.size() - slot_index.n_common_max(task.tokens.get_text_tokens()))) {
+                    SRV_WRN("the deadline of task %d cannot be met, rejecting it\n", task.id);
+                    metrics.on_deadline_rejected(task);
+                    send_error(task, "the deadline of the request cannot be met", ERROR_TYPE_UNAVAILABLE);
+                    break;
+                }
+
+                // the suspended tasks of higher or equal priority go first
+                slots_resume(task.params.priority);
+
                 server_slot * slot = id_slot != -1 ? get_slot_by_id(id_slot) : get_available_slot(task);
 
+                if (slot == nullptr && id_slot == -1 && (task.type == SERVER_TASK_TYPE_COMPLETION || task.type == SERVER_TASK_TYPE_INFILL)) {
+                    slot = slot_preempt(task);
+                }
+
                 if (slot == nullptr) {
                     // if no slot is available, we defer this task for processing later
                     SRV_DBG("no slot is available, defer task, id_task = %d\n", task.id);
@@ -3335,6 +6175,12 @@ struct server_context {
                     break;
                 }
 
+                if (slot_ctx_elastic && !ctx_budget_admit(task)) {
+                    SRV_DBG("not enough context budget, defer task, id_task = %d\n", task.id);
+                    queue_tasks.defer(std::move(task));
+                    break;
+                }
+
                 if (!launch_slot_with_task(*slot, std::move(task))) {
                     SRV_ERR("failed to launch slot with task, id_task = %d\n", task.id);
                     break;
@@ -3349,6 +6195,14 @@ struct server_context {
                         break;
                     }
                 }
+
+                for (auto it = slots_suspended.begin(); it != slots_suspended.end(); ++it) {
+                    if (it->task->id == task.id_target) {
+                        common_sampler_free(it->smpl);
+                        slots_suspended.erase(it);
+                        break;
+                    }
+                }
             } break;
             case SERVER_TASK_TYPE_NEXT_RESPONSE:
             {
@@ -3397,6 +6251,18 @@ struct server_context {
                 res->n_decode_total          = metrics.n_decode_total;
                 res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                res->n_prompt_tokens_shared_total = metrics.n_prompt_tokens_shared_total;
+
+                res->n_preempted_total = metrics.n_preempted_total;
+                res->n_resumed_total   = metrics.n_resumed_total;
+
+                if (prompt_cache) {
+                    res->prompt_cache_data = prompt_cache->to_json();
+                }
+
+                res->slo_data = metrics.slo_to_json();
+                res->histograms_data = metrics.histograms_to_json();
+
                 if (task.metrics_reset_bucket) {
                     metrics.reset_bucket();
                 }
@@ -3422,27 +6288,40 @@ struct server_context {
                     break;
                 }
 
-                const size_t token_count = slot->prompt.tokens.size();
                 const int64_t t_start = ggml_time_us();
 
-                std::string filename = task.slot_action.filename;
-                std::string filepath = task.slot_action.filepath;
+                // the slot is busy only for the copy of its state, the file is written by the I/O thread
+                auto tokens = std::make_shared<llama_tokens>(slot->prompt.tokens.get_text_tokens());
+                auto state  = std::make_shared<std::vector<uint8_t>>(llama_state_seq_get_size_ext(ctx, slot->id, 0));
+                llama_state_seq_get_data_ext(ctx, state->data(), state->size(), slot->id, 0);
 
-                const llama_tokens & tokens = slot->prompt.tokens.get_text_tokens();
-                const size_t nwrite = llama_state_seq_save_file(ctx, filepath.c_str(), slot->id, tokens.data(), token_count);
+                const int64_t t_copy_us = ggml_time_us() - t_start;
 
-                const int64_t t_end = ggml_time_us();
-                const double t_save_ms = (t_end - t_start) / 1000.0;
+                if (!slot_io) {
+                    slot_io = std::make_unique<server_slot_io>();
+                }
 
-                auto res = std::make_unique<server_task_result_slot_save_load>();
-                res->id       = task.id;
-                res->id_slot  = id_slot;
-                res->filename = filename;
-                res->is_save  = true;
-                res->n_tokens = token_count;
-                res->n_bytes  = nwrite;
-                res->t_ms     = t_save_ms;
-                queue_results.send(std::move(res));
+                slot_io->submit([this, id_task = task.id, id_slot, filename = task.slot_action.filename, filepath = task.slot_action.filepath, tokens, state, t_copy_us]() {
+                    const int64_t t_start = ggml_time_us();
+
+                    const size_t nwrite = server_slot_io::write(filepath, *tokens, *state);
+                    if (nwrite == 0) {
+                        send_error(id_task, "Unable to write the slot save file", ERROR_TYPE_SERVER);
+                        return;
+                    }
+
+                    const double t_save_ms = (t_copy_us + ggml_time_us() - t_start) / 1000.0;
+
+                    auto res = std::make_unique<server_task_result_slot_save_load>();
+                    res->id       = id_task;
+                    res->id_slot  = id_slot;
+                    res->filename = filename;
+                    res->is_save  = true;
+                    res->n_tokens = tokens->size();
+                    res->n_bytes  = nwrite;
+                    res->t_ms     = t_save_ms;
+                    queue_results.send(std::move(res));
+                });
             } break;
             case SERVER_TASK_TYPE_SLOT_RESTORE:
             {
@@ -3453,6 +6332,34 @@ struct server_context {
                     send_error(task, "Invalid slot ID", ERROR_TYPE_INVALID_REQUEST);
                     break;
                 }
+
+                if (!task.slot_action.state) {
+                    // the file is read by the I/O thread first, then the task comes back with the state
+                    if (!slot_io) {
+                        slot_io = std::make_unique<server_slot_io>();
+                    }
+
+                    auto job = std::make_shared<server_task>(std::move(task));
+                    slot_io->submit([this, job, n_ctx_slot = (size_t) slot->n_ctx]() {
+                        const int64_t t_start = ggml_time_us();
+
+                        auto state = std::make_shared<std::vector<uint8_t>>();
+
+                        const size_t nread = server_slot_io::read(job->slot_action.filepath, n_ctx_slot, job->slot_action.state_tokens, *state);
+                        if (nread == 0) {
+                            send_error(job->id, "Unable to restore slot, invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
+                            return;
+                        }
+
+                        job->slot_action.state     = std::move(state);
+                        job->slot_action.n_read    = nread;
+                        job->slot_action.t_read_us = ggml_time_us() - t_start;
+
+                        queue_tasks.post(std::move(*job));
+                    });
+                    break;
+                }
+
                 if (slot->is_processing()) {
                     // if requested slot is unavailable, we defer this task for processing later
                     SRV_DBG("requested slot is unavailable, defer task, id_task = %d\n", task.id);
@@ -3463,23 +6370,24 @@ struct server_context {
                 const int64_t t_start = ggml_time_us();
 
                 std::string filename = task.slot_action.filename;
-                std::string filepath = task.slot_action.filepath;
 
-                llama_tokens tokens;
-                tokens.resize(slot->n_ctx);
-                size_t token_count = 0;
-                size_t nread = llama_state_seq_load_file(ctx, filepath.c_str(), slot->id, tokens.data(), tokens.size(), &token_count);
+                const auto & state = *task.slot_action.state;
+
+                llama_tokens tokens = std::move(task.slot_action.state_tokens);
+                const size_t token_count = tokens.size();
+                const size_t nread = llama_state_seq_set_data_ext(ctx, state.data(), state.size(), slot->id, 0) == state.size() ? task.slot_action.n_read : 0;
                 if (nread == 0) {
                     slot->prompt.tokens.clear(); // KV may already been invalidated?
+                    slot_index_update(*slot);
                     send_error(task, "Unable to restore slot, no available space in KV cache or invalid slot save file", ERROR_TYPE_INVALID_REQUEST);
                     break;
                 }
-                tokens.resize(token_count);
                 slot->prompt.tokens.clear();
                 slot->prompt.tokens.insert(tokens);
+                slot_index_update(*slot);
 
                 const int64_t t_end = ggml_time_us();
-                const double t_restore_ms = (t_end - t_start) / 1000.0;
+                const double t_restore_ms = (task.slot_action.t_read_us + t_end - t_start) / 1000.0;
 
                 auto res = std::make_unique<server_task_result_slot_save_load>();
                 res->id       = task.id;
@@ -3511,6 +6419,7 @@ struct server_context {
                 const size_t n_erased = slot->prompt.tokens.size();
                 llama_memory_seq_rm(llama_get_memory(ctx), slot->id, -1, -1);
                 slot->prompt.tokens.clear();
+                slot_index_update(*slot);
 
                 auto res = std::make_unique<server_task_result_slot_erase>();
                 res->id       = task.id;
@@ -3518,6 +6427,37 @@ struct server_context {
                 res->n_erased = n_erased;
                 queue_results.send(std::move(res));
             } break;
+            case SERVER_TASK_TYPE_PROMPT_CACHE_PIN:
+            case SERVER_TASK_TYPE_PROMPT_CACHE_UNPIN:
+            {
+                if (!prompt_cache) {
+                    send_error(task, "The prompt cache is disabled - start the server with `--cache-ram N`", ERROR_TYPE_NOT_SUPPORTED);
+                    break;
+                }
+
+                const bool is_pin = task.type == SERVER_TASK_TYPE_PROMPT_CACHE_PIN;
+
+                if (is_pin) {
+                    if (task.tokens.empty()) {
+                        send_error(task, "The pinned prompt is empty", ERROR_TYPE_INVALID_REQUEST);
+                        break;
+                    }
+
+                    prompt_cache->pin(task.pin_name, task.tokens.get_text_tokens());
+                } else if (!prompt_cache->unpin(task.pin_name)) {
+                    send_error(task, "Unknown pin name", ERROR_TYPE_NOT_FOUND);
+                    break;
+                }
+
+                SRV_INF("%s prompt cache prefix '%s', n_tokens = %zu\n", is_pin ? "pinned" : "unpinned", task.pin_name.c_str(), task.tokens.size());
+
+                auto res = std::make_unique<server_task_result_prompt_cache_pin>();
+                res->id       = task.id;
+                res->name     = task.pin_name;
+                res->is_pin   = is_pin;
+                res->n_tokens = task.tokens.size();
+                queue_results.send(std::move(res));
+            } break;
             case SERVER_TASK_TYPE_SET_LORA:
             {
                 params_base.lora_adapters = std::move(task.set_lora);
@@ -3529,7 +6469,32 @@ struct server_context {
         }
     }
 
+    // a span for each slot with tokens in the decoded batch: a chunk of the prompt or the generated tokens
+    void trace_decode(int64_t t_start) {
+        const int64_t t_end = Tracer::now_us();
+
+        for (const auto & slot : slots) {
+            if (!slot.task) {
+                continue;
+            }
+
+            if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_DONE_PROMPT) {
+                Tracer::instance().record(slot.task->trace_id, "prefill", t_start, t_end, slot.id);
+            } else if (slot.state == SLOT_STATE_GENERATING) {
+                Tracer::instance().record(slot.task->trace_id, "decode", t_start, t_end, slot.id);
+            }
+        }
+    }
+
     void update_slots() {
+        slots_resume(INT32_MIN);
+
+        for (auto & task : queue_tasks.pop_deferred_expired([this](const server_task & task) { return !deadline_feasible(task, task.tokens.size()); })) {
+            SRV_WRN("the deadline of deferred task %d cannot be met, rejecting it\n", task.id);
+            metrics.on_deadline_rejected(task);
+            send_error(task, "the deadline of the request cannot be met", ERROR_TYPE_UNAVAILABLE);
+        }
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -3543,6 +6508,11 @@ struct server_context {
 
             if (all_idle) {
                 SRV_INF("%s", "all slots are idle\n");
+
+                if (snapshot_interval_us > 0 && snapshot_dirty && ggml_time_us() - t_snapshot_last >= snapshot_interval_us) {
+                    snapshot_save();
+                }
+
                 if (clean_kv_cache) {
                     kv_cache_clear();
                 }
@@ -3551,6 +6521,14 @@ struct server_context {
             }
         }
 
+        // the parent was released before evaluating its prompt (error or cancellation) - process the prompt instead
+        for (auto & slot : slots) {
+            if (slot.state == SLOT_STATE_WAIT_PARENT && !slot_parent(slot)) {
+                SLT_INF(slot, "parent task %d is gone, processing the prompt\n", slot.task->id_parent);
+                slot.state = SLOT_STATE_STARTED;
+            }
+        }
+
         {
             SRV_DBG("%s", "posting NEXT_RESPONSE\n");
 
@@ -3578,34 +6556,42 @@ struct server_context {
                 }
 
                 // Shift context
-                int n_keep = slot.task->params.n_keep < 0 ? slot.n_prompt_tokens() : slot.task->params.n_keep;
+                int n_keep;
+                int n_discard;
 
-                if (add_bos_token) {
-                    n_keep += 1;
-                }
+                if (slot.task->params.n_sink > 0) {
+                    // streaming: keep the leading sink tokens (they collect most of the attention, so dropping
+                    // them degrades the output) plus a rolling window of the most recent tokens, and slide the
+                    // window by a small step so that little recent context is lost at once. every shift re-rotates
+                    // the whole kept window, so a smaller step means more shifts and more total work
+                    n_keep = std::min(slot.n_ctx - 4, slot.task->params.n_sink);
 
-                n_keep = std::min(slot.n_ctx - 4, n_keep);
+                    const int n_left = slot.n_past - n_keep;
 
-                const int n_left    = slot.n_past - n_keep;
-                const int n_discard = slot.task->params.n_discard ? slot.task->params.n_discard : (n_left / 2);
+                    n_discard = slot.task->params.n_discard ? slot.task->params.n_discard : std::max(ctx_shift_stream_step, slot.n_ctx / 32);
+                    n_discard = std::min(n_discard, n_left / 2);
+                } else {
+                    n_keep = slot.task->params.n_keep < 0 ? slot.n_prompt_tokens() : slot.task->params.n_keep;
 
-                SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, n_left, n_discard);
+                    if (add_bos_token) {
+                        n_keep += 1;
+                    }
 
-                llama_memory_seq_rm (llama_get_memory(ctx), slot.id, n_keep            , n_keep + n_discard);
-                llama_memory_seq_add(llama_get_memory(ctx), slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+                    n_keep = std::min(slot.n_ctx - 4, n_keep);
 
-                // add generated tokens to cache
-                {
-                    llama_tokens new_tokens = slot.prompt.tokens.get_text_tokens(); // copy
-                    for (size_t i = n_keep + n_discard; i < new_tokens.size(); i++) {
-                        new_tokens[i - n_discard] = new_tokens[i];
-                    }
+                    const int n_left = slot.n_past - n_keep;
 
-                    new_tokens.resize(slot.prompt.tokens.size() - n_discard);
-                    slot.prompt.tokens.clear();
-                    slot.prompt.tokens.insert(new_tokens);
+                    n_discard = slot.task->params.n_discard ? slot.task->params.n_discard : (n_left / 2);
                 }
 
+                SLT_WRN(slot, "slot context shift, n_keep = %d, n_left = %d, n_discard = %d\n", n_keep, slot.n_past - n_keep, n_discard);
+
+                llama_memory_seq_rm (llama_get_memory(ctx), slot.id, n_keep            , n_keep + n_discard);
+                llama_memory_seq_add(llama_get_memory(ctx), slot.id, n_keep + n_discard, slot.n_past,        -n_discard);
+
+                // drop the discarded tokens from the cache in place
+                slot.prompt.tokens.erase(n_keep, n_discard);
+
                 slot.n_past -= n_discard;
 
                 slot.truncated = true;
@@ -3615,6 +6601,10 @@ struct server_context {
         // start populating the batch for this iteration
         common_batch_clear(batch);
 
+        for (auto & slot : slots) {
+            slot.batched = false;
+        }
+
         // track if given slot can be batched with slots already in the batch
         server_slot * slot_batched = nullptr;
 
@@ -3636,7 +6626,13 @@ struct server_context {
                 continue;
             }
 
+            if (slot_ctx_elastic && !ctx_budget_acquire(slot, 1)) {
+                ctx_budget_preempt(slot);
+                continue;
+            }
+
             slot.i_batch = batch.n_tokens;
+            slot.batched = true;
 
             common_batch_add(batch, slot.sampled, slot.n_past, { slot.id }, true);
 
@@ -3655,7 +6651,10 @@ struct server_context {
         float alora_scale = -1.0f;
         size_t alora_disabled_id = 0;
         if (params_base.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            // earliest deadline first
+            for (server_slot * slot_ptr : slots_by_deadline()) {
+                server_slot & slot = *slot_ptr;
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -3669,6 +6668,14 @@ struct server_context {
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_STARTED) {
                     const auto & input_tokens = slot.task->tokens;
 
+                    if (!slot.batched && !deadline_feasible(*slot.task, slot.n_prompt_tokens() - slot.n_past)) {
+                        SLT_WRN(slot, "the deadline cannot be met anymore, n_past = %d, n_prompt_tokens = %d\n", slot.n_past, slot.n_prompt_tokens());
+                        metrics.on_deadline_rejected(*slot.task);
+                        send_error(slot, "the deadline of the request cannot be met", ERROR_TYPE_UNAVAILABLE);
+                        slot.release();
+                        continue;
+                    }
+
                     // TODO: maybe move branch to outside of this loop in the future
                     if (slot.state == SLOT_STATE_STARTED) {
                         slot.t_start_process_prompt = ggml_time_us();
@@ -3788,6 +6795,10 @@ struct server_context {
 
                                     SLT_DBG(slot, "after context reuse, new slot.n_past = %d\n", slot.n_past);
                                 }
+
+                                if (slot_prefix_share && slot.alora_invocation_start < 0) {
+                                    slot_prefix_copy(slot, input_tokens);
+                                }
                             } else {
                                 // if we don't cache the prompt, we have to remove the entire KV cache
                                 slot.n_past = 0;
@@ -3989,6 +7000,27 @@ struct server_context {
                             (llama_model_n_swa(model) > 0 && !params_base.swa_full)
                     );
 
+                    // with an elastic context, the cells of the tokens taken by the loop below are reserved at once.
+                    // if the budget cannot cover them, the chunk is cut to what is left of it
+                    int32_t n_budget = 0;
+                    if (slot_ctx_elastic) {
+                        int32_t n_chunk = std::min(slot.n_prompt_tokens() - slot.n_past, n_batch - batch.n_tokens);
+                        if (do_checkpoint && slot.n_prompt_tokens() - slot.n_past > 64) {
+                            n_chunk = std::min(n_chunk, slot.n_prompt_tokens() - slot.n_past - 64);
+                        }
+                        if (alora_scale > 0 && slot.n_past < slot.alora_invocation_start - 1) {
+                            n_chunk = std::min(n_chunk, slot.alora_invocation_start - 1 - slot.n_past);
+                        }
+                        for (int32_t i = 0; i < n_chunk; ++i) {
+                            if (input_tokens[slot.n_past + i] == LLAMA_TOKEN_NULL) {
+                                n_chunk = i;
+                                break;
+                            }
+                        }
+
+                        n_budget = ctx_budget_acquire(slot, n_chunk) ? n_chunk : std::max(0, ctx_budget_total - ctx_budget_used());
+                    }
+
                     // add prompt tokens for processing in the current batch
                     while (slot.n_past < slot.n_prompt_tokens() && batch.n_tokens < n_batch) {
                         // get next token to process
@@ -4005,9 +7037,15 @@ struct server_context {
                             break;
                         }
 
+                        if (slot_ctx_elastic && n_budget-- <= 0) {
+                            SLT_DBG(slot, "waiting for context budget, n_past = %d\n", slot.n_past);
+                            break;
+                        }
+
                         // embedding requires all tokens in the batch to be output
                         common_batch_add(batch, cur_tok, slot.n_past, { slot.id }, slot.need_embd());
                         slot.prompt.tokens.push_back(cur_tok);
+                        slot.batched = true;
 
                         slot.n_prompt_tokens_processed++;
                         slot.n_past++;
@@ -4022,13 +7060,16 @@ struct server_context {
 
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_past / slot.n_prompt_tokens());
 
+                    // the tokens of the batch are computed before the next task is assigned a slot
+                    slot_index_update(slot);
+
                     // entire prompt has been processed
                     if (slot.n_past == slot.n_prompt_tokens()) {
                         slot.state = SLOT_STATE_DONE_PROMPT;
 
                         GGML_ASSERT(batch.n_tokens > 0);
 
-                        common_sampler_reset(slot.smpl);
+                        sampler_reset(slot);
 
                         // Process all prompt tokens through sampler system
                         for (int i = 0; i < slot.n_prompt_tokens(); ++i) {
@@ -4071,10 +7112,10 @@ struct server_context {
                             auto & cur = slot.prompt.checkpoints.emplace_back(server_prompt_checkpoint{
                                     /*.pos_min = */ pos_min,
                                     /*.pos_max = */ pos_max,
-                                    /*.data    = */ std::vector<uint8_t>(checkpoint_size),
+                                    /*.data    = */ {},
                             });
 
-                            llama_state_seq_get_data_ext(ctx, cur.data.data(), checkpoint_size, slot.id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
+                            llama_state_seq_get_data_ext(ctx, cur.data.alloc(checkpoint_size), checkpoint_size, slot.id, LLAMA_STATE_SEQ_FLAGS_PARTIAL_ONLY);
 
                             SLT_WRN(slot, "created context checkpoint %d of %d (pos_min = %d, pos_max = %d, size = %.3f MiB)\n",
                                     (int) slot.prompt.checkpoints.size(), params_base.n_ctx_checkpoints, cur.pos_min, cur.pos_max, (float) cur.data.size() / 1024 / 1024);
@@ -4125,9 +7166,15 @@ struct server_context {
                     batch.logits   + i,
             };
 
+            const int64_t t_decode_start = Tracer::instance().enabled() ? Tracer::now_us() : -1;
+
             const int ret = llama_decode(ctx, batch_view);
 
-            metrics.on_decoded(slots);
+            metrics.on_decoded(slots, double(n_tokens) / n_batch);
+
+            if (t_decode_start >= 0) {
+                trace_decode(t_decode_start);
+            }
 
             if (ret != 0) {
                 {
@@ -4172,6 +7219,14 @@ struct server_context {
             // on successful decode, restore the original batch size
             n_batch = llama_n_batch(ctx);
 
+            for (auto & slot : slots) {
+                if (slot.state == SLOT_STATE_DONE_PROMPT && slot.i_batch >= (int) i && slot.i_batch < (int) (i + n_tokens)) {
+                    slot_fork(slot);
+                }
+            }
+
+            slots_sample.clear();
+
             for (auto & slot : slots) {
                 // optionally send prompt processing progress
                 if (slot.state == SLOT_STATE_PROCESSING_PROMPT || slot.state == SLOT_STATE_DONE_PROMPT) {
@@ -4206,9 +7261,46 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
+                slots_sample.push_back(&slot);
+            }
+
+            // every read of the logits through the context synchronizes the backend and updates the context, so the
+            // context is used from this thread only: the logits of the slots are read here, and the slots that need
+            // the full sampler chain (which reads them through the context) sample here as well
+            slots_sample_logits.resize(slots_sample.size());
+            slots_sample_id.assign(slots_sample.size(), LLAMA_TOKEN_NULL);
+
+            for (size_t k = 0; k < slots_sample.size(); k++) {
+                server_slot & slot = *slots_sample[k];
+
                 const int tok_idx = slot.i_batch - i;
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                slots_sample_logits[k] = llama_get_logits_ith(ctx, tok_idx);
+
+                if (slot.task->params.fast_sampler == FAST_SAMPLER_NONE) {
+                    Tracer::Span span(slot.task->trace_id, "sample", slot.id);
+
+                    slots_sample_id[k] = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                }
+            }
+
+            // the slots only touch their own state (sampler, RNG, generated text) so the results do not depend
+            // on the number of threads; the responses of each slot are still sent in order
+            slots_sample_next.assign(slots_sample.size(), 0);
+
+            sampling_pool->parallel_for(slots_sample.size(), [&](size_t k) {
+                server_slot & slot = *slots_sample[k];
+
+                Tracer::Span span(slot.task->trace_id, "process_token", slot.id);
+
+                const float * logits = slots_sample_logits[k];
+
+                const auto & params = slot.task->params;
+
+                // the sampler chain still accepts the token, it keeps the history of the sequence
+                llama_token id = params.fast_sampler != FAST_SAMPLER_NONE
+                    ? fast_sampler_sample(params.fast_sampler, logits, llama_vocab_n_tokens(vocab), params.sampling, slot.rng, slot.probs_top)
+                    : slots_sample_id[k];
 
                 slot.i_batch = -1;
 
@@ -4221,28 +7313,38 @@ struct server_context {
                 if (slot.n_decoded == 1) {
                     slot.t_start_generation = t_current;
                     slot.t_prompt_processing = (slot.t_start_generation - slot.t_start_process_prompt) / 1e3;
-                    metrics.on_prompt_eval(slot);
                 }
 
                 slot.t_token_generation = std::max<int64_t>(1, t_current - slot.t_start_generation) / 1e3;
 
+                metrics.on_token(slot, t_current);
+
                 completion_token_output result;
                 result.tok          = id;
-                result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                result.text_to_send = token_pieces.piece(result.tok, accept_special_token(slot, result.tok));
                 result.prob         = 1.0f; // TODO: set it here instead of doing inside populate_token_probs
 
                 if (slot.task->params.sampling.n_probs > 0) {
-                    populate_token_probs(slot, result, slot.task->params.post_sampling_probs, params_base.special, tok_idx);
+                    populate_token_probs(slot, result, slot.task->params.post_sampling_probs, params_base.special, logits);
+                }
+
+                slots_sample_next[k] = process_token(result, slot);
+            });
+
+            for (size_t k = 0; k < slots_sample.size(); k++) {
+                server_slot & slot = *slots_sample[k];
+
+                if (slot.n_decoded == 1) {
+                    metrics.on_prompt_eval(slot);
+                    metrics.on_first_token(slot, slot.t_start_generation);
                 }
 
-                if (!process_token(result, slot)) {
+                if (!slots_sample_next[k]) {
                     // release slot because of stop condition
                     slot.print_timings();
                     send_final_response(slot);
                     metrics.on_prediction(slot);
                     slot.release();
-
-                    continue;
                 }
             }
 
@@ -4310,10 +7412,14 @@ struct server_context {
 
                 SLT_DBG(slot, "decoding speculative batch, size = %d\n", slot.batch_spec.n_tokens);
 
-                llama_decode(ctx, slot.batch_spec);
+                const auto ids = [&] {
+                    Tracer::Span span(slot.task->trace_id, "speculative", slot.id);
 
-                // the accepted tokens from the speculation
-                const auto ids = common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                    llama_decode(ctx, slot.batch_spec);
+
+                    // the accepted tokens from the speculation
+                    return common_sampler_sample_and_accept_n(slot.smpl, ctx, draft);
+                }();
 
                 slot.n_past    += ids.size();
                 slot.n_decoded += ids.size();
@@ -4321,6 +7427,8 @@ struct server_context {
                 // update how many tokens out of those tested were accepted
                 slot.n_draft_accepted += ids.size() - 1;
 
+                metrics.on_speculated(ids.size() - 1, draft.size());
+
                 slot.prompt.tokens.push_back(id);
                 slot.prompt.tokens.insert({ids.begin(), ids.end() - 1});
 
@@ -4330,7 +7438,7 @@ struct server_context {
                     completion_token_output result;
 
                     result.tok          = ids[i];
-                    result.text_to_send = common_token_to_piece(ctx, result.tok, accept_special_token(slot, result.tok));
+                    result.text_to_send = token_pieces.piece(result.tok, accept_special_token(slot, result.tok));
                     result.prob         = 1.0f; // set later
 
                     // TODO: set result.probs
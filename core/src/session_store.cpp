@@ -0,0 +1,147 @@
+#include "session_store.h"
+
+#include <random>
+
+void SessionStore::configure(int64_t ttl_s, size_t n_max) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_ttl_s = ttl_s;
+    m_n_max = n_max;
+}
+
+std::string SessionStore::create(const json& messages, const json& params, std::vector<std::string>& removed) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    while (m_sessions.size() >= m_n_max) {
+        auto lru = m_sessions.end();
+        for (auto it = m_sessions.begin(); it != m_sessions.end(); ++it) {
+            if (!it->second.busy && (lru == m_sessions.end() || it->second.t_last_used < lru->second.t_last_used)) {
+                lru = it;
+            }
+        }
+        if (lru == m_sessions.end()) {
+            return std::string();
+        }
+        removed.push_back(lru->first);
+        m_sessions.erase(lru);
+    }
+
+    std::string id = new_id();
+    while (m_sessions.count(id) > 0) {
+        id = new_id();
+    }
+
+    Session& session = m_sessions[id];
+    session.id          = id;
+    session.messages    = messages;
+    session.params      = params;
+    session.t_last_used = std::chrono::steady_clock::now();
+
+    return id;
+}
+
+std::string SessionStore::begin_turn(const std::string& id, json& messages, json& params) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_sessions.find(id);
+    if (it == m_sessions.end()) {
+        return "Unknown session, it may have expired";
+    }
+
+    Session& session = it->second;
+    if (session.busy) {
+        return "The session is running another turn";
+    }
+
+    session.busy        = true;
+    session.t_last_used = std::chrono::steady_clock::now();
+
+    messages = session.messages;
+    params   = session.params;
+
+    return std::string();
+}
+
+bool SessionStore::end_turn(const std::string& id, const json& messages) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // the session may have been deleted during the turn
+    auto it = m_sessions.find(id);
+    if (it == m_sessions.end()) {
+        return false;
+    }
+
+    Session& session = it->second;
+    session.busy        = false;
+    session.t_last_used = std::chrono::steady_clock::now();
+
+    if (messages.is_array()) {
+        for (const auto& msg : messages) {
+            session.messages.push_back(msg);
+        }
+        session.n_turns++;
+    }
+
+    return true;
+}
+
+bool SessionStore::remove(const std::string& id) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_sessions.erase(id) > 0;
+}
+
+std::vector<std::string> SessionStore::expire() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<std::string> expired;
+    if (m_ttl_s <= 0) {
+        return expired;
+    }
+
+    const auto t_expire = std::chrono::steady_clock::now() - std::chrono::seconds(m_ttl_s);
+    for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+        if (!it->second.busy && it->second.t_last_used < t_expire) {
+            expired.push_back(it->first);
+            it = m_sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    return expired;
+}
+
+SessionStore::json SessionStore::to_json() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // the ids are the only credential of a session, so only counts are reported
+    size_t n_busy = 0;
+    size_t n_messages = 0;
+    uint64_t n_turns = 0;
+    for (const auto& it : m_sessions) {
+        const Session& session = it.second;
+        n_busy += session.busy ? 1 : 0;
+        n_messages += session.messages.size();
+        n_turns += session.n_turns;
+    }
+
+    return json {
+        {"ttl_s",      m_ttl_s},
+        {"n_max",      m_n_max},
+        {"n_sessions", m_sessions.size()},
+        {"n_busy",     n_busy},
+        {"n_messages", n_messages},
+        {"n_turns",    n_turns},
+    };
+}
+
+std::string SessionStore::new_id() {
+    static const char hex[] = "0123456789abcdef";
+
+    static std::mt19937_64 rng(std::random_device{}());
+
+    std::string id = "sess-";
+    for (int i = 0; i < 24; ++i) {
+        id += hex[rng() % 16];
+    }
+    return id;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+// Chat conversations kept by the server, so that a request carries only the messages of the new turn.
+// A session holds the message history and the default parameters of its requests. A session that has
+// been idle for longer than the TTL expires, and the least recently used idle session is evicted when
+// the store is full. A session runs one turn at a time.
+class SessionStore {
+public:
+    using json = nlohmann::ordered_json;
+
+    struct Session {
+        std::string id;
+        json messages = json::array();
+        json params   = json::object();
+
+        int32_t n_turns = 0;
+        bool busy = false;
+
+        std::chrono::steady_clock::time_point t_last_used;
+    };
+
+    void configure(int64_t ttl_s, size_t n_max);
+
+    int64_t ttl() const { return m_ttl_s; }
+
+    size_t n_max() const { return m_n_max; }
+
+    // returns the id of the new session, empty if the store is full of busy sessions.
+    // the sessions removed to make room are added to removed
+    std::string create(const json& messages, const json& params, std::vector<std::string>& removed);
+
+    // start a turn: copy the history and the parameters of the session and mark it busy.
+    // returns an error message if the session does not exist or runs another turn
+    std::string begin_turn(const std::string& id, json& messages, json& params);
+
+    // end the turn started by begin_turn. the messages of the turn (the request and the reply) are added
+    // to the history, a failed turn passes null and leaves the history as it was.
+    // returns false if the session has been deleted during the turn
+    bool end_turn(const std::string& id, const json& messages);
+
+    bool remove(const std::string& id);
+
+    // remove the sessions that have been idle for longer than the TTL and return their ids
+    std::vector<std::string> expire();
+
+    // summary of the sessions, without their ids
+    json to_json() const;
+
+private:
+    std::string new_id();
+
+    int64_t m_ttl_s = 1800;
+    size_t m_n_max = 256;
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<std::string, Session> m_sessions;
+};
@@ -0,0 +1,690 @@
+#include "state_codec.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+namespace {
+
+constexpr uint32_t CODEC_MAGIC = 0x31444353; // 'SCD1'
+
+constexpr size_t HEADER_SIZE = 4 + 4 + 8 + 4 + 4;
+
+// LZ packs at most 255 matched bytes into one extra length byte and HUF at most 8 symbols into one byte
+constexpr uint64_t MAX_RATIO = 4096;
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t MAX_OFFSET = 65535;
+constexpr int HASH_BITS = 16;
+
+constexpr int HUF_MAX_BITS = 12;
+constexpr size_t HUF_HEADER_SIZE = 128; // 256 code lengths, 4 bits each
+
+enum segment_mode : uint8_t {
+    SEGMENT_RAW = 0,
+    SEGMENT_LZ = 1,
+    SEGMENT_HUF = 2,
+};
+
+uint32_t read_u32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+void shuffle(const uint8_t* src, uint8_t* dst, size_t size, size_t width) {
+    const size_t n = size / width;
+    if (width == 2) {
+        for (size_t i = 0; i < n; ++i) {
+            dst[i] = src[2*i];
+            dst[n + i] = src[2*i + 1];
+        }
+        memcpy(dst + 2*n, src + 2*n, size - 2*n);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < width; ++j) {
+            dst[j*n + i] = src[i*width + j];
+        }
+    }
+    memcpy(dst + n*width, src + n*width, size - n*width);
+}
+
+void unshuffle(const uint8_t* src, uint8_t* dst, size_t size, size_t width) {
+    const size_t n = size / width;
+    if (width == 2) {
+        for (size_t i = 0; i < n; ++i) {
+            dst[2*i] = src[i];
+            dst[2*i + 1] = src[n + i];
+        }
+        memcpy(dst + 2*n, src + 2*n, size - 2*n);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < width; ++j) {
+            dst[i*width + j] = src[j*n + i];
+        }
+    }
+    memcpy(dst + n*width, src + n*width, size - n*width);
+}
+
+// sequences: token (4 bits literal length, 4 bits match length - MIN_MATCH), extra literal length bytes,
+// literals, u16 offset, extra match length bytes. The last sequence has literals only.
+// returns the encoded size, or 0 if it would not be smaller than the input
+size_t lz_compress(const uint8_t* src, size_t size, std::vector<uint8_t>& dst) {
+    dst.clear();
+    dst.reserve(size);
+
+    const auto put_length = [&](size_t len) {
+        while (len >= 255) {
+            dst.push_back(255);
+            len -= 255;
+        }
+        dst.push_back((uint8_t) len);
+    };
+
+    const auto put_sequence = [&](const uint8_t* lit, size_t n_lit, size_t offset, size_t n_match) {
+        const size_t ml = n_match >= MIN_MATCH ? n_match - MIN_MATCH : 0;
+
+        dst.push_back((uint8_t) ((std::min<size_t>(n_lit, 15) << 4) | std::min<size_t>(ml, 15)));
+        if (n_lit >= 15) {
+            put_length(n_lit - 15);
+        }
+        dst.insert(dst.end(), lit, lit + n_lit);
+
+        if (n_match > 0) {
+            dst.push_back((uint8_t) (offset & 0xff));
+            dst.push_back((uint8_t) (offset >> 8));
+            if (ml >= 15) {
+                put_length(ml - 15);
+            }
+        }
+    };
+
+    std::vector<int32_t> table(1u << HASH_BITS, -1);
+
+    size_t i = 0;
+    size_t anchor = 0;
+
+    while (i + MIN_MATCH <= size) {
+        const uint32_t seq = read_u32(src + i);
+        const uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+
+        const int32_t cand = table[h];
+        table[h] = (int32_t) i;
+
+        if (cand >= 0 && i - cand <= MAX_OFFSET && read_u32(src + cand) == seq) {
+            size_t len = MIN_MATCH;
+            while (i + len < size && src[cand + len] == src[i + len]) {
+                len++;
+            }
+
+            put_sequence(src + anchor, i - anchor, i - cand, len);
+
+            i += len;
+            anchor = i;
+        } else {
+            // skip faster through data that does not compress
+            i += 1 + ((i - anchor) >> 6);
+        }
+
+        // give up early on data without repetitions, the literals would only be copied around
+        if (dst.size() >= size || (i >= 65536 && anchor == 0)) {
+            return 0;
+        }
+    }
+
+    put_sequence(src + anchor, size - anchor, 0, 0);
+
+    return dst.size() < size ? dst.size() : 0;
+}
+
+bool lz_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t dst_size) {
+    const uint8_t* ip = src;
+    const uint8_t* const iend = src + size;
+
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + dst_size;
+
+    const auto get_length = [&](size_t& len) {
+        uint8_t b;
+        do {
+            if (ip >= iend) {
+                return false;
+            }
+            b = *ip++;
+            len += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < iend) {
+        const uint8_t token = *ip++;
+
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && !get_length(n_lit)) {
+            return false;
+        }
+        if ((size_t) (iend - ip) < n_lit || (size_t) (oend - op) < n_lit) {
+            return false;
+        }
+        memcpy(op, ip, n_lit);
+        ip += n_lit;
+        op += n_lit;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return false;
+        }
+        const size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t) (op - dst)) {
+            return false;
+        }
+
+        size_t n_match = token & 15;
+        if (n_match == 15 && !get_length(n_match)) {
+            return false;
+        }
+        n_match += MIN_MATCH;
+        if ((size_t) (oend - op) < n_match) {
+            return false;
+        }
+
+        // the match can overlap the output
+        const uint8_t* match = op - offset;
+        for (size_t k = 0; k < n_match; ++k) {
+            op[k] = match[k];
+        }
+        op += n_match;
+    }
+
+    return op == oend;
+}
+
+// canonical Huffman code lengths, limited to HUF_MAX_BITS by flattening the frequencies until they fit
+void huf_lengths(const uint32_t freq[256], uint8_t len[256]) {
+    std::vector<uint64_t> f(freq, freq + 256);
+
+    while (true) {
+        std::fill(len, len + 256, 0);
+
+        // nodes 0..255 are the symbols, the internal nodes follow
+        std::vector<uint64_t> weight;
+        std::vector<int> parent;
+        std::vector<int> heap;
+
+        for (int i = 0; i < 256; ++i) {
+            weight.push_back(f[i]);
+            parent.push_back(-1);
+            if (f[i] > 0) {
+                heap.push_back(i);
+            }
+        }
+
+        if (heap.size() == 1) {
+            len[heap[0]] = 1;
+            return;
+        }
+
+        const auto cmp = [&](int a, int b) { return weight[a] > weight[b]; };
+        std::make_heap(heap.begin(), heap.end(), cmp);
+
+        while (heap.size() > 1) {
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            const int a = heap.back();
+            heap.pop_back();
+            std::pop_heap(heap.begin(), heap.end(), cmp);
+            const int b = heap.back();
+            heap.pop_back();
+
+            const int node = (int) weight.size();
+            weight.push_back(weight[a] + weight[b]);
+            parent.push_back(-1);
+            parent[a] = node;
+            parent[b] = node;
+
+            heap.push_back(node);
+            std::push_heap(heap.begin(), heap.end(), cmp);
+        }
+
+        int max_len = 0;
+        for (int i = 0; i < 256; ++i) {
+            if (f[i] == 0) {
+                continue;
+            }
+            int depth = 0;
+            for (int n = i; parent[n] >= 0; n = parent[n]) {
+                depth++;
+            }
+            len[i] = (uint8_t) depth;
+            max_len = std::max(max_len, depth);
+        }
+
+        if (max_len <= HUF_MAX_BITS) {
+            return;
+        }
+
+        for (auto& x : f) {
+            if (x > 0) {
+                x = (x + 1) / 2;
+            }
+        }
+    }
+}
+
+// canonical codes from the lengths, bit-reversed for LSB-first output
+void huf_codes(const uint8_t len[256], uint16_t code[256]) {
+    uint16_t next = 0;
+    int prev_len = 0;
+
+    for (int l = 1; l <= HUF_MAX_BITS; ++l) {
+        for (int s = 0; s < 256; ++s) {
+            if (len[s] != l) {
+                continue;
+            }
+            next <<= (l - prev_len);
+            prev_len = l;
+
+            uint16_t rev = 0;
+            for (int k = 0; k < l; ++k) {
+                rev |= ((next >> k) & 1) << (l - 1 - k);
+            }
+            code[s] = rev;
+            next++;
+        }
+    }
+}
+
+// returns the encoded size, or 0 if it would not be smaller than the input
+size_t huf_compress(const uint8_t* src, size_t size, std::vector<uint8_t>& dst) {
+    uint32_t freq[256] = {};
+    for (size_t i = 0; i < size; ++i) {
+        freq[src[i]]++;
+    }
+
+    uint8_t len[256];
+    uint16_t code[256] = {};
+    huf_lengths(freq, len);
+    huf_codes(len, code);
+
+    uint64_t n_bits = 0;
+    for (int s = 0; s < 256; ++s) {
+        n_bits += (uint64_t) freq[s] * len[s];
+    }
+    if (HUF_HEADER_SIZE + (n_bits + 7) / 8 >= size) {
+        return 0;
+    }
+
+    // room for the whole 64-bit flushes past the end of the bitstream
+    dst.assign(HUF_HEADER_SIZE + (n_bits + 7) / 8 + 8, 0);
+
+    for (int s = 0; s < 256; s += 2) {
+        dst[s / 2] = (uint8_t) (len[s] | (len[s + 1] << 4));
+    }
+
+    uint8_t* op = dst.data() + HUF_HEADER_SIZE;
+
+    uint64_t acc = 0;
+    int n_acc = 0;
+    for (size_t i = 0; i < size; ++i) {
+        acc |= (uint64_t) code[src[i]] << n_acc;
+        n_acc += len[src[i]];
+        if (n_acc >= 48) {
+            memcpy(op, &acc, sizeof(acc));
+            op += n_acc >> 3;
+            acc >>= n_acc & ~7;
+            n_acc &= 7;
+        }
+    }
+    memcpy(op, &acc, sizeof(acc));
+    op += (n_acc + 7) >> 3;
+
+    dst.resize(op - dst.data());
+
+    return dst.size();
+}
+
+bool huf_decompress(const uint8_t* src, size_t size, uint8_t* dst, size_t dst_size) {
+    if (size < HUF_HEADER_SIZE) {
+        return false;
+    }
+
+    uint8_t len[256];
+    for (int s = 0; s < 256; s += 2) {
+        len[s] = src[s / 2] & 15;
+        len[s + 1] = src[s / 2] >> 4;
+    }
+
+    // the lengths must describe a complete prefix code (or a single symbol)
+    uint32_t kraft = 0;
+    for (int s = 0; s < 256; ++s) {
+        if (len[s] > HUF_MAX_BITS) {
+            return false;
+        }
+        if (len[s] > 0) {
+            kraft += 1u << (HUF_MAX_BITS - len[s]);
+        }
+    }
+    if (kraft > (1u << HUF_MAX_BITS)) {
+        return false;
+    }
+
+    uint16_t code[256] = {};
+    huf_codes(len, code);
+
+    // entries of unused codes keep length 0 and are rejected while decoding
+    std::vector<uint16_t> table(1u << HUF_MAX_BITS, 0);
+    for (int s = 0; s < 256; ++s) {
+        if (len[s] == 0) {
+            continue;
+        }
+        for (uint32_t k = code[s]; k < (1u << HUF_MAX_BITS); k += 1u << len[s]) {
+            table[k] = (uint16_t) ((len[s] << 8) | s);
+        }
+    }
+
+    const uint8_t* ip = src + HUF_HEADER_SIZE;
+    const uint8_t* const iend = src + size;
+
+    const uint64_t n_bits_total = (uint64_t) (iend - ip) * 8;
+    uint64_t n_bits_used = 0;
+
+    uint64_t acc = 0;
+    int n_acc = 0;
+
+    for (size_t i = 0; i < dst_size; ++i) {
+        if (n_acc < HUF_MAX_BITS) {
+            if (iend - ip >= 8) {
+                uint64_t next;
+                memcpy(&next, ip, sizeof(next));
+                acc |= next << n_acc;
+                ip += (63 - n_acc) >> 3;
+                n_acc |= 56;
+            } else {
+                while (n_acc <= 56) {
+                    // past the end of the input, the accumulator is padded with zeros
+                    acc |= (uint64_t) (ip < iend ? *ip++ : 0) << n_acc;
+                    n_acc += 8;
+                }
+            }
+        }
+
+        const uint16_t entry = table[acc & ((1u << HUF_MAX_BITS) - 1)];
+        const int l = entry >> 8;
+        if (l == 0) {
+            return false;
+        }
+
+        dst[i] = (uint8_t) entry;
+        acc >>= l;
+        n_acc -= l;
+        n_bits_used += l;
+    }
+
+    return n_bits_used <= n_bits_total;
+}
+
+// segment: u8 mode, [u32 lz size if SEGMENT_LZ and SEGMENT_HUF], u32 payload size, payload
+void encode_segment(const uint8_t* src, size_t size, std::vector<uint8_t>& out) {
+    std::vector<uint8_t> lz;
+    std::vector<uint8_t> huf;
+
+    const uint8_t* cur = src;
+    size_t n_cur = size;
+    uint8_t mode = SEGMENT_RAW;
+
+    if (lz_compress(src, size, lz) > 0) {
+        cur = lz.data();
+        n_cur = lz.size();
+        mode |= SEGMENT_LZ;
+    }
+
+    const uint32_t n_lz = (uint32_t) n_cur;
+
+    if (huf_compress(cur, n_cur, huf) > 0) {
+        cur = huf.data();
+        n_cur = huf.size();
+        mode |= SEGMENT_HUF;
+    }
+
+    const uint32_t n_payload = (uint32_t) n_cur;
+
+    out.push_back(mode);
+    if ((mode & SEGMENT_LZ) && (mode & SEGMENT_HUF)) {
+        out.insert(out.end(), (const uint8_t*) &n_lz, (const uint8_t*) &n_lz + sizeof(n_lz));
+    }
+    out.insert(out.end(), (const uint8_t*) &n_payload, (const uint8_t*) &n_payload + sizeof(n_payload));
+    out.insert(out.end(), cur, cur + n_cur);
+}
+
+bool decode_segment(const uint8_t*& ip, const uint8_t* iend, uint8_t* dst, size_t size) {
+    if (ip >= iend) {
+        return false;
+    }
+    const uint8_t mode = *ip++;
+    if (mode > (SEGMENT_LZ | SEGMENT_HUF)) {
+        return false;
+    }
+
+    uint32_t n_lz = (uint32_t) size;
+    if ((mode & SEGMENT_LZ) && (mode & SEGMENT_HUF)) {
+        if (iend - ip < 4) {
+            return false;
+        }
+        n_lz = read_u32(ip);
+        ip += 4;
+    }
+
+    if (iend - ip < 4) {
+        return false;
+    }
+    const uint32_t n_payload = read_u32(ip);
+    ip += 4;
+    if ((size_t) (iend - ip) < n_payload) {
+        return false;
+    }
+
+    const uint8_t* payload = ip;
+    ip += n_payload;
+
+    switch (mode) {
+        case SEGMENT_RAW:
+            if (n_payload != size) {
+                return false;
+            }
+            memcpy(dst, payload, size);
+            return true;
+        case SEGMENT_LZ:
+            return lz_decompress(payload, n_payload, dst, size);
+        case SEGMENT_HUF:
+            return huf_decompress(payload, n_payload, dst, size);
+        default: {
+            // the LZ output is bounded by the input size, see lz_compress()
+            if (n_lz >= size) {
+                return false;
+            }
+            std::vector<uint8_t> lz(n_lz);
+            return huf_decompress(payload, n_payload, lz.data(), n_lz) && lz_decompress(lz.data(), n_lz, dst, size);
+        }
+    }
+}
+
+// a shuffled block is made of one segment per byte plane, plus the trailing bytes that do not form a whole element
+std::vector<size_t> segment_sizes(size_t size, size_t width) {
+    std::vector<size_t> res(width, size / width);
+    if (size % width) {
+        res.push_back(size % width);
+    }
+    return res;
+}
+
+void parallel_blocks(size_t n_blocks, ThreadPool* pool, const std::function<void(size_t)>& fn) {
+    if (pool == nullptr || n_blocks <= 1) {
+        for (size_t i = 0; i < n_blocks; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    pool->parallel_for(n_blocks, fn);
+}
+
+struct codec_header {
+    uint32_t width;
+    uint64_t raw_size;
+    uint32_t block_size;
+    uint32_t n_blocks;
+};
+
+// checks the fields against each other, so that a corrupt header is rejected before anything is allocated
+bool parse_header(const uint8_t* data, size_t size, codec_header& hdr) {
+    if (size < HEADER_SIZE || read_u32(data) != CODEC_MAGIC) {
+        return false;
+    }
+
+    hdr.width = read_u32(data + 4);
+    memcpy(&hdr.raw_size, data + 8, sizeof(hdr.raw_size));
+    hdr.block_size = read_u32(data + 16);
+    hdr.n_blocks = read_u32(data + 20);
+
+    if (hdr.block_size == 0 || hdr.width == 0 || hdr.width > hdr.block_size) {
+        return false;
+    }
+
+    // no segment packs more than MAX_RATIO bytes into one, this bounds the allocation for the output
+    if (hdr.raw_size / MAX_RATIO > size) {
+        return false;
+    }
+
+    return hdr.n_blocks == (hdr.raw_size + hdr.block_size - 1) / hdr.block_size &&
+           (size - HEADER_SIZE) / sizeof(uint32_t) >= hdr.n_blocks;
+}
+
+} // namespace
+
+std::vector<uint8_t> StateCodec::encode(const uint8_t* data, size_t size, size_t width, ThreadPool* pool, size_t block_size) {
+    block_size = std::max<size_t>(block_size, 64);
+    width = std::min(std::max<size_t>(width, 1), block_size);
+
+    const size_t n_blocks = (size + block_size - 1) / block_size;
+
+    std::vector<std::vector<uint8_t>> blocks(n_blocks);
+
+    parallel_blocks(n_blocks, pool, [&](size_t i) {
+        const uint8_t* src = data + i*block_size;
+        const size_t n = std::min(block_size, size - i*block_size);
+
+        std::vector<uint8_t> shuffled(n);
+        shuffle(src, shuffled.data(), n, width);
+
+        size_t off = 0;
+        for (const size_t n_seg : segment_sizes(n, width)) {
+            encode_segment(shuffled.data() + off, n_seg, blocks[i]);
+            off += n_seg;
+        }
+    });
+
+    size_t total = HEADER_SIZE + n_blocks*sizeof(uint32_t);
+    for (const auto& b : blocks) {
+        total += b.size();
+    }
+
+    std::vector<uint8_t> out(total);
+    uint8_t* p = out.data();
+
+    const auto put = [&](const void* src, size_t n) {
+        memcpy(p, src, n);
+        p += n;
+    };
+
+    const uint32_t magic = CODEC_MAGIC;
+    const uint32_t w = (uint32_t) width;
+    const uint64_t raw_size = size;
+    const uint32_t bs = (uint32_t) block_size;
+    const uint32_t nb = (uint32_t) n_blocks;
+
+    put(&magic, sizeof(magic));
+    put(&w, sizeof(w));
+    put(&raw_size, sizeof(raw_size));
+    put(&bs, sizeof(bs));
+    put(&nb, sizeof(nb));
+    for (const auto& b : blocks) {
+        const uint32_t n_block = (uint32_t) b.size();
+        put(&n_block, sizeof(n_block));
+    }
+    for (const auto& b : blocks) {
+        put(b.data(), b.size());
+    }
+
+    return out;
+}
+
+size_t StateCodec::decoded_size(const uint8_t* data, size_t size) {
+    codec_header hdr;
+    if (!parse_header(data, size, hdr)) {
+        return 0;
+    }
+
+    return hdr.raw_size;
+}
+
+bool StateCodec::decode(const uint8_t* data, size_t size, uint8_t* out, size_t out_size, ThreadPool* pool) {
+    codec_header hdr;
+    if (!parse_header(data, size, hdr) || hdr.raw_size != out_size) {
+        return false;
+    }
+
+    const uint32_t width = hdr.width;
+    const uint64_t raw_size = hdr.raw_size;
+    const uint32_t block_size = hdr.block_size;
+    const uint32_t n_blocks = hdr.n_blocks;
+
+    // offsets of the encoded blocks
+    std::vector<size_t> offsets(n_blocks + 1);
+    offsets[0] = HEADER_SIZE + n_blocks*sizeof(uint32_t);
+    for (uint32_t i = 0; i < n_blocks; ++i) {
+        offsets[i + 1] = offsets[i] + read_u32(data + HEADER_SIZE + i*sizeof(uint32_t));
+        if (offsets[i + 1] > size) {
+            return false;
+        }
+    }
+
+    std::atomic<bool> ok{true};
+
+    parallel_blocks(n_blocks, pool, [&](size_t i) {
+        const uint8_t* ip = data + offsets[i];
+        const uint8_t* iend = data + offsets[i + 1];
+
+        const size_t n = std::min<size_t>(block_size, raw_size - i*(size_t) block_size);
+
+        std::vector<uint8_t> shuffled(n);
+
+        size_t off = 0;
+        for (const size_t n_seg : segment_sizes(n, width)) {
+            if (!decode_segment(ip, iend, shuffled.data() + off, n_seg)) {
+                ok = false;
+                return;
+            }
+            off += n_seg;
+        }
+
+        unshuffle(shuffled.data(), out + i*(size_t) block_size, n, width);
+    });
+
+    return ok;
+}
+
+bool StateCodec::decode(const uint8_t* data, size_t size, std::vector<uint8_t>& out, ThreadPool* pool) {
+    codec_header hdr;
+    if (!parse_header(data, size, hdr)) {
+        return false;
+    }
+
+    out.resize(hdr.raw_size);
+    return decode(data, size, out.data(), out.size(), pool);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class ThreadPool;
+
+// Lossless block codec for serialized sequence states (KV cache data, recurrent states).
+// The input is split into independent blocks, so that both encoding and decoding can run on several threads.
+// Each block is byte-shuffled by the element width, which groups the sign/exponent bytes of f16/f32 values
+// together, and then stored as one segment per byte plane, plus one for the trailing bytes that do not form
+// a whole element. Every segment is coded on its own: LZ is applied if it makes the segment smaller, then
+// HUF if it makes the result smaller, so that the mode is one of
+//   RAW     the bytes as is
+//   LZ      LZ77 with a 64 KiB window: tokens of a 4-bit literal length and a 4-bit match length - 4,
+//           both extended with 255 bytes, then the literals and a u16 offset
+//   HUF     canonical Huffman codes of at most 12 bits, 128 bytes of 4-bit code lengths in front
+//   LZ|HUF  the LZ output coded with HUF
+//
+// layout:  u32 magic, u32 width, u64 raw size, u32 block size, u32 n_blocks,
+//          n_blocks x u32 encoded block size, encoded blocks
+// segment: u8 mode, [u32 LZ size if LZ|HUF], u32 payload size, payload
+class StateCodec {
+public:
+    static constexpr size_t DEFAULT_BLOCK_SIZE = 1024*1024;
+
+    // the blocks are spread over the threads of the pool, or coded on the calling thread if there is none
+    static std::vector<uint8_t> encode(const uint8_t* data, size_t size, size_t width, ThreadPool* pool, size_t block_size = DEFAULT_BLOCK_SIZE);
+
+    // size of the decoded data, 0 if the input is not a valid encoding
+    static size_t decoded_size(const uint8_t* data, size_t size);
+
+    static bool decode(const uint8_t* data, size_t size, uint8_t* out, size_t out_size, ThreadPool* pool);
+
+    static bool decode(const uint8_t* data, size_t size, std::vector<uint8_t>& out, ThreadPool* pool);
+};
@@ -0,0 +1,122 @@
+#include "stop_matcher.h"
+
+#include <deque>
+
+StopMatcher::StopMatcher(const std::vector<std::string>& words) {
+    for (const std::string& w : words) {
+        if (!w.empty()) {
+            m_words.push_back(w);
+        }
+    }
+
+    // bytes that do not appear in any word share the class 0
+    for (const std::string& w : m_words) {
+        for (unsigned char c : w) {
+            if (m_class[c] == 0) {
+                m_class[c] = (uint8_t) m_n_classes++;
+            }
+        }
+    }
+
+    auto add_state = [this](int32_t depth) {
+        m_next.resize(m_next.size() + m_n_classes, -1);
+        m_depth.push_back(depth);
+        m_fail.push_back(0);
+        m_word.push_back(-1);
+        m_dict.push_back(-1);
+        return (int32_t) m_depth.size() - 1;
+    };
+
+    add_state(0);
+
+    // trie
+    for (size_t i = 0; i < m_words.size(); ++i) {
+        int32_t s = 0;
+        for (unsigned char c : m_words[i]) {
+            const size_t k = s*m_n_classes + m_class[c];
+            if (m_next[k] < 0) {
+                const int32_t t = add_state(m_depth[s] + 1);
+                m_next[k] = t;
+            }
+            s = m_next[k];
+        }
+        if (m_word[s] < 0) {
+            m_word[s] = (int32_t) i;
+        }
+    }
+
+    // failure links in breadth-first order, the missing transitions are resolved so that the trie becomes a DFA
+    std::deque<int32_t> queue;
+    for (size_t c = 0; c < m_n_classes; ++c) {
+        int32_t& t = m_next[c];
+        if (t < 0) {
+            t = 0;
+        } else {
+            queue.push_back(t);
+        }
+    }
+
+    while (!queue.empty()) {
+        const int32_t s = queue.front();
+        queue.pop_front();
+
+        const int32_t f = m_fail[s];
+        m_dict[s] = m_word[f] >= 0 ? f : m_dict[f];
+
+        for (size_t c = 0; c < m_n_classes; ++c) {
+            int32_t& t = m_next[s*m_n_classes + c];
+            if (t < 0) {
+                t = m_next[f*m_n_classes + c];
+            } else {
+                m_fail[t] = m_next[f*m_n_classes + c];
+                queue.push_back(t);
+            }
+        }
+    }
+}
+
+void StopMatcher::reset() {
+    m_state = 0;
+    m_consumed = 0;
+    m_last_end = 0;
+}
+
+size_t StopMatcher::feed(const char* data, size_t size, size_t min_pos, size_t* word) {
+    size_t res = std::string::npos;
+    if (m_words.empty()) {
+        m_consumed += size;
+        return res;
+    }
+
+    for (size_t i = 0; i < size; ++i) {
+        m_state = m_next[m_state*m_n_classes + m_class[(unsigned char) data[i]]];
+        ++m_consumed;
+
+        // the words that end here, from the longest
+        for (int32_t s = m_word[m_state] >= 0 ? m_state : m_dict[m_state]; s >= 0; s = m_dict[s]) {
+            m_last_end = m_consumed;
+
+            const size_t pos = m_consumed - m_depth[s];
+            if (pos < min_pos) {
+                continue;
+            }
+            if (res == std::string::npos || pos < res) {
+                res = pos;
+                if (word) {
+                    *word = m_word[s];
+                }
+            }
+            break;
+        }
+    }
+
+    return res;
+}
+
+size_t StopMatcher::partial(size_t min_pos) const {
+    int32_t s = m_state;
+    while (s != 0 && m_consumed - m_depth[s] < min_pos) {
+        s = m_fail[s];
+    }
+    return s == 0 ? std::string::npos : m_consumed - m_depth[s];
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Incremental matcher for a set of stop strings (Aho-Corasick automaton).
+// The words are compiled once into a DFA over byte classes, then the text is fed in pieces as it is generated:
+// each byte costs one table lookup, whatever the number of words, and the text is never rescanned.
+class StopMatcher {
+public:
+    StopMatcher() = default;
+
+    // empty words are ignored
+    explicit StopMatcher(const std::vector<std::string>& words);
+
+    bool empty() const { return m_words.empty(); }
+
+    const std::string& word(size_t i) const { return m_words[i]; }
+
+    // number of bytes fed since the construction or the last reset
+    size_t consumed() const { return m_consumed; }
+
+    // end of the last match of a word, 0 if there was none
+    size_t last_match_end() const { return m_last_end; }
+
+    // forget the text, keep the words
+    void reset();
+
+    // consume the next bytes of the text.
+    // returns the start of the earliest match that ends in these bytes and starts at or after min_pos,
+    // std::string::npos if there is none. The index of the matched word is written to word.
+    size_t feed(const char* data, size_t size, size_t min_pos = 0, size_t* word = nullptr);
+
+    size_t feed(const std::string& text, size_t min_pos = 0, size_t* word = nullptr) {
+        return feed(text.data(), text.size(), min_pos, word);
+    }
+
+    // start of the longest suffix of the consumed text that is a prefix of a word and starts at or after min_pos,
+    // std::string::npos if there is none
+    size_t partial(size_t min_pos = 0) const;
+
+private:
+    std::vector<std::string> m_words;
+
+    uint8_t m_class[256] = {};
+    size_t m_n_classes = 1;
+
+    // per state: transitions by byte class, depth in the trie, failure link,
+    // word ending here (-1 if none) and the nearest state on the failure chain where a word ends (-1 if none)
+    std::vector<int32_t> m_next;
+    std::vector<int32_t> m_depth;
+    std::vector<int32_t> m_fail;
+    std::vector<int32_t> m_word;
+    std::vector<int32_t> m_dict;
+
+    int32_t m_state = 0;
+    size_t m_consumed = 0;
+    size_t m_last_end = 0;
+};
@@ -0,0 +1,96 @@
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int n_threads) {
+    for (int i = 1; i < n_threads; ++i) {
+        m_workers.emplace_back(&ThreadPool::worker, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv_start.notify_all();
+
+    for (auto& t : m_workers) {
+        t.join();
+    }
+}
+
+void ThreadPool::parallel_for(size_t n, const std::function<void(size_t)>& fn) {
+    if (n == 0) {
+        return;
+    }
+
+    if (m_workers.empty() || n == 1) {
+        for (size_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fn = &fn;
+        m_n = n;
+        m_next = 0;
+        m_error = nullptr;
+        m_active = (int) m_workers.size();
+        ++m_generation;
+    }
+    m_cv_start.notify_all();
+
+    run();
+
+    std::exception_ptr error;
+    {
+        // the workers that wake up late find no work left, but the loop must not return before they are done with fn
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv_done.wait(lock, [this] { return m_active == 0; });
+        m_fn = nullptr;
+        error = m_error;
+        m_error = nullptr;
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::worker() {
+    uint64_t generation = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv_start.wait(lock, [&] { return m_stop || m_generation != generation; });
+            if (m_stop) {
+                return;
+            }
+            generation = m_generation;
+        }
+
+        run();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_active == 0) {
+                m_cv_done.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::run() {
+    for (size_t i = m_next.fetch_add(1); i < m_n; i = m_next.fetch_add(1)) {
+        try {
+            (*m_fn)(i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error) {
+                m_error = std::current_exception();
+            }
+        }
+    }
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads that share the iterations of a loop. The calling thread takes part in the work,
+// so a pool of n threads starts n - 1 workers and a pool of 1 runs the loop inline.
+class ThreadPool {
+public:
+    explicit ThreadPool(int n_threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return (int) m_workers.size() + 1; }
+
+    // run fn(i) for every i in [0, n) and return when all are done.
+    // the iterations run in any order on any thread, the first exception thrown by fn is rethrown here
+    void parallel_for(size_t n, const std::function<void(size_t)>& fn);
+
+private:
+    void worker();
+
+    void run();
+
+    std::vector<std::thread> m_workers;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv_start;
+    std::condition_variable m_cv_done;
+
+    const std::function<void(size_t)>* m_fn = nullptr;
+    size_t m_n = 0;
+    std::atomic<size_t> m_next{0};
+
+    uint64_t m_generation = 0;
+    int m_active = 0;
+    bool m_stop = false;
+
+    std::exception_ptr m_error;
+};
@@ -0,0 +1,46 @@
+#include "token_pieces.h"
+
+#include <cstring>
+
+namespace {
+
+size_t token_to_piece(const llama_vocab* vocab, llama_token token, bool special, std::vector<char>& buf) {
+    int32_t n = llama_token_to_piece(vocab, token, buf.data(), (int32_t) buf.size(), 0, special);
+    if (n < 0) {
+        buf.resize(-n);
+        n = llama_token_to_piece(vocab, token, buf.data(), (int32_t) buf.size(), 0, special);
+    }
+    return n < 0 ? 0 : (size_t) n;
+}
+
+}
+
+void TokenPieces::build(const llama_vocab* vocab) {
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    m_data.clear();
+    m_entries.clear();
+    m_entries.reserve(2*(size_t) n_vocab);
+
+    std::vector<char> plain(64);
+    std::vector<char> special(64);
+
+    for (llama_token token = 0; token < n_vocab; ++token) {
+        const size_t n_plain   = token_to_piece(vocab, token, false, plain);
+        const size_t n_special = token_to_piece(vocab, token, true, special);
+
+        const Entry e_plain = { (uint32_t) m_data.size(), (uint32_t) n_plain };
+        m_data.insert(m_data.end(), plain.data(), plain.data() + n_plain);
+
+        Entry e_special = e_plain;
+        if (n_special != n_plain || memcmp(plain.data(), special.data(), n_plain) != 0) {
+            e_special = { (uint32_t) m_data.size(), (uint32_t) n_special };
+            m_data.insert(m_data.end(), special.data(), special.data() + n_special);
+        }
+
+        m_entries.push_back(e_plain);
+        m_entries.push_back(e_special);
+    }
+
+    m_data.shrink_to_fit();
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "llama.h"
+
+// Text of every token of a vocab, detokenized once when the model is loaded.
+// Lookups return views into the table, so that the generation loop does not build a string per token.
+// The pieces are stored with and without the rendering of special tokens, the two variants share
+// the bytes when they are the same (all the normal tokens).
+class TokenPieces {
+public:
+    TokenPieces() = default;
+
+    void build(const llama_vocab* vocab);
+
+    bool empty() const { return m_entries.empty(); }
+
+    // same text as common_token_to_piece(ctx, token, special)
+    std::string_view piece(llama_token token, bool special = true) const {
+        const Entry& e = m_entries[2*token + (special ? 1 : 0)];
+        return std::string_view(m_data.data() + e.offset, e.size);
+    }
+
+    void append(std::string& out, llama_token token, bool special = true) const {
+        out.append(piece(token, special));
+    }
+
+private:
+    struct Entry {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    std::vector<char> m_data;
+    std::vector<Entry> m_entries;
+};
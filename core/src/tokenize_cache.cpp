@@ -0,0 +1,98 @@
+#include "tokenize_cache.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "common.h"
+
+std::vector<llama_token> TokenizeCache::tokenize(const llama_vocab* vocab, const std::string& text) {
+    // the tokens added at the end of the prompt would end up in the middle of the reused ones
+    if (text.size() < min_text_size || llama_vocab_get_add_eos(vocab) || llama_vocab_get_add_sep(vocab)) {
+        return common_tokenize(vocab, text, true, true);
+    }
+
+    std::vector<llama_token> tokens;
+    size_t n_reused_text = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto best = m_entries.end();
+        size_t best_index = 0;
+        for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+            if (it->vocab != vocab) {
+                continue;
+            }
+
+            const size_t n = std::min(it->text.size(), text.size());
+            const size_t n_common = std::mismatch(text.begin(), text.begin() + n, it->text.begin()).first - text.begin();
+
+            // last special token that is whole in the common part, the pieces before it are tokenized the same way
+            for (auto s = it->specials.rbegin(); s != it->specials.rend(); ++s) {
+                if (s->end <= n_common) {
+                    if (s->begin > n_reused_text) {
+                        n_reused_text = s->begin;
+                        best_index = s->index;
+                        best = it;
+                    }
+                    break;
+                }
+            }
+        }
+
+        if (best != m_entries.end()) {
+            tokens.assign(best->tokens.begin(), best->tokens.begin() + best_index);
+            m_entries.splice(m_entries.begin(), m_entries, best);
+        }
+    }
+
+    if (n_reused_text > 0) {
+        const auto suffix = common_tokenize(vocab, text.substr(n_reused_text), false, true);
+        tokens.insert(tokens.end(), suffix.begin(), suffix.end());
+    } else {
+        tokens = common_tokenize(vocab, text, true, true);
+    }
+
+    Entry entry = { vocab, text, tokens, find_specials(vocab, text, tokens) };
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.push_front(std::move(entry));
+    while (m_entries.size() > m_n_max) {
+        m_entries.pop_back();
+    }
+
+    return tokens;
+}
+
+void TokenizeCache::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+}
+
+std::vector<TokenizeCache::Special> TokenizeCache::find_specials(const llama_vocab* vocab, const std::string& text,
+                                                                 const std::vector<llama_token>& tokens) {
+    std::vector<Special> specials;
+
+    size_t pos = 0;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        // the BOS added by the tokenizer is not in the text
+        if (i == 0 && llama_vocab_get_add_bos(vocab) && tokens[0] == llama_vocab_bos(vocab)) {
+            continue;
+        }
+
+        if (!(llama_vocab_get_attr(vocab, tokens[i]) & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_USER_DEFINED))) {
+            continue;
+        }
+
+        // the special tokens are matched on their raw text
+        const char* token_text = llama_vocab_get_text(vocab, tokens[i]);
+        const size_t begin = text.find(token_text, pos);
+        if (begin == std::string::npos) {
+            break;
+        }
+
+        pos = begin + strlen(token_text);
+        specials.push_back({ begin, pos, i });
+    }
+
+    return specials;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+// Tokens of the recent prompts, so that a prompt that extends one of them (the next turn of a chat,
+// a long system prompt shared by the requests) only tokenizes its new text.
+// The tokenizer splits the text at the special tokens first and tokenizes the pieces in between on
+// their own, so the tokens before a special token that both prompts have at the same place are the
+// tokens of the new prompt too. The prompts are tokenized with add_special and parse_special.
+class TokenizeCache {
+public:
+    explicit TokenizeCache(size_t n_max = 32) : m_n_max(n_max) {}
+
+    std::vector<llama_token> tokenize(const llama_vocab* vocab, const std::string& text);
+
+    void clear();
+
+private:
+    struct Special {
+        size_t begin;   // position of the token text in the prompt
+        size_t end;
+        size_t index;   // position of the token in the tokens
+    };
+
+    struct Entry {
+        const llama_vocab* vocab;
+        std::string text;
+        std::vector<llama_token> tokens;
+        std::vector<Special> specials;
+    };
+
+    static std::vector<Special> find_specials(const llama_vocab* vocab, const std::string& text,
+                                              const std::vector<llama_token>& tokens);
+
+    // shorter prompts are not worth the lookup
+    static constexpr size_t min_text_size = 1024;
+
+    const size_t m_n_max;
+
+    std::mutex m_mutex;
+    std::list<Entry> m_entries;
+};
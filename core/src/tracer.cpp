@@ -0,0 +1,102 @@
+#include "tracer.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+
+void Tracer::enable(size_t capacity) {
+    size_t n = 1;
+    while (n < capacity) {
+        n *= 2;
+    }
+
+    m_entries.reset(new Entry[n]);
+    m_head = 0;
+    m_mask = n - 1;
+}
+
+int64_t Tracer::now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int32_t Tracer::thread_index() {
+    static std::atomic<int32_t> n_threads{0};
+    thread_local const int32_t index = n_threads.fetch_add(1);
+    return index;
+}
+
+void Tracer::record(uint64_t trace_id, const char* name, int64_t t_start_us, int64_t t_end_us, int32_t id_slot) {
+    if (m_mask == 0) {
+        return;
+    }
+
+    const uint64_t i = m_head.fetch_add(1, std::memory_order_relaxed);
+
+    Entry& e = m_entries[i & m_mask];
+
+    e.seq.store(2*i + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    e.trace_id.store(trace_id, std::memory_order_relaxed);
+    e.name.store(name, std::memory_order_relaxed);
+    e.t_start.store(t_start_us, std::memory_order_relaxed);
+    e.t_end.store(t_end_us, std::memory_order_relaxed);
+    e.tid.store(thread_index(), std::memory_order_relaxed);
+    e.id_slot.store(id_slot, std::memory_order_relaxed);
+
+    e.seq.store(2*i + 2, std::memory_order_release);
+}
+
+std::string Tracer::dump(uint64_t trace_id) const {
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+    if (m_mask != 0) {
+        const uint64_t head  = m_head.load(std::memory_order_acquire);
+        const uint64_t first = head > m_mask + 1 ? head - (m_mask + 1) : 0;
+
+        char buf[256];
+        bool first_event = true;
+
+        for (uint64_t i = first; i < head; ++i) {
+            const Entry& e = m_entries[i & m_mask];
+
+            const uint64_t seq = e.seq.load(std::memory_order_acquire);
+
+            const uint64_t cur_trace_id = e.trace_id.load(std::memory_order_relaxed);
+            const char*    name         = e.name.load(std::memory_order_relaxed);
+            const int64_t  t_start      = e.t_start.load(std::memory_order_relaxed);
+            const int64_t  t_end        = e.t_end.load(std::memory_order_relaxed);
+            const int32_t  tid          = e.tid.load(std::memory_order_relaxed);
+            const int32_t  id_slot      = e.id_slot.load(std::memory_order_relaxed);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // still being written, or overwritten by a newer span
+            if (seq != 2*i + 2 || e.seq.load(std::memory_order_relaxed) != seq) {
+                continue;
+            }
+
+            if (trace_id != 0 && cur_trace_id != trace_id) {
+                continue;
+            }
+
+            snprintf(buf, sizeof(buf),
+                     "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64 ",\"pid\":%" PRIu64 ",\"tid\":%d",
+                     first_event ? "" : ",", name, t_start, t_end - t_start, cur_trace_id, tid);
+            out += buf;
+
+            if (id_slot >= 0) {
+                snprintf(buf, sizeof(buf), ",\"args\":{\"id_slot\":%d}", id_slot);
+                out += buf;
+            }
+
+            out += "}";
+
+            first_event = false;
+        }
+    }
+
+    out += "]}";
+
+    return out;
+}
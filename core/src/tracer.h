@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "singleton.h"
+
+// Spans of the phases of the requests (parsing, tokenization, queue wait, prefill, sampling, ...) recorded in a
+// ring buffer, and dumped in the Chrome trace event format (chrome://tracing, Perfetto).
+// Tracing is off unless enabled: record() is then a single check. When on, a span is written with a few relaxed
+// atomic stores and the oldest spans are overwritten once the buffer is full.
+// The spans of a request share its trace id, the dump shows each trace id as a process.
+class Tracer : public patterns::Singleton<Tracer> {
+    friend class patterns::Singleton<Tracer>;
+
+public:
+    // capacity in spans, rounded up to a power of two. must be called before the spans are recorded
+    void enable(size_t capacity);
+
+    bool enabled() const { return m_mask != 0; }
+
+    // number of spans kept, 0 if tracing is off
+    size_t capacity() const { return m_mask == 0 ? 0 : m_mask + 1; }
+
+    static int64_t now_us();
+
+    // name must have static storage, only the pointer is kept. id_slot is -1 for the spans outside of the slots
+    void record(uint64_t trace_id, const char* name, int64_t t_start_us, int64_t t_end_us, int32_t id_slot = -1);
+
+    // trace_id 0: all the spans in the buffer
+    std::string dump(uint64_t trace_id = 0) const;
+
+    // records the span from its construction to its destruction
+    class Span {
+    public:
+        Span(uint64_t trace_id, const char* name, int32_t id_slot = -1)
+            : m_trace_id(trace_id), m_name(name), m_id_slot(id_slot), m_t_start(Tracer::instance().enabled() ? now_us() : -1) {}
+
+        ~Span() {
+            if (m_t_start >= 0) {
+                Tracer::instance().record(m_trace_id, m_name, m_t_start, now_us(), m_id_slot);
+            }
+        }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        uint64_t m_trace_id;
+        const char* m_name;
+        int32_t m_id_slot;
+        int64_t m_t_start;
+    };
+
+private:
+    Tracer() = default;
+
+    // a writer marks the entry odd while it writes it, the dump skips the entries that are odd or change meanwhile
+    struct Entry {
+        std::atomic<uint64_t> seq{0};
+        std::atomic<uint64_t> trace_id{0};
+        std::atomic<const char*> name{nullptr};
+        std::atomic<int64_t> t_start{0};
+        std::atomic<int64_t> t_end{0};
+        std::atomic<int32_t> tid{0};
+        std::atomic<int32_t> id_slot{-1};
+    };
+
+    static int32_t thread_index();
+
+    std::unique_ptr<Entry[]> m_entries;
+    size_t m_mask = 0;
+
+    std::atomic<uint64_t> m_head{0};
+};
@@ -8,6 +8,8 @@
 #include "mtmd.h"
 #include "mtmd-helper.h"
 #include "chat.h"
+#include "json-schema-to-grammar.h"
+#include "tokenize_cache.h"
 
 #define JSON_ASSERT GGML_ASSERT
 #include <nlohmann/json.hpp>
@@ -18,6 +20,13 @@
 #include <vector>
 #include <memory>
 #include <cinttypes>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <cerrno>
+#include <cstdlib>
+#include <list>
+#include <mutex>
 
 #define DEFAULT_OAICOMPAT_MODEL "gpt-3.5-turbo"
 
@@ -150,6 +159,12 @@ static json json_get_nested_values(const std::vector<std::string> & paths, const
     return result;
 }
 
+// tokens of the recent prompts, shared by the request threads
+inline TokenizeCache & prompt_tokenize_cache() {
+    static TokenizeCache cache;
+    return cache;
+}
+
 /**
  * this handles 2 cases:
  * - only string, example: "string"
@@ -185,7 +200,12 @@ static llama_tokens tokenize_mixed(const llama_vocab * vocab, const json & json_
         }
     } else {
         auto s = json_prompt.template get<std::string>();
-        prompt_tokens = common_tokenize(vocab, s, add_special, parse_special);
+        if (add_special && parse_special) {
+            // chat prompts repeat the whole history, only the new turn is tokenized
+            prompt_tokens = prompt_tokenize_cache().tokenize(vocab, s);
+        } else {
+            prompt_tokens = common_tokenize(vocab, s, add_special, parse_special);
+        }
     }
 
     return prompt_tokens;
@@ -221,6 +241,41 @@ static size_t validate_utf8(const std::string& text) {
     return len;
 }
 
+// incremental version of validate_utf8 for a text that only grows at the end:
+// tracks the number of continuation bytes still expected by the last character
+struct utf8_tail {
+    int n_pending = 0;
+
+    void append(const char * data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            const unsigned char c = data[i];
+            if ((c & 0xC0) == 0x80) {
+                // continuation byte: 10xxxxxx
+                if (n_pending > 0) {
+                    n_pending--;
+                }
+            } else if ((c & 0xE0) == 0xC0) {
+                n_pending = 1;
+            } else if ((c & 0xF0) == 0xE0) {
+                n_pending = 2;
+            } else if ((c & 0xF8) == 0xF0) {
+                n_pending = 3;
+            } else {
+                n_pending = 0;
+            }
+        }
+    }
+
+    void append(const std::string & text) {
+        append(text.data(), text.size());
+    }
+
+    // the text ends in the middle of a multi-byte character
+    bool incomplete() const {
+        return n_pending > 0;
+    }
+};
+
 //
 // template utils
 //
@@ -393,6 +448,30 @@ static inline raw_buffer base64_decode(const std::string & encoded_string) {
     return ret;
 }
 
+//
+// server settings
+//
+
+// integer setting of the server from the environment (see ServerEnv in config/config.go). an unset or empty
+// variable keeps the default, a value that is not an integer in [min, max] is an error
+static bool server_env_int(const char * name, int64_t min, int64_t max, int64_t & value) {
+    const char * str = getenv(name);
+    if (str == nullptr || str[0] == '\0') {
+        return true;
+    }
+
+    char * end = nullptr;
+    errno = 0;
+    const long long res = std::strtoll(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || res < min || res > max) {
+        LOG_ERR("invalid value '%s' for %s, expected an integer in [%" PRId64 ", %" PRId64 "]\n", str, name, min, max);
+        return false;
+    }
+
+    value = res;
+    return true;
+}
+
 //
 // random string / id
 //
@@ -455,6 +534,42 @@ static std::string tokens_to_output_formatted_string(const llama_context * ctx,
 // OAI utils
 //
 
+// json_schema_to_grammar() with a small LRU cache keyed by the serialized schema,
+// structured-output traffic keeps sending the same few schemas
+static std::string json_schema_to_grammar_cached(const json & schema) {
+    static std::mutex mutex;
+    static std::list<std::pair<std::string, std::string>> entries;
+    static std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> index;
+
+    constexpr size_t n_max = 64;
+
+    std::string key = schema.dump();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->second;
+        }
+    }
+
+    std::string grammar = json_schema_to_grammar(schema);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index.find(key) == index.end()) {
+            entries.emplace_front(key, grammar);
+            index.emplace(std::move(key), entries.begin());
+
+            if (entries.size() > n_max) {
+                index.erase(entries.back().first);
+                entries.pop_back();
+            }
+        }
+    }
+
+    return grammar;
+}
+
 // used by /completions endpoint
 static json oaicompat_completion_params_parse(const json & body) {
     json llama_params;
@@ -470,11 +585,12 @@ static json oaicompat_completion_params_parse(const json & body) {
         llama_params["stop"] = json_value(body, "stop", json::array());
     }
 
-    // Handle "n" field
+    // Handle "n" field, the choices are generated by forking the evaluated prompt (see handle_completions_impl)
     int n_choices = json_value(body, "n", 1);
-    if (n_choices != 1) {
-        throw std::runtime_error("Only one completion choice is allowed");
+    if (n_choices < 1) {
+        throw std::runtime_error("n must be at least 1");
     }
+    llama_params["n_cmpl"] = n_choices;
 
     // Handle "echo" field
     if (json_value(body, "echo", false)) {
@@ -664,6 +780,13 @@ static json oaicompat_chat_params_parse(
         }
     }
 
+    // without jinja the template only converts the schema to a grammar, the cached conversion is used instead.
+    // the jinja formats build their grammar around the schema (tool calls, reasoning), they still convert it
+    if (!opt.use_jinja && !json_schema.is_null()) {
+        grammar     = json_schema_to_grammar_cached(json_schema);
+        json_schema = json();
+    }
+
     common_chat_templates_inputs inputs;
     inputs.messages              = common_chat_msgs_parse_oaicompat(messages);
     inputs.tools                 = common_chat_tools_parse_oaicompat(tools);
@@ -754,11 +877,12 @@ static json oaicompat_chat_params_parse(
         llama_params["stop"].push_back(stop);
     }
 
-    // Handle "n" field
+    // Handle "n" field, the choices are generated by forking the evaluated prompt (see handle_completions_impl)
     int n_choices = json_value(body, "n", 1);
-    if (n_choices != 1) {
-        throw std::runtime_error("Only one completion choice is allowed");
+    if (n_choices < 1) {
+        throw std::runtime_error("n must be at least 1");
     }
+    llama_params["n_cmpl"] = n_choices;
 
     // Handle "logprobs" field
     // TODO: The response format of this option is not yet OAI-compatible, but seems like no one really using it; We may need to fix it in the future
@@ -931,38 +1055,202 @@ static std::string safe_json_to_str(const json & data) {
     return data.dump(-1, ' ', false, json::error_handler_t::replace);
 }
 
-static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx) {
-    std::vector<llama_token_data> cur;
-    const auto * logits = llama_get_logits_ith(ctx, idx);
+// probability of the token tok and the n most likely tokens, without sorting or normalizing the whole vocab:
+// one pass finds the max logit and keeps the top n in a min-heap, one pass sums the exponentials.
+// top is a scratch buffer reused between calls, on return it holds the top tokens by decreasing probability
+static float get_token_probabilities(const float * logits, int n_vocab, llama_token tok, size_t n, std::vector<llama_token_data> & top) {
+    n = std::min(n, (size_t) n_vocab);
 
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
+    const auto cmp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
 
-    const int n_vocab = llama_vocab_n_tokens(vocab);
+    top.clear();
+    top.reserve(n);
 
-    cur.resize(n_vocab);
+    float max_l = -INFINITY;
     for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        const float l = logits[token_id];
+        max_l = std::max(max_l, l);
+
+        if (top.size() < n) {
+            top.push_back({token_id, l, 0.0f});
+            std::push_heap(top.begin(), top.end(), cmp);
+        } else if (n > 0 && l > top.front().logit) {
+            std::pop_heap(top.begin(), top.end(), cmp);
+            top.back() = {token_id, l, 0.0f};
+            std::push_heap(top.begin(), top.end(), cmp);
+        }
     }
 
-    // sort tokens by logits
-    std::sort(cur.begin(), cur.end(), [](const llama_token_data & a, const llama_token_data & b) {
-        return a.logit > b.logit;
-    });
-
-    // apply softmax
-    float max_l = cur[0].logit;
+    // independent partial sums, so that the loop can be vectorized
+    constexpr int n_acc = 8;
+    float acc[n_acc] = {};
+    int i = 0;
+    for (; i + n_acc <= n_vocab; i += n_acc) {
+        for (int j = 0; j < n_acc; j++) {
+            acc[j] += expf(logits[i + j] - max_l);
+        }
+    }
     float cum_sum = 0.0f;
-    for (size_t i = 0; i < cur.size(); ++i) {
-        float p = expf(cur[i].logit - max_l);
-        cur[i].p = p;
-        cum_sum += p;
+    for (; i < n_vocab; i++) {
+        cum_sum += expf(logits[i] - max_l);
+    }
+    for (int j = 0; j < n_acc; j++) {
+        cum_sum += acc[j];
+    }
+
+    std::sort_heap(top.begin(), top.end(), cmp);
+    for (auto & cur : top) {
+        cur.p = expf(cur.logit - max_l) / cum_sum;
+    }
+
+    return expf(logits[tok] - max_l) / cum_sum;
+}
+
+// sampler configurations that do not need the full common_sampler chain
+enum fast_sampler_type {
+    FAST_SAMPLER_NONE,
+    FAST_SAMPLER_GREEDY, // the token with the highest logit
+    FAST_SAMPLER_TOP_K,  // top-k followed by temperature
+};
+
+static const char * fast_sampler_type_name(fast_sampler_type type) {
+    switch (type) {
+        case FAST_SAMPLER_GREEDY: return "greedy";
+        case FAST_SAMPLER_TOP_K:  return "top_k";
+        default:                  return "none";
+    }
+}
+
+// the fast path applies only when every other stage of the chain would leave the logits unchanged
+static fast_sampler_type fast_sampler_select(const common_params_sampling & sp) {
+    const bool has_temp  = std::find(sp.samplers.begin(), sp.samplers.end(), COMMON_SAMPLER_TYPE_TEMPERATURE) != sp.samplers.end();
+    const bool has_top_k = std::find(sp.samplers.begin(), sp.samplers.end(), COMMON_SAMPLER_TYPE_TOP_K)       != sp.samplers.end();
+    const bool has_infill = std::find(sp.samplers.begin(), sp.samplers.end(), COMMON_SAMPLER_TYPE_INFILL)     != sp.samplers.end();
+
+    const bool neutral =
+        has_temp && !has_infill &&
+        sp.mirostat == 0 &&
+        sp.grammar.empty() &&
+        sp.logit_bias.empty() &&
+        (sp.penalty_last_n == 0 || (sp.penalty_repeat == 1.0f && sp.penalty_freq == 0.0f && sp.penalty_present == 0.0f)) &&
+        sp.dry_multiplier == 0.0f &&
+        sp.xtc_probability <= 0.0f &&
+        sp.typ_p >= 1.0f &&
+        sp.dynatemp_range <= 0.0f;
+
+    if (!neutral) {
+        return FAST_SAMPLER_NONE;
+    }
+
+    // top-k, top-p, min-p and top-n-sigma always keep the most likely token
+    if (sp.temp <= 0.0f) {
+        return FAST_SAMPLER_GREEDY;
     }
-    for (size_t i = 0; i < cur.size(); ++i) {
-        cur[i].p /= cum_sum;
+
+    if (has_top_k && sp.top_k > 0 && sp.top_p >= 1.0f && sp.min_p <= 0.0f && sp.top_n_sigma < 0.0f) {
+        return FAST_SAMPLER_TOP_K;
+    }
+
+    return FAST_SAMPLER_NONE;
+}
+
+template <fast_sampler_type type>
+static llama_token fast_sampler_sample(const float * logits, int n_vocab, const common_params_sampling & sp, std::mt19937 & rng, std::vector<llama_token_data> & top) {
+    if constexpr (type == FAST_SAMPLER_GREEDY) {
+        GGML_UNUSED(sp);
+        GGML_UNUSED(rng);
+        GGML_UNUSED(top);
+
+        // argmax with independent lanes, so that the loop can be vectorized; ties go to the lowest id
+        constexpr int n_lanes = 8;
+
+        float   best_l[n_lanes];
+        int32_t best_i[n_lanes];
+        for (int j = 0; j < n_lanes; j++) {
+            best_l[j] = -INFINITY;
+            best_i[j] = 0;
+        }
+
+        int i = 0;
+        for (; i + n_lanes <= n_vocab; i += n_lanes) {
+            for (int j = 0; j < n_lanes; j++) {
+                const bool gt = logits[i + j] > best_l[j];
+                best_l[j] = gt ? logits[i + j] : best_l[j];
+                best_i[j] = gt ? i + j         : best_i[j];
+            }
+        }
+
+        float   res_l = -INFINITY;
+        int32_t res_i = 0;
+        for (int j = 0; j < n_lanes; j++) {
+            if (best_l[j] > res_l || (best_l[j] == res_l && best_i[j] < res_i)) {
+                res_l = best_l[j];
+                res_i = best_i[j];
+            }
+        }
+        for (; i < n_vocab; i++) {
+            if (logits[i] > res_l) {
+                res_l = logits[i];
+                res_i = i;
+            }
+        }
+
+        return res_i;
+    } else {
+        static_assert(type == FAST_SAMPLER_TOP_K, "unknown fast sampler");
+
+        const size_t k = std::min((size_t) sp.top_k, (size_t) n_vocab);
+
+        const auto cmp = [](const llama_token_data & a, const llama_token_data & b) {
+            return a.logit > b.logit;
+        };
+
+        // the k highest logits in a min-heap
+        top.clear();
+        top.reserve(k);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            const float l = logits[token_id];
+            if (top.size() < k) {
+                top.push_back({token_id, l, 0.0f});
+                std::push_heap(top.begin(), top.end(), cmp);
+            } else if (l > top.front().logit) {
+                std::pop_heap(top.begin(), top.end(), cmp);
+                top.back() = {token_id, l, 0.0f};
+                std::push_heap(top.begin(), top.end(), cmp);
+            }
+        }
+
+        // softmax with temperature over the k tokens only
+        std::sort_heap(top.begin(), top.end(), cmp);
+
+        const float max_l = top[0].logit;
+        float cum_sum = 0.0f;
+        for (auto & cur : top) {
+            cur.p = expf((cur.logit - max_l) / sp.temp);
+            cum_sum += cur.p;
+        }
+
+        std::uniform_real_distribution<float> dist(0.0f, cum_sum);
+        float r = dist(rng);
+        for (const auto & cur : top) {
+            r -= cur.p;
+            if (r <= 0.0f) {
+                return cur.id;
+            }
+        }
+
+        return top.back().id;
     }
+}
 
-    return cur;
+static llama_token fast_sampler_sample(fast_sampler_type type, const float * logits, int n_vocab, const common_params_sampling & sp, std::mt19937 & rng, std::vector<llama_token_data> & top) {
+    switch (type) {
+        case FAST_SAMPLER_GREEDY: return fast_sampler_sample<FAST_SAMPLER_GREEDY>(logits, n_vocab, sp, rng, top);
+        case FAST_SAMPLER_TOP_K:  return fast_sampler_sample<FAST_SAMPLER_TOP_K> (logits, n_vocab, sp, rng, top);
+        default:                  GGML_ABORT("no fast sampler");
+    }
 }
 
 static bool are_lora_equal(
@@ -1237,6 +1525,13 @@ public:
         tokens.resize(n);
     }
 
+    // remove n tokens starting at pos, in place (used by the context shift)
+    void erase(size_t pos, size_t n) {
+        GGML_ASSERT(!has_mtmd); // TODO: support mtmd
+        GGML_ASSERT(pos + n <= tokens.size());
+        tokens.erase(tokens.begin() + pos, tokens.begin() + pos + n);
+    }
+
     std::string detokenize(const llama_context * ctx, bool special) const {
         llama_tokens text_tokens;
         text_tokens.reserve(tokens.size());
@@ -1353,6 +1648,259 @@ public:
     }
 };
 
+/**
+ * server_prefix_tree is a token radix tree over the sequences held by a set of owners (slots, cached prompts).
+ * each owner contributes a single sequence. lookups are O(n_tokens) in the length of the query, independent
+ * of the number of owners, and every node knows which owners share the prefix leading to it. inserting or removing
+ * an owner touches only the nodes on the path of its sequence.
+ */
+struct server_prefix_tree {
+    struct node {
+        node * parent = nullptr;
+
+        // tokens on the edge leading to this node (never empty, except for the root)
+        llama_tokens edge;
+
+        // number of tokens from the root to the end of this node
+        size_t depth = 0;
+
+        // keyed by the first token of the child's edge
+        std::unordered_map<llama_token, std::unique_ptr<node>> children;
+
+        // owners whose sequence passes through or ends at this node (not tracked for the root, which they all share)
+        std::unordered_set<int32_t> owners;
+
+        // owners whose sequence ends exactly at this node
+        std::unordered_set<int32_t> owners_end;
+    };
+
+    struct match {
+        int32_t id;
+        size_t  n_common; // length of the common prefix between the owner's sequence and the query
+    };
+
+    server_prefix_tree() = default;
+
+    server_prefix_tree(const server_prefix_tree &) = delete;
+    server_prefix_tree & operator=(const server_prefix_tree &) = delete;
+
+    // replace the sequence of the owner (an empty sequence removes the owner)
+    void insert(int32_t id, const llama_tokens & tokens) {
+        remove(id);
+
+        if (tokens.empty()) {
+            return;
+        }
+
+        node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                auto child = std::make_unique<node>();
+                child->parent = cur;
+                child->edge.assign(tokens.begin() + i, tokens.end());
+                child->depth  = cur->depth + child->edge.size();
+                child->owners.insert(id);
+
+                node * next = child.get();
+                cur->children.emplace(tokens[i], std::move(child));
+
+                cur = next;
+                i   = tokens.size();
+                break;
+            }
+
+            node * child = it->second.get();
+
+            const size_t k = common_length(child->edge, tokens, i);
+            if (k < child->edge.size()) {
+                // split the edge at the first mismatching token
+                auto mid = std::make_unique<node>();
+                mid->parent = cur;
+                mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+                mid->depth  = cur->depth + k;
+                mid->owners = child->owners;
+
+                std::unique_ptr<node> tail = std::move(it->second);
+                tail->edge.erase(tail->edge.begin(), tail->edge.begin() + k);
+                tail->parent = mid.get();
+                mid->children.emplace(tail->edge[0], std::move(tail));
+
+                child = mid.get();
+                it->second = std::move(mid);
+            }
+
+            child->owners.insert(id);
+
+            cur = child;
+            i  += k;
+        }
+
+        cur->owners_end.insert(id);
+        ends[id] = cur;
+    }
+
+    void remove(int32_t id) {
+        auto it = ends.find(id);
+        if (it == ends.end()) {
+            return;
+        }
+
+        node * cur = it->second;
+        ends.erase(it);
+
+        cur->owners_end.erase(id);
+
+        while (cur != &root) {
+            node * parent = cur->parent;
+
+            cur->owners.erase(id);
+
+            if (cur->owners.empty()) {
+                // no sequence passes through this node anymore - drop it together with its (empty) subtree
+                parent->children.erase(cur->edge[0]);
+            } else if (cur->owners_end.empty() && cur->children.size() == 1) {
+                // keep the tree compressed - merge the node with its only child
+                std::unique_ptr<node> child = std::move(cur->children.begin()->second);
+                child->edge.insert(child->edge.begin(), cur->edge.begin(), cur->edge.end());
+                child->parent = parent;
+
+                const llama_token key = child->edge[0];
+                parent->children[key] = std::move(child);
+            }
+
+            cur = parent;
+        }
+    }
+
+    void clear() {
+        root.children.clear();
+        ends.clear();
+    }
+
+    // for every owner that shares at least one token with the query, return the length of the common prefix
+    // optionally, collect the owners whose whole sequence is a prefix of the query
+    std::vector<match> find(const llama_tokens & tokens, std::vector<int32_t> * prefix_ids = nullptr) const {
+        // deepest position reached inside each visited node
+        std::vector<std::pair<const node *, size_t>> path;
+
+        walk(tokens, [&](const node * cur, size_t n_common, bool full) {
+            path.emplace_back(cur, n_common);
+
+            if (full && prefix_ids) {
+                prefix_ids->insert(prefix_ids->end(), cur->owners_end.begin(), cur->owners_end.end());
+            }
+        });
+
+        std::vector<match> res;
+
+        // owners of deeper nodes are a subset of the owners of their ancestors
+        std::unordered_set<int32_t> seen;
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            for (const int32_t id : it->first->owners) {
+                if (seen.insert(id).second) {
+                    res.push_back({ id, it->second });
+                }
+            }
+        }
+
+        return res;
+    }
+
+    // owners whose whole sequence is a prefix of the query
+    std::vector<int32_t> find_prefixes(const llama_tokens & tokens) const {
+        std::vector<int32_t> res;
+
+        walk(tokens, [&](const node * cur, size_t /*n_common*/, bool full) {
+            if (full) {
+                res.insert(res.end(), cur->owners_end.begin(), cur->owners_end.end());
+            }
+        });
+
+        return res;
+    }
+
+    // length of the longest prefix of the query that is held by at least one owner
+    size_t n_common_max(const llama_tokens & tokens) const {
+        return walk(tokens, [](const node *, size_t, bool) {});
+    }
+
+    // number of leading tokens of the owner's sequence that are also held by at least one other owner
+    size_t n_shared(int32_t id) const {
+        auto it = ends.find(id);
+        if (it == ends.end()) {
+            return 0;
+        }
+
+        for (const node * cur = it->second; cur != &root; cur = cur->parent) {
+            if (cur->owners.size() > 1) {
+                return cur->depth;
+            }
+        }
+
+        return 0;
+    }
+
+    bool contains(int32_t id) const {
+        return ends.find(id) != ends.end();
+    }
+
+    size_t size() const {
+        return ends.size();
+    }
+
+private:
+    node root;
+
+    // owner -> node where its sequence ends
+    std::unordered_map<int32_t, node *> ends;
+
+    // follow the query down the tree, calling on_node(node, n_common, full) for each node that is entered
+    // returns the number of matched tokens
+    template <typename F>
+    size_t walk(const llama_tokens & tokens, F && on_node) const {
+        const node * cur = &root;
+
+        size_t i = 0;
+        while (i < tokens.size()) {
+            auto it = cur->children.find(tokens[i]);
+            if (it == cur->children.end()) {
+                break;
+            }
+
+            const node * child = it->second.get();
+
+            const size_t k = common_length(child->edge, tokens, i);
+            i += k;
+
+            const bool full = k == child->edge.size();
+
+            on_node(child, i, full);
+
+            if (!full) {
+                break;
+            }
+
+            cur = child;
+        }
+
+        return i;
+    }
+
+    static size_t common_length(const llama_tokens & edge, const llama_tokens & tokens, size_t offset) {
+        const size_t n = std::min(edge.size(), tokens.size() - offset);
+
+        size_t k = 0;
+        while (k < n && edge[k] == tokens[offset + k]) {
+            k++;
+        }
+
+        return k;
+    }
+};
+
 // Computes FNV-1a hash of the data
 static std::string fnv_hash(const uint8_t * data, size_t len) {
     const uint64_t fnv_prime = 0x100000001b3ULL;
@@ -1365,6 +1913,48 @@ static std::string fnv_hash(const uint8_t * data, size_t len) {
     return std::to_string(hash);
 }
 
+// cheap fingerprint of a (possibly very large) model file: its size and a FNV-1a hash of sampled chunks
+// - the first and the last MiB, and 64 chunks of 64 KiB spread evenly over the file
+static std::string model_file_fingerprint(const std::string & path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return "";
+    }
+
+    const uint64_t size = file.tellg();
+
+    const uint64_t fnv_prime = 0x100000001b3ULL;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    std::vector<char> buf;
+
+    const auto sample = [&](uint64_t offset, uint64_t n) {
+        n = std::min(n, size - offset);
+
+        buf.resize(n);
+        file.seekg(offset);
+        file.read(buf.data(), n);
+
+        for (std::streamsize i = 0; i < file.gcount(); ++i) {
+            hash ^= (uint8_t) buf[i];
+            hash *= fnv_prime;
+        }
+
+        file.clear();
+    };
+
+    sample(0, 1024*1024);
+    for (uint64_t i = 1; i < 64; ++i) {
+        sample(size/64*i, 64*1024);
+    }
+    sample(size - std::min<uint64_t>(size, 1024*1024), 1024*1024);
+
+    char res[64];
+    snprintf(res, sizeof(res), "%" PRIu64 "-%016" PRIx64, size, hash);
+
+    return res;
+}
+
 static server_tokens process_mtmd_prompt(mtmd_context * mctx, std::string prompt, std::vector<raw_buffer> files) {
     mtmd::bitmaps bitmaps;
     for (auto & file : files) {
@@ -0,0 +1,128 @@
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "histogram.h"
+
+static bool expect_near(double got, double expected, const char* what) {
+    if (std::fabs(got - expected) > 1e-9*std::max(1.0, std::fabs(expected))) {
+        std::cerr << what << ": " << got << " != " << expected << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool expect_line(const std::string& out, const std::string& line) {
+    if (out.find(line + "\n") == std::string::npos) {
+        std::cerr << "missing line '" << line << "' in:\n" << out << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    // bounds
+    {
+        const auto exp = Histogram::exponential(1.0, 2.0, 4);
+        const auto lin = Histogram::linear(0.1, 0.1, 3);
+        if (exp != std::vector<double>({ 1.0, 2.0, 4.0, 8.0 }) || lin.size() != 3 ||
+            !expect_near(lin[0], 0.1, "linear") || !expect_near(lin[2], 0.3, "linear")) {
+            std::cerr << "wrong bounds" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // an observation counts in the first bucket whose bound is greater or equal to it, the rest goes to +Inf
+    {
+        Histogram h({ 1.0, 2.0, 4.0 });
+        for (const double v : { 0.5, 1.0, 1.5, 2.0, 3.0, 4.0, 10.0 }) {
+            h.observe(v);
+        }
+
+        std::string out;
+        h.write_prometheus(out, "test", "help text");
+
+        if (h.count() != 7 ||
+            !expect_line(out, "# HELP test help text") ||
+            !expect_line(out, "# TYPE test histogram") ||
+            !expect_line(out, "test_bucket{le=\"1\"} 2") ||
+            !expect_line(out, "test_bucket{le=\"2\"} 4") ||
+            !expect_line(out, "test_bucket{le=\"4\"} 6") ||
+            !expect_line(out, "test_bucket{le=\"+Inf\"} 7") ||
+            !expect_line(out, "test_sum 22") ||
+            !expect_line(out, "test_count 7")) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // quantiles are interpolated inside the bucket, the observations past the last bound are reported at it
+    {
+        Histogram h({ 10.0, 20.0 });
+        if (!expect_near(h.quantile(0.5), 0.0, "empty quantile")) {
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            h.observe(5.0);
+            h.observe(15.0);
+        }
+        if (!expect_near(h.quantile(0.25), 5.0, "quantile 0.25") ||
+            !expect_near(h.quantile(0.5), 10.0, "quantile 0.5") ||
+            !expect_near(h.quantile(0.75), 15.0, "quantile 0.75")) {
+            return EXIT_FAILURE;
+        }
+
+        h.observe(100.0);
+        if (!expect_near(h.quantile(1.0), 20.0, "quantile 1.0")) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // observe() is called from several threads at once
+    {
+        Histogram h(Histogram::exponential(1.0, 2.0, 8));
+
+        const int n_threads = 4;
+        const int n_per_thread = 100000;
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < n_threads; ++t) {
+            threads.emplace_back([&h, t]() {
+                for (int i = 0; i < n_per_thread; ++i) {
+                    h.observe((double) ((i + t) % 300));
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        double sum = 0.0;
+        for (int t = 0; t < n_threads; ++t) {
+            for (int i = 0; i < n_per_thread; ++i) {
+                sum += (i + t) % 300;
+            }
+        }
+
+        std::string out;
+        h.write_prometheus(out, "mt", "concurrent");
+
+        if (h.count() != (uint64_t) n_threads*n_per_thread ||
+            !expect_line(out, "mt_count " + std::to_string(n_threads*n_per_thread)) ||
+            !expect_line(out, "mt_bucket{le=\"+Inf\"} " + std::to_string(n_threads*n_per_thread))) {
+            std::cerr << "lost observations" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        const size_t pos = out.find("mt_sum ");
+        if (pos == std::string::npos || !expect_near(std::stod(out.substr(pos + 7)), sum, "concurrent sum")) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::cout << "histogram: ok" << std::endl;
+    return EXIT_SUCCESS;
+}
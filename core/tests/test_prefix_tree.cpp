@@ -0,0 +1,136 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <set>
+
+#include "utils.hpp"
+
+// the tree is checked against a plain map of the sequences, after every insert and remove
+using sequences = std::map<int32_t, llama_tokens>;
+
+static size_t common_prefix(const llama_tokens& a, const llama_tokens& b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+static bool check(const server_prefix_tree& tree, const sequences& seqs, const llama_tokens& query) {
+    if (tree.size() != seqs.size()) {
+        std::cerr << "size: " << tree.size() << " != " << seqs.size() << std::endl;
+        return false;
+    }
+
+    std::map<int32_t, size_t> expected;
+    std::set<int32_t> expected_prefixes;
+    size_t n_common_max = 0;
+    for (const auto& [id, tokens] : seqs) {
+        const size_t n = common_prefix(tokens, query);
+        if (n > 0) {
+            expected[id] = n;
+        }
+        if (n == tokens.size()) {
+            expected_prefixes.insert(id);
+        }
+        n_common_max = std::max(n_common_max, n);
+    }
+
+    std::map<int32_t, size_t> found;
+    std::vector<int32_t> prefix_ids;
+    for (const auto& match : tree.find(query, &prefix_ids)) {
+        if (!found.emplace(match.id, match.n_common).second) {
+            std::cerr << "find: owner " << match.id << " returned twice" << std::endl;
+            return false;
+        }
+    }
+    if (found != expected) {
+        std::cerr << "find: wrong matches" << std::endl;
+        return false;
+    }
+
+    const auto prefixes = tree.find_prefixes(query);
+    if (std::set<int32_t>(prefixes.begin(), prefixes.end()) != expected_prefixes ||
+        std::set<int32_t>(prefix_ids.begin(), prefix_ids.end()) != expected_prefixes) {
+        std::cerr << "find_prefixes: wrong owners" << std::endl;
+        return false;
+    }
+
+    if (tree.n_common_max(query) != n_common_max) {
+        std::cerr << "n_common_max: " << tree.n_common_max(query) << " != " << n_common_max << std::endl;
+        return false;
+    }
+
+    for (const auto& [id, tokens] : seqs) {
+        size_t n_shared = 0;
+        for (const auto& [other, other_tokens] : seqs) {
+            if (other != id) {
+                n_shared = std::max(n_shared, common_prefix(tokens, other_tokens));
+            }
+        }
+        if (!tree.contains(id) || tree.n_shared(id) != n_shared) {
+            std::cerr << "n_shared: owner " << id << ", " << tree.n_shared(id) << " != " << n_shared << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main() {
+    std::mt19937 rng(42);
+
+    // a small vocabulary and a few common stems, so that the sequences share prefixes and the edges get split and merged
+    std::vector<llama_tokens> stems;
+    for (int i = 0; i < 4; ++i) {
+        llama_tokens stem(rng() % 40);
+        for (auto& t : stem) {
+            t = rng() % 4;
+        }
+        stems.push_back(stem);
+    }
+
+    const auto random_tokens = [&]() {
+        llama_tokens res = stems[rng() % stems.size()];
+        res.resize(rng() % (res.size() + 1));
+        for (size_t n = rng() % 30; n > 0; --n) {
+            res.push_back(rng() % 4);
+        }
+        return res;
+    };
+
+    server_prefix_tree tree;
+    sequences seqs;
+
+    for (int step = 0; step < 5000; ++step) {
+        const int32_t id = rng() % 16;
+
+        if (rng() % 4 == 0) {
+            tree.remove(id);
+            seqs.erase(id);
+        } else {
+            const llama_tokens tokens = random_tokens();
+            tree.insert(id, tokens);
+            if (tokens.empty()) {
+                seqs.erase(id);
+            } else {
+                seqs[id] = tokens;
+            }
+        }
+
+        if (!check(tree, seqs, random_tokens())) {
+            std::cerr << "failed at step " << step << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    tree.clear();
+    if (tree.size() != 0 || !tree.find({ 0, 1, 2 }).empty()) {
+        std::cerr << "clear: the tree is not empty" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "prefix tree: ok" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "state_codec.h"
+#include "thread_pool.h"
+
+// data that looks like a KV cache: f16 values with few distinct exponents, runs of zeros and random bytes
+static std::vector<uint8_t> make_data(size_t size, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+        const size_t part = (i * 4) / std::max<size_t>(size, 1);
+        switch (part) {
+            case 0:  data[i] = (i % 2) ? (uint8_t) (0x38 + rng() % 4) : (uint8_t) rng(); break;
+            case 1:  data[i] = 0; break;
+            case 2:  data[i] = (uint8_t) "abcdefgh"[rng() % 8]; break;
+            default: data[i] = (uint8_t) rng(); break;
+        }
+    }
+    return data;
+}
+
+static bool round_trip(size_t size, size_t width, size_t block_size, ThreadPool* pool) {
+    const auto data = make_data(size, (uint32_t) (size * 31 + width));
+    const auto enc = StateCodec::encode(data.data(), data.size(), width, pool, block_size);
+
+    if (StateCodec::decoded_size(enc.data(), enc.size()) != size) {
+        std::cerr << "decoded_size mismatch, size = " << size << ", width = " << width << std::endl;
+        return false;
+    }
+
+    std::vector<uint8_t> out;
+    if (!StateCodec::decode(enc.data(), enc.size(), out, pool) || out != data) {
+        std::cerr << "round trip failed, size = " << size << ", width = " << width << ", block size = " << block_size << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// corrupt inputs must be rejected (or decode to something) without reading or writing out of bounds
+static bool corrupt(ThreadPool* pool) {
+    const auto data = make_data(200000, 7);
+    const auto enc = StateCodec::encode(data.data(), data.size(), 2, pool, 65536);
+
+    std::vector<uint8_t> out;
+
+    for (size_t n = 0; n < enc.size(); n += 1 + n / 8) {
+        if (StateCodec::decode(enc.data(), n, out, pool)) {
+            std::cerr << "truncated input of " << n << " bytes was accepted" << std::endl;
+            return false;
+        }
+    }
+
+    std::mt19937 rng(1);
+    for (int i = 0; i < 500; ++i) {
+        auto bad = enc;
+        bad[rng() % bad.size()] ^= (uint8_t) (1u << (rng() % 8));
+        if (StateCodec::decode(bad.data(), bad.size(), out, pool) && out.size() != data.size()) {
+            std::cerr << "corrupt input decoded to a different size" << std::endl;
+            return false;
+        }
+    }
+
+    if (StateCodec::decoded_size(nullptr, 0) != 0) {
+        std::cerr << "empty input has a decoded size" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    ThreadPool pool(4);
+
+    for (ThreadPool* p : { (ThreadPool*) nullptr, &pool }) {
+        for (const size_t size : { 0, 1, 3, 64, 1000, 65536, 300001 }) {
+            for (const size_t width : { 1, 2, 4, 3 }) {
+                if (!round_trip(size, width, 65536, p)) {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+
+        if (!round_trip(5000000, 2, StateCodec::DEFAULT_BLOCK_SIZE, p) || !corrupt(p)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::cout << "state codec: ok" << std::endl;
+    return EXIT_SUCCESS;
+}
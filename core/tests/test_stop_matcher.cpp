@@ -0,0 +1,187 @@
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "stop_matcher.h"
+
+// the stop strings were searched with std::string::find over the end of the text (full stop) and
+// string_find_partial_stop() (partial stop), word by word - the matcher must find the same positions
+
+static size_t find_full_stop(const std::string& text, size_t last_piece_size, const std::vector<std::string>& words) {
+    size_t res = std::string::npos;
+    for (const auto& word : words) {
+        const size_t tmp = word.size() + last_piece_size;
+        const size_t pos = text.find(word, text.size() > tmp ? text.size() - tmp : 0);
+        res = std::min(res, pos);
+    }
+    return res;
+}
+
+static size_t find_partial_stop(const std::string& text, const std::vector<std::string>& words) {
+    size_t res = std::string::npos;
+    for (const auto& word : words) {
+        res = std::min(res, string_find_partial_stop(text, word));
+    }
+    return res;
+}
+
+// earliest match that ends in text[prev, text.size()) and starts at or after min_pos
+static size_t find_from(const std::string& text, size_t prev, size_t min_pos, const std::vector<std::string>& words) {
+    size_t res = std::string::npos;
+    for (const auto& word : words) {
+        for (size_t pos = text.find(word, min_pos); pos != std::string::npos; pos = text.find(word, pos + 1)) {
+            if (pos + word.size() > prev) {
+                res = std::min(res, pos);
+                break;
+            }
+        }
+    }
+    return res;
+}
+
+static bool expect(size_t got, size_t expected, const char* what, const std::string& text) {
+    if (got != expected) {
+        std::cerr << what << ": " << (long long) got << " != " << (long long) expected << ", text = '" << text << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// the cases that the old code and the matcher must agree on
+static bool test_fixed() {
+    {
+        StopMatcher m({ "</s>", "stop" });
+        const std::string text = "hello </s> world";
+        const size_t pos = m.feed(text);
+        if (!expect(pos, 6, "full", text) || m.word(0) != "</s>") {
+            return false;
+        }
+    }
+    {
+        // partial stop at the end of the text, then completed by the next piece
+        StopMatcher m({ "<|im_end|>" });
+        std::string text = "answer <|im_";
+        if (!expect(m.feed(text), std::string::npos, "no full", text) ||
+            !expect(m.partial(), find_partial_stop(text, { "<|im_end|>" }), "partial", text)) {
+            return false;
+        }
+        const std::string piece = "end|> more";
+        text += piece;
+        if (!expect(m.feed(piece), 7, "completed", text)) {
+            return false;
+        }
+    }
+    {
+        // overlapping words: the earliest start wins, whatever the order of the words
+        const std::vector<std::string> words = { "bcd", "abcde", "cd" };
+        StopMatcher m(words);
+        const std::string text = "xxabcdexx";
+        size_t word = 0;
+        if (!expect(m.feed(text.data(), text.size(), 0, &word), find_full_stop(text, text.size(), words), "overlap", text) ||
+            m.word(word) != "abcde") {
+            return false;
+        }
+    }
+    {
+        // a word that is a suffix of another one
+        const std::vector<std::string> words = { "aab", "ab" };
+        StopMatcher m(words);
+        const std::string text = "aaab";
+        if (!expect(m.feed(text), find_full_stop(text, text.size(), words), "suffix", text)) {
+            return false;
+        }
+    }
+    {
+        // min_pos skips the matches that start before it, also in the partial stop
+        StopMatcher m({ "ab" });
+        const std::string text = "ab ab a";
+        if (!expect(m.feed(text, 1), 3, "min_pos", text) ||
+            !expect(m.partial(0), 6, "partial", text) ||
+            !expect(m.partial(7), std::string::npos, "partial min_pos", text)) {
+            return false;
+        }
+    }
+    {
+        // empty words are ignored
+        StopMatcher m({ "", "x" });
+        if (!expect(m.feed("abc"), std::string::npos, "empty word", "abc") || !expect(m.feed("x"), 3, "empty word", "abcx")) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// random texts over a small alphabet, fed in random pieces like the tokens of a generation
+static bool test_random() {
+    std::mt19937 rng(1234);
+
+    const auto random_string = [&](size_t n) {
+        std::string s;
+        for (size_t i = 0; i < n; ++i) {
+            s += "abc"[rng() % 3];
+        }
+        return s;
+    };
+
+    for (int iter = 0; iter < 2000; ++iter) {
+        std::vector<std::string> words;
+        for (size_t n = 1 + rng() % 4; n > 0; --n) {
+            words.push_back(random_string(1 + rng() % 5));
+        }
+
+        StopMatcher m(words);
+
+        const std::string full = random_string(rng() % 60);
+        const size_t min_pos = rng() % 8;
+
+        std::string text;
+        while (text.size() < full.size()) {
+            const size_t n = std::min<size_t>(1 + rng() % 4, full.size() - text.size());
+            const size_t prev = text.size();
+            const std::string piece = full.substr(prev, n);
+            text += piece;
+
+            const size_t pos = m.feed(piece, min_pos);
+
+            if (!expect(pos, find_from(text, prev, min_pos, words), "min_pos", text)) {
+                return false;
+            }
+
+            // without a full stop in the piece (whatever min_pos), the old code looked for a partial stop
+            if (pos == std::string::npos && find_from(text, prev, 0, words) == std::string::npos) {
+                if (!expect(m.partial(), find_partial_stop(text, words), "partial", text)) {
+                    return false;
+                }
+            }
+
+            // the old search had no min_pos, it is compared when no match was skipped because of it
+            if (pos != std::string::npos) {
+                if (find_from(text, 0, 0, words) >= min_pos && !expect(pos, find_full_stop(text, n, words), "full", text)) {
+                    return false;
+                }
+                break;
+            }
+        }
+
+        m.reset();
+        if (m.consumed() != 0) {
+            std::cerr << "reset: consumed = " << m.consumed() << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main() {
+    if (!test_fixed() || !test_random()) {
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "stop matcher: ok" << std::endl;
+    return EXIT_SUCCESS;
+}
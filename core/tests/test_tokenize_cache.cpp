@@ -0,0 +1,105 @@
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "llama.h"
+#include "tokenize_cache.h"
+
+// the prompts that extend a cached one must get the tokens that the tokenizer gives for the whole text.
+// only the vocabulary of the model is loaded
+
+// reported to ctest as a skipped test
+static const int EXIT_SKIP = 77;
+
+int main() {
+    const char* env_model = "LLAMA_TEST_MODEL";
+    const char* model_path = std::getenv(env_model);
+
+    if (model_path == nullptr) {
+        std::cout << "skipped, set " << env_model << " to run the test" << std::endl;
+        return EXIT_SKIP;
+    }
+
+    llama_backend_init();
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+
+    llama_model* model = llama_model_load_from_file(model_path, mparams);
+    if (model == nullptr) {
+        std::cerr << "error: failed to load " << model_path << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+
+    // the turns of a chat are separated by special tokens, whatever the model they are given as text
+    std::vector<std::string> specials;
+    for (const llama_token tok : { llama_vocab_bos(vocab), llama_vocab_eos(vocab), llama_vocab_eot(vocab) }) {
+        if (tok != LLAMA_TOKEN_NULL) {
+            specials.push_back(common_token_to_piece(vocab, tok, true));
+        }
+    }
+
+    std::mt19937 rng(3);
+
+    const auto random_text = [&](size_t n) {
+        static const char* words[] = { "the", " cat", " sat", " on", " mat", ".", "\n", " 42", " über", " 中文", "  ", "!" };
+        std::string res;
+        while (res.size() < n) {
+            res += words[rng() % (sizeof(words) / sizeof(words[0]))];
+        }
+        return res;
+    };
+
+    TokenizeCache cache(4);
+
+    // a long system prompt shared by all the conversations, then turns that extend the previous prompt
+    const std::string system_prompt = random_text(1500);
+
+    int n_fail = 0;
+    for (int conv = 0; conv < 8 && n_fail == 0; ++conv) {
+        std::string text = system_prompt;
+
+        for (int turn = 0; turn < 6; ++turn) {
+            if (!specials.empty()) {
+                text += specials[rng() % specials.size()];
+            }
+            text += random_text(1 + rng() % 400);
+
+            const auto expected = common_tokenize(vocab, text, true, true);
+            const auto tokens = cache.tokenize(vocab, text);
+
+            if (tokens != expected) {
+                std::cerr << "conversation " << conv << ", turn " << turn << ": " << tokens.size()
+                          << " tokens, expected " << expected.size() << std::endl;
+                n_fail++;
+                break;
+            }
+        }
+    }
+
+    // a prompt that differs inside the cached text must not reuse anything after the difference
+    if (n_fail == 0) {
+        std::string text = random_text(2000);
+        cache.tokenize(vocab, text);
+        text[100] = text[100] == 'a' ? 'b' : 'a';
+        if (cache.tokenize(vocab, text) != common_tokenize(vocab, text, true, true)) {
+            std::cerr << "modified prompt: wrong tokens" << std::endl;
+            n_fail++;
+        }
+    }
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    if (n_fail > 0) {
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "tokenize cache: ok" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,57 @@
+#include <iostream>
+#include <cstdlib>
+#include <random>
+#include <string>
+
+#include "utils.hpp"
+
+// utf8_tail follows the text as it grows, it must tell that the text ends in the middle of a character
+// exactly when validate_utf8() stops short of the end of the text
+
+static std::string random_utf8(std::mt19937& rng, size_t n_chars) {
+    static const char* chars[] = { "a", " ", "\n", "\xc3\xa9", "\xd0\x96", "\xe4\xb8\xad", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xf0\x9f\x91\x8d" };
+
+    std::string res;
+    for (size_t i = 0; i < n_chars; ++i) {
+        res += chars[rng() % (sizeof(chars) / sizeof(chars[0]))];
+    }
+    return res;
+}
+
+int main() {
+    std::mt19937 rng(7);
+
+    for (int iter = 0; iter < 1000; ++iter) {
+        const std::string full = random_utf8(rng, rng() % 40);
+
+        utf8_tail tail;
+        std::string text;
+        while (text.size() < full.size()) {
+            // pieces of any size, cut anywhere like the pieces of the tokens
+            const size_t n = std::min<size_t>(1 + rng() % 5, full.size() - text.size());
+            const std::string piece = full.substr(text.size(), n);
+
+            text += piece;
+            tail.append(piece);
+
+            const bool incomplete = validate_utf8(text) < text.size();
+            if (tail.incomplete() != incomplete) {
+                std::cerr << "utf8_tail: incomplete = " << tail.incomplete() << ", expected " << incomplete
+                          << " after " << text.size() << " bytes" << std::endl;
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    // an empty text and plain ASCII are complete
+    utf8_tail tail;
+    tail.append("");
+    tail.append("abc");
+    if (tail.incomplete()) {
+        std::cerr << "utf8_tail: ASCII text is incomplete" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "utf8 tail: ok" << std::endl;
+    return EXIT_SUCCESS;
+}
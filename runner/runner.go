@@ -54,10 +54,10 @@ func (s *Service) IsRunning() bool {
 	return s.running
 }
 
-func (s *Service) Generate(id int, prompt string, stream bool) error {
-	return wrapper.LlamaGenerate(id, fmt.Sprintf("{\"prompt\":\"%s\",\"stream\":%v}", prompt, stream))
+func (s *Service) Generate(id int, prompt string, stream bool, traceID uint64) error {
+	return wrapper.LlamaGenerate(id, fmt.Sprintf("{\"prompt\":\"%s\",\"stream\":%v}", prompt, stream), traceID)
 }
 
-func (s *Service) Chat(id int, jsStr string) error {
-	return wrapper.LlamaChat(id, jsStr)
+func (s *Service) Chat(id int, jsStr string, traceID uint64) error {
+	return wrapper.LlamaChat(id, jsStr, traceID)
 }
@@ -39,6 +39,15 @@ func (s *API) Setup(r *gin.Engine) {
 	r.GET("/props", s.PropsHandler)
 	r.POST("/props", s.PropsChangeHandler)
 	r.GET("/slots", s.SlotsHandler)
+	r.GET("/metrics", s.MetricsHandler)
+	r.GET("/trace", s.TraceHandler)
+	r.GET("/cache", s.PromptCacheHandler)
+	r.POST("/cache/pins", s.PromptCachePinHandler)
+	r.DELETE("/cache/pins/:name", s.PromptCacheUnpinHandler)
+	r.GET("/sessions", s.SessionsHandler)
+	r.POST("/sessions", s.SessionCreateHandler)
+	r.DELETE("/sessions/:id", s.SessionDeleteHandler)
+	r.POST("/sessions/:id/chat", s.SessionChatHandler)
 
 	r.POST("/api/generate", s.GenerateHandler)
 	r.POST("/api/chat", s.ChatHandler)
@@ -10,6 +10,7 @@ import (
 	"io"
 	"net/http"
 	"slices"
+	"strconv"
 	"strings"
 	"time"
 
@@ -118,8 +119,9 @@ func (s *API) GenerateHandler(c *gin.Context) {
 	if req.Stream != nil {
 		stream = *req.Stream
 	}
+	traceID := requestTraceID(c, id)
 	go func() {
-		err = s.runnerSer.Generate(id, req.Prompt, stream)
+		err = s.runnerSer.Generate(id, req.Prompt, stream, traceID)
 		if err != nil {
 			log.Warn(err.Error())
 			return
@@ -175,8 +177,9 @@ func (s *API) ChatHandler(c *gin.Context) {
 		c.JSON(http.StatusInternalServerError, gin.H{"error": "task id error"})
 		return
 	}
+	traceID := requestTraceID(c, id)
 	go func() {
-		err = s.runnerSer.Chat(id, bodyStr)
+		err = s.runnerSer.Chat(id, bodyStr, traceID)
 		if err != nil {
 			log.Warn(err.Error())
 			return
@@ -404,3 +407,169 @@ func (s *API) SlotsHandler(c *gin.Context) {
 	}
 	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
 }
+
+func (s *API) MetricsHandler(c *gin.Context) {
+	text, err := wrapper.GetMetrics()
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "text/plain; version=0.0.4", []byte(text))
+}
+
+// requestTraceID returns the trace id given by the X-Trace-Id header, or the id of the request channel.
+// The id is sent back in the X-Trace-Id header of the response so that GET /trace can find the spans
+func requestTraceID(c *gin.Context, id int) uint64 {
+	traceID := uint64(id)
+	if h := c.GetHeader("X-Trace-Id"); len(h) > 0 {
+		if v, err := strconv.ParseUint(h, 10, 64); err == nil && v != 0 {
+			traceID = v
+		}
+	}
+	c.Header("X-Trace-Id", strconv.FormatUint(traceID, 10))
+	return traceID
+}
+
+// TraceHandler dumps the recorded spans in the Chrome trace event format (chrome://tracing, ui.perfetto.dev),
+// the trace_id query selects the spans of one request
+func (s *API) TraceHandler(c *gin.Context) {
+	var traceID uint64
+	if q := c.Query("trace_id"); len(q) > 0 {
+		v, err := strconv.ParseUint(q, 10, 64)
+		if err != nil {
+			c.AbortWithStatusJSON(http.StatusBadRequest, gin.H{"error": "invalid trace_id"})
+			return
+		}
+		traceID = v
+	}
+
+	jsonStr, err := wrapper.GetTrace(traceID)
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
+}
+
+func (s *API) PromptCacheHandler(c *gin.Context) {
+	jsonStr, err := wrapper.GetPromptCache()
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
+}
+
+func (s *API) PromptCachePinHandler(c *gin.Context) {
+	bodyBytes, err := c.GetRawData()
+	if err != nil {
+		c.JSON(http.StatusBadRequest, gin.H{"error": err.Error()})
+		return
+	}
+	jsonStr, err := wrapper.PromptCachePin(string(bodyBytes))
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
+}
+
+func (s *API) PromptCacheUnpinHandler(c *gin.Context) {
+	jsonStr, err := wrapper.PromptCacheUnpin(c.Param("name"))
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
+}
+
+func (s *API) SessionsHandler(c *gin.Context) {
+	jsonStr, err := wrapper.GetSessions()
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
+}
+
+func (s *API) SessionCreateHandler(c *gin.Context) {
+	bodyBytes, err := c.GetRawData()
+	if err != nil {
+		c.JSON(http.StatusBadRequest, gin.H{"error": err.Error()})
+		return
+	}
+	jsonStr, err := wrapper.SessionCreate(string(bodyBytes))
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
+}
+
+func (s *API) SessionDeleteHandler(c *gin.Context) {
+	jsonStr, err := wrapper.SessionDelete(c.Param("id"))
+	if err != nil {
+		c.AbortWithStatusJSON(http.StatusInternalServerError, gin.H{"error": err.Error()})
+		return
+	}
+	c.Data(http.StatusOK, "application/json; charset=utf-8", []byte(jsonStr))
+}
+
+// SessionChatHandler runs a turn of a session, the body is a chat request with the new messages only
+func (s *API) SessionChatHandler(c *gin.Context) {
+	bodyBytes, err := c.GetRawData()
+	if err != nil {
+		c.JSON(http.StatusBadRequest, gin.H{"error": err.Error()})
+		return
+	}
+
+	var req struct {
+		Stream *bool `json:"stream,omitempty"`
+	}
+	if len(bodyBytes) <= 0 {
+		c.AbortWithStatusJSON(http.StatusBadRequest, gin.H{"error": "missing request body"})
+		return
+	} else if err := json.Unmarshal(bodyBytes, &req); err != nil {
+		c.AbortWithStatusJSON(http.StatusBadRequest, gin.H{"error": err.Error()})
+		return
+	}
+
+	id, ch := wrapper.NewChan()
+	if id == 0 {
+		c.JSON(http.StatusInternalServerError, gin.H{"error": "task id error"})
+		return
+	}
+	sessionID := c.Param("id")
+	traceID := requestTraceID(c, id)
+	go func() {
+		err = wrapper.LlamaSessionChat(id, sessionID, string(bodyBytes), traceID)
+		if err != nil {
+			log.Warn(err.Error())
+			return
+		}
+	}()
+
+	if req.Stream == nil || !*req.Stream {
+		content := ""
+		for rr := range ch {
+			str, ok := rr.(string)
+			if !ok {
+				continue
+			}
+			content += str
+		}
+		if len(content) <= 0 {
+			c.JSON(http.StatusInternalServerError, gin.H{"error": "no content"})
+			return
+		}
+		var ret map[string]interface{}
+		if err := json.Unmarshal([]byte(content), &ret); err != nil {
+			c.JSON(http.StatusInternalServerError, gin.H{"error": "invalid json"})
+			return
+		}
+		c.JSON(http.StatusOK, ret)
+
+		return
+	}
+	streamHandler(c, ch)
+}
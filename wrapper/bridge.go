@@ -9,6 +9,7 @@ import "C"
 import (
 	"fmt"
 	"math"
+	"os"
 	"sync"
 	"unsafe"
 
@@ -48,7 +49,7 @@ func LlamaStopInteractive() error {
 	return nil
 }
 
-func LlamaGenerate(id int, jsStr string) error {
+func LlamaGenerate(id int, jsStr string, traceID uint64) error {
 	if len(jsStr) <= 0 {
 		return fmt.Errorf("json string")
 	}
@@ -56,21 +57,21 @@ func LlamaGenerate(id int, jsStr string) error {
 	js := C.CString(jsStr)
 	defer C.free(unsafe.Pointer(js))
 
-	ret := C.llama_gen(C.int(id), js)
+	ret := C.llama_gen(C.int(id), js, C.ulonglong(traceID))
 	if !bool(ret.ret) {
 		return fmt.Errorf("Llama run error")
 	}
 	return nil
 }
 
-func LlamaChat(id int, jsStr string) error {
+func LlamaChat(id int, jsStr string, traceID uint64) error {
 	if len(jsStr) <= 0 {
 		return fmt.Errorf("json string")
 	}
 	js := C.CString(jsStr)
 	defer C.free(unsafe.Pointer(js))
 
-	ret := C.llama_chat(C.int(id), js)
+	ret := C.llama_chat(C.int(id), js, C.ulonglong(traceID))
 	if !bool(ret.ret) {
 		return fmt.Errorf("Llama run error")
 	}
@@ -81,6 +82,11 @@ func LlamaStart(cfg *config.Config) error {
 	if !cfg.HasModel() {
 		return fmt.Errorf("No model")
 	}
+	for name, value := range cfg.ServerEnv() {
+		if err := os.Setenv(name, value); err != nil {
+			return err
+		}
+	}
 	cfgArgs := assemblyArgs(cfg)
 	ca := C.CString(cfgArgs)
 	defer C.free(unsafe.Pointer(ca))
@@ -214,6 +220,138 @@ func GetSlots() (string, error) {
 	return content, nil
 }
 
+func GetMetrics() (string, error) {
+	ret := C.get_metrics()
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Llama run error")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+// GetTrace returns the spans of a request in the Chrome trace event format, all the spans if traceID is 0
+func GetTrace(traceID uint64) (string, error) {
+	ret := C.get_trace(C.ulonglong(traceID))
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Tracing is disabled, set LLAMA_SERVER_TRACE")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+func GetPromptCache() (string, error) {
+	ret := C.get_prompt_cache()
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Llama run error")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+func PromptCachePin(jsStr string) (string, error) {
+	if len(jsStr) <= 0 {
+		return "", fmt.Errorf("json string")
+	}
+	js := C.CString(jsStr)
+	defer C.free(unsafe.Pointer(js))
+
+	ret := C.prompt_cache_pin(js)
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Llama run error")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+func PromptCacheUnpin(name string) (string, error) {
+	if len(name) <= 0 {
+		return "", fmt.Errorf("No pin name")
+	}
+	cn := C.CString(name)
+	defer C.free(unsafe.Pointer(cn))
+
+	ret := C.prompt_cache_unpin(cn)
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Llama run error")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+func SessionCreate(jsStr string) (string, error) {
+	if len(jsStr) <= 0 {
+		jsStr = "{}"
+	}
+	js := C.CString(jsStr)
+	defer C.free(unsafe.Pointer(js))
+
+	ret := C.session_create(js)
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Llama run error")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+func SessionDelete(sessionID string) (string, error) {
+	if len(sessionID) <= 0 {
+		return "", fmt.Errorf("No session id")
+	}
+	sid := C.CString(sessionID)
+	defer C.free(unsafe.Pointer(sid))
+
+	ret := C.session_delete(sid)
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Llama run error")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+func GetSessions() (string, error) {
+	ret := C.get_sessions()
+	if !bool(ret.ret) {
+		return "", fmt.Errorf("Llama run error")
+	}
+
+	content := C.GoString(ret.content)
+	C.free(unsafe.Pointer(ret.content))
+	return content, nil
+}
+
+func LlamaSessionChat(id int, sessionID string, jsStr string, traceID uint64) error {
+	if len(sessionID) <= 0 {
+		return fmt.Errorf("No session id")
+	}
+	if len(jsStr) <= 0 {
+		return fmt.Errorf("json string")
+	}
+	sid := C.CString(sessionID)
+	defer C.free(unsafe.Pointer(sid))
+	js := C.CString(jsStr)
+	defer C.free(unsafe.Pointer(js))
+
+	ret := C.llama_session_chat(C.int(id), sid, js, C.ulonglong(traceID))
+	if !bool(ret.ret) {
+		return fmt.Errorf("Llama run error")
+	}
+	return nil
+}
+
 func assemblyArgs(cfg *config.Config) string {
 	cfgArgs := "llama"
 	if len(cfg.ModelPath()) > 0 {